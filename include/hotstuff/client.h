@@ -34,19 +34,28 @@ struct MsgReqCmd {
 
 struct MsgRespCmd {
     static const opcode_t opcode = 0x5;
+    static const uint8_t STATUS_OK = 0;
+    /** the replica had no room for the command: try again later */
+    static const uint8_t STATUS_BUSY = 1;
     DataStream serialized;
 #if HOTSTUFF_CMD_RESPSIZE > 0
     uint8_t payload[HOTSTUFF_CMD_RESPSIZE];
 #endif
     Finality fin;
-    MsgRespCmd(const Finality &fin) {
-        serialized << fin;
+    uint8_t status;
+    /** how many more commands the replica would take right now */
+    uint32_t credit;
+    MsgRespCmd(const Finality &fin,
+            uint8_t status = STATUS_OK,
+            uint32_t credit = UINT32_MAX) {
+        serialized << fin << status << htole(credit);
 #if HOTSTUFF_CMD_RESPSIZE > 0
         serialized.put_data(payload, payload + sizeof(payload));
 #endif
     }
     MsgRespCmd(DataStream &&s) {
-        s >> fin;
+        s >> fin >> status >> credit;
+        credit = letoh(credit);
     }
 };
 
@@ -95,6 +104,8 @@ class CommandDummy: public Command {
         return hash;
     }
 
+    uint32_t get_cid() const { return cid; }
+
     bool verify() const override {
         return true;
     }
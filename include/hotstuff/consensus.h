@@ -19,6 +19,9 @@
 #define _HOTSTUFF_CONSENSUS_H
 
 #include <cassert>
+#include <deque>
+#include <map>
+#include <queue>
 #include <set>
 #include <unordered_map>
 
@@ -36,7 +39,10 @@ struct Blame;
 struct BlameNotify;
 struct Finality;
 struct Notify;
+struct Snapshot;
 
+/** how many of the blocks released by pruning are remembered as such */
+const size_t blk_pruned_max = 1 << 16;
 
 
 
@@ -47,7 +53,7 @@ class HotStuffCore {
     /** block containing the QC for the highest block having one */
     std::pair<block_t, quorum_cert_bt> hqc;   /**< highest QC */
     std::pair<block_t, quorum_cert_bt> hqc_ancestor;   /**< highest responsive ancestor */
-    block_t b_exec;                            /**< last executed block */
+    block_t b_exec;                            /**< last committed block */
     uint32_t vheight;          /**< height of the block last voted for */
     uint32_t view;             /**< the current view number */
     /* Q: does the proposer retry the same block in a new view? */
@@ -65,6 +71,18 @@ class HotStuffCore {
     ReplicaConfig config;                   /**< replica configuration */
     /* === async event queues === */
     std::unordered_map<block_t, promise_t> qc_waiting;
+    /** committed blocks whose execution waits for a body, in order */
+    std::queue<block_t> exec_waiting;
+    /** proposals voted for once is_vote_ready() turns true */
+    std::unordered_set<block_t> vote_waiting;
+    /** delivered blocks not committed yet, by height */
+    std::multimap<uint32_t, block_t> undecided;
+    /** abandoned blocks still referred to from elsewhere, to release later */
+    std::unordered_set<uint256_t> gc_pinned;
+    /** the blocks prune() released last, oldest first: not to be fetched
+     * again for a late fork or a stale message */
+    std::unordered_set<uint256_t> pruned;
+    std::deque<uint256_t> pruned_order;
     promise_t propose_waiting;
     promise_t receive_proposal_waiting;
     promise_t hqc_update_waiting;
@@ -78,6 +96,12 @@ class HotStuffCore {
     block_t get_delivered_blk(const uint256_t &blk_hash);
     void sanity_check_delivered(const block_t &blk);
     void check_commit(const block_t &_hqc);
+    void exec_committed();
+    void gc_forks();
+    void release_abandoned(const block_t &blk);
+    /** Release an abandoned (or pruned) block from the storage, then cut
+     * its links; false if something still holds it. */
+    bool try_release(const block_t &blk);
     bool update_hqc(const block_t &_hqc, const quorum_cert_bt &qc, const block_t &hva_blk, const quorum_cert_bt &hva_qc);
     void on_hqc_update();
     void on_qc_finish(const block_t &blk);
@@ -118,6 +142,20 @@ class HotStuffCore {
      * @return true if valid */
     bool on_deliver_blk(const block_t &blk);
 
+    /** Call to hand over the body of a block delivered header-only. The
+     * user should ensure `cmds` matches the block's body digest. Committed
+     * blocks are executed only once their bodies (and those of the blocks
+     * committed before them) are delivered. */
+    void on_deliver_body(const block_t &blk, std::vector<uint256_t> &&cmds);
+
+    /** Call once is_payload_ready() may have turned true for the next
+     * committed block, to resume the execution. */
+    void on_payload_ready() { exec_committed(); }
+
+    /** Call once is_vote_ready() may have turned true for a proposal, to
+     * cast the votes held back. */
+    void on_vote_ready();
+
     /** Call upon the delivery of a proposal message.
      * The block mentioned in the message should be already delivered. */
     void on_receive_proposal(const Proposal &prop);
@@ -130,6 +168,27 @@ class HotStuffCore {
     void on_receive_blame(const Blame &blame);
     void on_receive_blamenotify(const BlameNotify &blame);
     void on_receive_new_view(const Status &status);
+
+    /* Cheap checks, based only on the current state, of whether a message
+     * could still change anything. They let the user drop a message before
+     * paying for its signature verification. A message that passes may
+     * still be ignored later by the corresponding on_receive_*(). */
+    /** Whether `vote.voter` is a known replica that has not voted for the
+     * block yet, and the block still lacks a responsive QC. */
+    bool is_vote_useful(const Vote &vote) const;
+    /** Whether the block is not committed yet. */
+    bool is_notify_useful(const Notify &notify) const;
+    /** Whether `blame.blamer` is a known replica that has not blamed yet,
+     * and the blame quorum is not complete. */
+    bool is_blame_useful(const Blame &blame) const;
+
+    /** Call to jump to a checkpoint taken by other replicas: the snapshot
+     * block becomes the last executed block and the only tail, with its
+     * ancestors left unknown. The snapshot must have been checked (see
+     * Snapshot::verify) and be higher than the last executed block.
+     * @return true if installed */
+    bool install_snapshot(const Snapshot &snap);
+
     void on_commit_timeout(const block_t &blk);
     void on_blame_timeout();
     void on_viewtrans_timeout();
@@ -154,6 +213,23 @@ class HotStuffCore {
     /** Called by HotStuffCore upon the decision being made for cmd. */
     virtual void do_decide(Finality &&fin) = 0;
     virtual void do_consensus(const block_t &blk) = 0;
+    /** Called by HotStuffCore after each committed block is executed, in
+     * order. `certified` tells whether blk->self_qc is a complete QC for
+     * it. */
+    virtual void do_commit(const block_t &, bool /*certified*/) {}
+    /** Called by HotStuffCore for each block on a fork that can no longer
+     * be committed, before it is released. */
+    virtual void do_abandon(const block_t &) {}
+    /** Called by HotStuffCore for each committed block a snapshot covers
+     * that was not executed here, in order. */
+    virtual void do_skip(const block_t &) {}
+    /** Called by HotStuffCore before executing a committed block (with its
+     * body delivered): the execution waits while it returns false, until
+     * on_payload_ready(). */
+    virtual bool is_payload_ready(const block_t &) { return true; }
+    /** Called by HotStuffCore before voting for a proposal: the vote waits
+     * while it returns false, until on_vote_ready(). */
+    virtual bool is_vote_ready(const block_t &) { return true; }
     /** Called by HotStuffCore upon broadcasting a new proposal.
      * The user should send the proposal message to all replicas except for
      * itself. */
@@ -187,6 +263,12 @@ class HotStuffCore {
     virtual quorum_cert_bt create_quorum_cert(const uint256_t &blk_hash) = 0;
     /** Create a quorum certificate from its serialized form. */
     virtual quorum_cert_bt parse_quorum_cert(DataStream &s) = 0;
+    /** Create a partial certificate from its compact form, whose obj_hash is
+     * supplied by the caller. */
+    virtual part_cert_bt parse_part_cert_compact(DataStream &s, const uint256_t &obj_hash) = 0;
+    /** Create a quorum certificate from its compact form, whose obj_hash is
+     * supplied by the caller. */
+    virtual quorum_cert_bt parse_quorum_cert_compact(DataStream &s, const uint256_t &obj_hash) = 0;
     /** Create a command object from its serialized form. */
     //virtual command_t parse_cmd(DataStream &s) = 0;
 
@@ -196,6 +278,11 @@ class HotStuffCore {
     void add_replica(ReplicaID rid, const NetAddr &addr, pubkey_bt &&pub_key);
     /** Try to prune blocks lower than last committed height - staleness. */
     void prune(uint32_t staleness);
+    /** Whether the block is one of the most recent ones released by
+     * prune(), so that it is not to be fetched again. */
+    bool is_blk_pruned(const uint256_t &blk_hash) const {
+        return pruned.count(blk_hash);
+    }
 
     /* PaceMaker can use these functions to monitor the core protocol state
      * transition */
@@ -217,9 +304,12 @@ class HotStuffCore {
     /* Other useful functions */
     const block_t &get_genesis() { return b0; }
     const block_t &get_hqc() { return hqc.first; }
+    const block_t &get_b_exec() const { return b_exec; }
     const ReplicaConfig &get_config() { return config; }
     ReplicaID get_id() const { return id; }
     const std::set<block_t, BlockHeightCmp> get_tails() const { return tails; }
+    /** abandoned blocks that could not be released yet */
+    size_t get_gc_pinned_size() const { return gc_pinned.size(); }
     uint32_t get_view() const { return view; }
     operator std::string () const;
     void set_vote_disabled(bool f) { vote_disabled = f; }
@@ -260,11 +350,50 @@ struct Proposal: public Serializable {
     }
 
     inline void unserialize(DataStream &s) override {
+        decode(s);
+        blk = hsc->storage->add_blk(blk);
+    }
+
+    /** Parse without adding the block to `hsc->storage`, so it can run off
+     * the event loop. */
+    void decode(DataStream &s) {
         assert(hsc != nullptr);
         s >> proposer;
         Block _blk;
         _blk.unserialize(s, hsc);
-        blk = hsc->storage->add_blk(std::move(_blk), hsc->get_config());
+        blk = new Block(std::move(_blk));
+    }
+
+    void serialize_compact(DataStream &s) const {
+        put_varint(s, proposer);
+        blk->serialize_compact(s);
+    }
+
+    void unserialize_compact(DataStream &s) {
+        decode_compact(s);
+        blk = hsc->storage->add_blk(blk);
+    }
+
+    void decode_compact(DataStream &s) {
+        assert(hsc != nullptr);
+        proposer = get_varint(s);
+        Block _blk;
+        _blk.unserialize_compact(s, hsc);
+        blk = new Block(std::move(_blk));
+    }
+
+    /** Like the compact form, but with the block header only. */
+    void serialize_header(DataStream &s) const {
+        put_varint(s, proposer);
+        blk->serialize_header(s);
+    }
+
+    void decode_header(DataStream &s) {
+        assert(hsc != nullptr);
+        proposer = get_varint(s);
+        Block _blk;
+        _blk.unserialize_header(s, hsc);
+        blk = new Block(std::move(_blk));
     }
 
     operator std::string () const {
@@ -283,23 +412,27 @@ struct Vote: public Serializable {
     uint256_t blk_hash;
     /** proof of validity for the vote */
     part_cert_bt cert;
+    /** whether cert's obj_hash is already known to match (set by the
+     * decode stage, so verify() only has to check the signature) */
+    bool obj_hash_checked;
     
     /** handle of the core object to allow polymorphism */
     HotStuffCore *hsc;
 
-    Vote(): cert(nullptr), hsc(nullptr) {}
+    Vote(): cert(nullptr), obj_hash_checked(false), hsc(nullptr) {}
     Vote(ReplicaID voter,
         const uint256_t &blk_hash,
         part_cert_bt &&cert,
         HotStuffCore *hsc):
         voter(voter),
         blk_hash(blk_hash),
-        cert(std::move(cert)), hsc(hsc) {}
+        cert(std::move(cert)), obj_hash_checked(false), hsc(hsc) {}
 
     Vote(const Vote &other):
         voter(other.voter),
         blk_hash(other.blk_hash),
         cert(other.cert ? other.cert->clone() : nullptr),
+        obj_hash_checked(other.obj_hash_checked),
         hsc(other.hsc) {}
 
     Vote(Vote &&other) = default;
@@ -314,12 +447,30 @@ struct Vote: public Serializable {
         cert = hsc->parse_part_cert(s);
     }
 
+    /** The cert always proves proof_obj_hash(blk_hash), so it is elided. */
+    void serialize_compact(DataStream &s) const {
+        put_varint(s, voter);
+        s << blk_hash;
+        cert->serialize_compact(s);
+    }
+
+    void unserialize_compact(DataStream &s) {
+        assert(hsc != nullptr);
+        voter = get_varint(s);
+        s >> blk_hash;
+        cert = hsc->parse_part_cert_compact(s, proof_obj_hash(blk_hash));
+    }
+
     static uint256_t proof_obj_hash(const uint256_t &blk_hash) {
         DataStream p;
         p << (uint8_t)ProofType::VOTE << blk_hash;
         return p.get_hash();
     }
 
+    bool check_obj_hash() {
+        return obj_hash_checked = cert->get_obj_hash() == proof_obj_hash(blk_hash);
+    }
+
     bool verify() const {
         assert(hsc != nullptr);
         return cert->verify(hsc->get_config().get_pubkey(voter)) &&
@@ -329,7 +480,8 @@ struct Vote: public Serializable {
     promise_t verify(VeriPool &vpool) const {
         assert(hsc != nullptr);
         return cert->verify(hsc->get_config().get_pubkey(voter), vpool).then([this](bool result) {
-            return result && cert->get_obj_hash() == proof_obj_hash(blk_hash);
+            return result && (obj_hash_checked ||
+                cert->get_obj_hash() == proof_obj_hash(blk_hash));
         });
     }
 
@@ -346,22 +498,26 @@ struct Vote: public Serializable {
 struct Notify: public Serializable {
     uint256_t blk_hash;
     quorum_cert_bt qc;
+    /** whether qc's obj_hash is already known to match */
+    bool obj_hash_checked;
 
     /** handle of the core object to allow polymorphism */
     HotStuffCore *hsc;
 
-    Notify(): qc(nullptr), hsc(nullptr) {}
+    Notify(): qc(nullptr), obj_hash_checked(false), hsc(nullptr) {}
     Notify(ReplicaID notifier,
            const uint256_t blk_hash,
            quorum_cert_bt &&qc,
            HotStuffCore *hsc):
             blk_hash(blk_hash),
             qc(std::move(qc)),
+            obj_hash_checked(false),
             hsc(hsc) {}
 
     Notify(const Notify &other):
             blk_hash(other.blk_hash),
             qc(other.qc ? other.qc->clone() : nullptr),
+            obj_hash_checked(other.obj_hash_checked),
             hsc(other.hsc) {}
 
     Notify(Notify &&other) = default;
@@ -375,6 +531,10 @@ struct Notify: public Serializable {
         qc = hsc->parse_quorum_cert(s);
     }
 
+    bool check_obj_hash() {
+        return obj_hash_checked = qc->get_obj_hash() == Vote::proof_obj_hash(blk_hash);
+    }
+
     bool verify() const {
         assert(hsc != nullptr);
         return qc->verify(hsc->get_config()) &&
@@ -385,7 +545,8 @@ struct Notify: public Serializable {
         assert(hsc != nullptr);
 
         return qc->verify(hsc->get_config(), vpool).then([this](bool result) {
-            return result && qc->get_obj_hash() == Vote::proof_obj_hash(blk_hash);
+            return result && (obj_hash_checked ||
+                qc->get_obj_hash() == Vote::proof_obj_hash(blk_hash));
         });
     }
 
@@ -405,12 +566,14 @@ struct Status: public Serializable {
     uint256_t responsive_ancestor_blk_hash; // highest-view-v-responsive ancestor
 
     quorum_cert_bt responsive_ancestor_qc;
+    /** whether hqc's obj_hash is already known to match */
+    bool obj_hash_checked;
     /** handle of the core object to allow polymorphism */
     HotStuffCore *hsc;
 
     ReplicaID sender;
 
-    Status(): hqc(nullptr), responsive_ancestor_qc(nullptr), hsc(nullptr) {}
+    Status(): hqc(nullptr), responsive_ancestor_qc(nullptr), obj_hash_checked(false), hsc(nullptr) {}
     Status(const uint256_t hqc_blk_hash,
            quorum_cert_bt &&hqc,
            const uint256_t responsive_ancestor_blk_hash,
@@ -420,6 +583,7 @@ struct Status: public Serializable {
             hqc(std::move(hqc)),
             responsive_ancestor_blk_hash(responsive_ancestor_blk_hash),
             responsive_ancestor_qc(std::move(responsive_ancestor_qc)),
+            obj_hash_checked(false),
             hsc(hsc), sender(sender) {}
 
     Status(const Status &other):
@@ -427,6 +591,7 @@ struct Status: public Serializable {
             hqc(other.hqc ? other.hqc->clone() : nullptr),
             responsive_ancestor_blk_hash(other.responsive_ancestor_blk_hash),
             responsive_ancestor_qc(other.responsive_ancestor_qc ? other.responsive_ancestor_qc->clone() : nullptr),
+            obj_hash_checked(other.obj_hash_checked),
             hsc(other.hsc), sender(other.sender) {}
 
     Status(Status &&other) = default;
@@ -442,6 +607,42 @@ struct Status: public Serializable {
         responsive_ancestor_qc = hsc->parse_quorum_cert(s);
     }
 
+    /** Both QCs prove the votes for the hashes they follow, and the
+     * responsive ancestor is only present when its hash is set. */
+    void serialize_compact(DataStream &s) const {
+        s << hqc_blk_hash;
+        hqc->serialize_compact(s);
+        if (!responsive_ancestor_blk_hash.is_null() && responsive_ancestor_qc)
+        {
+            s << (uint8_t)1 << responsive_ancestor_blk_hash;
+            responsive_ancestor_qc->serialize_compact(s);
+        }
+        else
+            s << (uint8_t)0;
+    }
+
+    void unserialize_compact(DataStream &s) {
+        uint8_t flag;
+        s >> hqc_blk_hash;
+        hqc = hsc->parse_quorum_cert_compact(s, Vote::proof_obj_hash(hqc_blk_hash));
+        s >> flag;
+        if (flag)
+        {
+            s >> responsive_ancestor_blk_hash;
+            responsive_ancestor_qc = hsc->parse_quorum_cert_compact(s,
+                Vote::proof_obj_hash(responsive_ancestor_blk_hash));
+        }
+        else
+        {
+            responsive_ancestor_blk_hash = uint256_t();
+            responsive_ancestor_qc = nullptr;
+        }
+    }
+
+    bool check_obj_hash() {
+        return obj_hash_checked = hqc->get_obj_hash() == Vote::proof_obj_hash(hqc_blk_hash);
+    }
+
     bool verify() const {
         assert(hsc != nullptr);
         return hqc->verify(hsc->get_config()) &&
@@ -451,7 +652,8 @@ struct Status: public Serializable {
     promise_t verify(VeriPool &vpool) const {
         assert(hsc != nullptr);
         return hqc->verify(hsc->get_config(), vpool).then([this](bool result) {
-            return result && hqc->get_obj_hash() == Vote::proof_obj_hash(hqc_blk_hash);
+            return result && (obj_hash_checked ||
+                hqc->get_obj_hash() == Vote::proof_obj_hash(hqc_blk_hash));
         });
     }
 
@@ -471,11 +673,13 @@ struct Blame: public Serializable {
 
     // A quick hack to indicate blame due to equivocation. Setting this flag makes a replica quit view immediately!
     bool equiv;
+    /** whether cert's obj_hash is already known to match */
+    bool obj_hash_checked;
 
     /** handle of the core object to allow polymorphism */
     HotStuffCore *hsc;
 
-    Blame(): cert(nullptr), equiv(false), hsc(nullptr) {}
+    Blame(): cert(nullptr), equiv(false), obj_hash_checked(false), hsc(nullptr) {}
     Blame(ReplicaID blamer,
         uint32_t view,
         part_cert_bt &&cert,
@@ -484,13 +688,14 @@ struct Blame: public Serializable {
         blamer(blamer),
         view(view),
         cert(std::move(cert)),
-        equiv(equiv), hsc(hsc) {}
+        equiv(equiv), obj_hash_checked(false), hsc(hsc) {}
 
     Blame(const Blame &other):
         blamer(other.blamer),
         view(other.view),
         cert(other.cert ? other.cert->clone() : nullptr),
         equiv(other.equiv),
+        obj_hash_checked(other.obj_hash_checked),
         hsc(other.hsc) {}
 
     Blame(Blame &&other) = default;
@@ -511,6 +716,10 @@ struct Blame: public Serializable {
         return p.get_hash();
     }
 
+    bool check_obj_hash() {
+        return obj_hash_checked = cert->get_obj_hash() == proof_obj_hash(view);
+    }
+
     bool verify() const {
         assert(hsc != nullptr);
         return cert->verify(hsc->get_config().get_pubkey(blamer)) &&
@@ -520,7 +729,8 @@ struct Blame: public Serializable {
     promise_t verify(VeriPool &vpool) const {
         assert(hsc != nullptr);
         return cert->verify(hsc->get_config().get_pubkey(blamer), vpool).then([this](bool result) {
-            return result && cert->get_obj_hash() == proof_obj_hash(view);
+            return result && (obj_hash_checked ||
+                cert->get_obj_hash() == proof_obj_hash(view));
         });
     }
 
@@ -648,6 +858,111 @@ struct Finality: public Serializable {
     }
 };
 
+/** Abstraction for checkpoint snapshots: the last executed block with its
+ * QC, and the hashes of the chunks of the application state taken right
+ * after executing it. Heights are not part of the block encoding, so the
+ * height is carried alongside. A snapshot without a block stands for "no
+ * checkpoint yet". */
+struct Snapshot: public Serializable {
+    block_t blk;
+    uint32_t height;
+    quorum_cert_bt qc;
+    std::vector<uint256_t> chunk_hashes;
+    /** handle of the core object to allow polymorphism */
+    HotStuffCore *hsc;
+
+    Snapshot(): blk(nullptr), height(0), qc(nullptr), hsc(nullptr) {}
+    Snapshot(const block_t &blk,
+            uint32_t height,
+            quorum_cert_bt &&qc,
+            std::vector<uint256_t> &&chunk_hashes,
+            HotStuffCore *hsc):
+        blk(blk), height(height), qc(std::move(qc)),
+        chunk_hashes(std::move(chunk_hashes)), hsc(hsc) {}
+
+    Snapshot(const Snapshot &other):
+        blk(other.blk), height(other.height),
+        qc(other.qc ? other.qc->clone() : nullptr),
+        chunk_hashes(other.chunk_hashes), hsc(other.hsc) {}
+
+    Snapshot(Snapshot &&other) = default;
+    Snapshot &operator=(Snapshot &&other) = default;
+
+    void serialize(DataStream &s) const override {
+        if (!blk)
+        {
+            s << (uint8_t)0;
+            return;
+        }
+        s << (uint8_t)1 << htole(height) << *blk << *qc
+          << htole((uint32_t)chunk_hashes.size());
+        for (const auto &h: chunk_hashes)
+            s << h;
+    }
+
+    /** Parse without adding the block to `hsc->storage`, so it can run off
+     * the event loop. */
+    void unserialize(DataStream &s) override {
+        assert(hsc != nullptr);
+        uint8_t flag;
+        uint32_t n;
+        s >> flag;
+        chunk_hashes.clear();
+        if (!flag)
+        {
+            blk = nullptr;
+            return;
+        }
+        s >> height;
+        height = letoh(height);
+        Block _blk;
+        _blk.unserialize(s, hsc);
+        blk = new Block(std::move(_blk));
+        qc = hsc->parse_quorum_cert(s);
+        s >> n;
+        n = letoh(n);
+        /* no reserve(): a bogus count runs out of data instead of memory */
+        for (uint32_t i = 0; i < n; i++)
+        {
+            uint256_t h;
+            s >> h;
+            chunk_hashes.push_back(h);
+        }
+    }
+
+    /** Identifies the snapshot. The QC is left out, as replicas holding the
+     * same checkpoint may have collected different votes for it. */
+    uint256_t get_digest() const {
+        DataStream p;
+        p << blk->get_hash() << htole(height)
+          << htole((uint32_t)chunk_hashes.size());
+        for (const auto &h: chunk_hashes)
+            p << h;
+        return p.get_hash();
+    }
+
+    promise_t verify(VeriPool &vpool) const {
+        assert(hsc != nullptr);
+        return qc->verify(hsc->get_config(), vpool).then([this](bool result) {
+            return result &&
+                qc->get_obj_hash() == Vote::proof_obj_hash(blk->get_hash());
+        });
+    }
+
+    operator std::string () const {
+        DataStream s;
+        s << "<snapshot ";
+        if (blk)
+            s << "blk=" << get_hex10(blk->get_hash()) << " "
+              << "height=" << std::to_string(height) << " "
+              << "chunks=" << std::to_string(chunk_hashes.size());
+        else
+            s << "none";
+        s << ">";
+        return std::move(s);
+    }
+};
+
 }
 
 #endif
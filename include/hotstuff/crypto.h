@@ -52,6 +52,10 @@ class PartCert: public Serializable, public Cloneable {
     virtual bool verify(const PubKey &pubkey) = 0;
     virtual const uint256_t &get_obj_hash() const = 0;
     virtual PartCert *clone() override = 0;
+    /** Compact form used by the version 1 wire format: obj_hash is elided
+     * because the receiver can derive it from the enclosing message. */
+    virtual void serialize_compact(DataStream &s) const = 0;
+    virtual void unserialize_compact(DataStream &s, const uint256_t &obj_hash) = 0;
 };
 
 class ReplicaConfig;
@@ -65,6 +69,9 @@ class QuorumCert: public Serializable, public Cloneable {
     virtual bool verify(const ReplicaConfig &config) = 0;
     virtual const uint256_t &get_obj_hash() const = 0;
     virtual QuorumCert *clone() override = 0;
+    /** Compact form used by the version 1 wire format (see PartCert). */
+    virtual void serialize_compact(DataStream &s) const = 0;
+    virtual void unserialize_compact(DataStream &s, const uint256_t &obj_hash) = 0;
 };
 
 using part_cert_bt = BoxObj<PartCert>;
@@ -99,6 +106,12 @@ class PartCertDummy: public PartCert {
         s >> tmp >> obj_hash;
     }
 
+    void serialize_compact(DataStream &) const override {}
+
+    void unserialize_compact(DataStream &, const uint256_t &_obj_hash) override {
+        obj_hash = _obj_hash;
+    }
+
     PartCert *clone() override {
         return new PartCertDummy(obj_hash);
     }
@@ -127,6 +140,12 @@ class QuorumCertDummy: public QuorumCert {
         s >> tmp >> obj_hash;
     }
 
+    void serialize_compact(DataStream &) const override {}
+
+    void unserialize_compact(DataStream &, const uint256_t &_obj_hash) override {
+        obj_hash = _obj_hash;
+    }
+
     QuorumCert *clone() override {
         return new QuorumCertDummy(*this);
     }
@@ -382,6 +401,15 @@ class PartCertSecp256k1: public SigSecp256k1, public PartCert {
         s >> obj_hash;
         this->SigSecp256k1::unserialize(s);
     }
+
+    void serialize_compact(DataStream &s) const override {
+        this->SigSecp256k1::serialize(s);
+    }
+
+    void unserialize_compact(DataStream &s, const uint256_t &_obj_hash) override {
+        obj_hash = _obj_hash;
+        this->SigSecp256k1::unserialize(s);
+    }
 };
 
 class QuorumCertSecp256k1: public QuorumCert {
@@ -423,6 +451,11 @@ class QuorumCertSecp256k1: public QuorumCert {
         for (size_t i = 0; i < rids.size(); i++)
             if (rids.get(i)) s >> sigs[i];
     }
+
+    /** The signer set is sent as a bare bitmap prefixed by its varint bit
+     * length, followed by the signatures in signer order. */
+    void serialize_compact(DataStream &s) const override;
+    void unserialize_compact(DataStream &s, const uint256_t &obj_hash) override;
 };
 
 }
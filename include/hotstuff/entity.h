@@ -18,6 +18,7 @@
 #define _HOTSTUFF_ENT_H
 
 #include <vector>
+#include <deque>
 #include <unordered_map>
 #include <unordered_set>
 #include <string>
@@ -29,6 +30,8 @@
 #include "hotstuff/type.h"
 #include "hotstuff/util.h"
 #include "hotstuff/crypto.h"
+#include "hotstuff/rcu.h"
+#include "hotstuff/hashmap.h"
 
 namespace hotstuff {
 
@@ -79,6 +82,10 @@ class ReplicaConfig {
         nreplicas++;
     }
 
+    bool has_replica(ReplicaID rid) const {
+        return replica_map.count(rid);
+    }
+
     const ReplicaInfo &get_info(ReplicaID rid) const {
         auto it = replica_map.find(rid);
         if (it == replica_map.end())
@@ -129,6 +136,8 @@ class Block {
     friend HotStuffCore;
     std::vector<uint256_t> parent_hashes;
     std::vector<uint256_t> cmds;
+    /** commits to cmds (the body), so that the header alone has the hash */
+    uint256_t body_digest;
     quorum_cert_bt qc;
     uint256_t qc_ref_hash;
     bytearray_t extra;
@@ -144,25 +153,34 @@ class Block {
     quorum_cert_bt self_qc;
     uint32_t height;
     bool delivered;
+    /** whether cmds is known (a block may be delivered header-only) */
+    bool body_delivered;
+    /** delivered on a descendant's QC by hash link, so that its own qc
+     * was never checked and must not be adopted */
+    bool qc_unchecked;
     int8_t decision;
 
     std::unordered_set<ReplicaID> voted;
 
     uint256_t _get_hash();
+    void _serialize_compact(DataStream &s, bool header_only) const;
+    void _unserialize_compact(DataStream &s, HotStuffCore *hsc, bool header_only);
 
     public:
     Block():
         qc(nullptr),
-        qc_ref(nullptr), view(0),
+        qc_ref(nullptr), view(0), cert_type(UNDEFINED_CERT),
         self_qc(nullptr), height(0),
-        delivered(false), decision(0) {}
+        delivered(false), body_delivered(true), qc_unchecked(false), decision(0) {}
 
     Block(bool delivered, int8_t decision):
+        body_digest(get_body_digest(std::vector<uint256_t>())),
         qc(nullptr),
         hash(_get_hash()),
-        qc_ref(nullptr), view(0),
+        qc_ref(nullptr), view(0), cert_type(UNDEFINED_CERT),
         self_qc(nullptr), height(0),
-        delivered(delivered), decision(decision) {}
+        delivered(delivered), body_delivered(true), qc_unchecked(false),
+        decision(decision) {}
 
     Block(const std::vector<block_t> &parents,
         const std::vector<uint256_t> &cmds,
@@ -175,6 +193,7 @@ class Block {
         int8_t decision = 0):
             parent_hashes(get_hashes(parents)),
             cmds(cmds),
+            body_digest(get_body_digest(cmds)),
             qc(std::move(qc)),
             qc_ref_hash(qc_ref ? qc_ref->get_hash() : uint256_t()),
             extra(std::move(extra)),
@@ -183,14 +202,38 @@ class Block {
             qc_ref(qc_ref),
             self_qc(std::move(self_qc)),
             view(view),
+            cert_type(UNDEFINED_CERT),
             height(height),
             delivered(0),
+            body_delivered(true),
+            qc_unchecked(false),
             decision(decision) {}
 
     void serialize(DataStream &s) const;
 
     void unserialize(DataStream &s, HotStuffCore *hsc);
 
+    /** Version 1 wire format: varint counts, and the qc obj_hash elided when
+     * it is the vote proof for qc_ref_hash (always the case for honest
+     * proposers). */
+    void serialize_compact(DataStream &s) const;
+
+    void unserialize_compact(DataStream &s, HotStuffCore *hsc);
+
+    /** The header: the compact format with cmds replaced by body_digest.
+     * The block is then delivered without its body, unless that is empty. */
+    void serialize_header(DataStream &s) const;
+
+    void unserialize_header(DataStream &s, HotStuffCore *hsc);
+
+    static uint256_t get_body_digest(const std::vector<uint256_t> &cmds) {
+        DataStream s;
+        s << htole((uint32_t)cmds.size());
+        for (const auto &cmd: cmds)
+            s << cmd;
+        return s.get_hash();
+    }
+
     const std::vector<uint256_t> &get_cmds() const {
         return cmds;
     }
@@ -219,12 +262,20 @@ class Block {
 
     bool is_delivered() const { return delivered; }
 
+    bool is_body_delivered() const { return body_delivered; }
+
+    void set_qc_unchecked() { qc_unchecked = true; }
+
+    const uint256_t &get_body_digest() const { return body_digest; }
+
     uint32_t get_view() const {return view; }
 
     uint32_t get_height() const { return height; }
 
     const quorum_cert_bt &get_qc() const { return qc; }
 
+    const quorum_cert_bt &get_self_qc() const { return self_qc; }
+
     const block_t &get_qc_ref() const { return qc_ref; }
 
     const bytearray_t &get_extra() const { return extra; }
@@ -251,9 +302,85 @@ struct BlockHeightCmp {
 };
 
 class EntityStorage {
-    std::unordered_map<const uint256_t, block_t> blk_cache;
-    std::unordered_map<const uint256_t, command_t> cmd_cache;
+    FlatHashMap<uint256_t, block_t> blk_cache;
+    /** The commands by hash. An entry counts the blocks in blk_cache whose
+     * bodies include the command, and may be there for that alone, without
+     * the command itself yet. */
+    struct CmdEntry {
+        command_t cmd;
+        size_t nbytes;
+        uint32_t nref;
+        /** not decided yet: it may still have to be proposed */
+        bool pending;
+    };
+    FlatHashMap<uint256_t, CmdEntry> cmd_cache;
+    /** the decided commands no block refers to, oldest first: the first to
+     * go over the budget (may hold stale entries, which are skipped) */
+    std::deque<uint256_t> cmd_unref;
+    /** the size of the commands held, and the most of them to hold unless
+     * pending or referred to by blocks (0: no limit) */
+    size_t cmd_bytes;
+    size_t cmd_budget;
+
+    static bool is_evictable(const CmdEntry &e) {
+        return e.cmd && !e.nref && !e.pending;
+    }
+
+    void evict_cmds() {
+        while (cmd_budget && cmd_bytes > cmd_budget && !cmd_unref.empty())
+        {
+            auto it = cmd_cache.find(cmd_unref.front());
+            cmd_unref.pop_front();
+            if (it == cmd_cache.end() || !is_evictable(it->second)) continue;
+            cmd_bytes -= it->second.nbytes;
+            cmd_cache.erase(it);
+        }
+        /* mostly stale */
+        if (cmd_unref.size() > 2 * cmd_cache.size() + 1024)
+        {
+            std::deque<uint256_t> live;
+            for (const auto &h: cmd_unref)
+            {
+                auto it = cmd_cache.find(h);
+                if (it != cmd_cache.end() && is_evictable(it->second))
+                    live.push_back(h);
+            }
+            cmd_unref.swap(live);
+        }
+    }
+
+    /** The body of `blk`, held in blk_cache, refers to its commands. */
+    void ref_cmds(const block_t &blk) {
+        for (const auto &h: blk->get_cmds())
+            cmd_cache.try_emplace(h, CmdEntry{nullptr, 0, 0, false}).first->second.nref++;
+    }
+
+    void unref_cmds(const block_t &blk) {
+        for (const auto &h: blk->get_cmds())
+        {
+            auto it = cmd_cache.find(h);
+            if (it == cmd_cache.end() || !it->second.nref ||
+                --it->second.nref) continue;
+            if (is_evictable(it->second))
+                cmd_unref.push_back(h);
+            else if (!it->second.cmd)
+                cmd_cache.erase(it);
+        }
+        evict_cmds();
+    }
+
+    block_t insert_blk(const block_t &blk) {
+        auto res = blk_cache.insert(std::make_pair(blk->get_hash(), blk));
+        if (res.second) ref_cmds(blk);
+        return res.first->second;
+    }
+
+    /** Blocks delivered with their bodies, readable from any thread: what
+     * they serialize to no longer changes. */
+    RCUHashMap<uint256_t, block_t> blk_index;
     public:
+    EntityStorage(): cmd_bytes(0), cmd_budget(0) {}
+
     bool is_blk_delivered(const uint256_t &blk_hash) {
         auto it = blk_cache.find(blk_hash);
         if (it == blk_cache.end()) return false;
@@ -270,12 +397,15 @@ class EntityStorage {
         //    HOTSTUFF_LOG_WARN("invalid %s", std::string(_blk).c_str());
         //    return nullptr;
         //}
-        block_t blk = new Block(std::move(_blk));
-        return blk_cache.insert(std::make_pair(blk->get_hash(), blk)).first->second;
+        return insert_blk(new Block(std::move(_blk)));
     }
 
-    const block_t &add_blk(const block_t &blk) {
-        return blk_cache.insert(std::make_pair(blk->get_hash(), blk)).first->second;
+    block_t add_blk(const block_t &blk) { return insert_blk(blk); }
+
+    /** The body of `blk`, delivered after its header, is now set. */
+    void on_blk_body(const block_t &blk) {
+        auto it = blk_cache.find(blk->get_hash());
+        if (it != blk_cache.end() && it->second == blk) ref_cmds(blk);
     }
 
     block_t find_blk(const uint256_t &blk_hash) {
@@ -283,45 +413,85 @@ class EntityStorage {
         return it == blk_cache.end() ? nullptr : it->second;
     }
 
+    /** Make a delivered block with its body visible to find_published_blk(). */
+    void publish_blk(const block_t &blk) {
+        blk_index.insert(blk->get_hash(), blk);
+    }
+
+    /** Thread-safe: can be used off the event loop, e.g. to serve blocks to
+     * other replicas from the VeriPool workers. */
+    block_t find_published_blk(const uint256_t &blk_hash) const {
+        block_t blk;
+        return blk_index.find(blk_hash, blk) ? blk : nullptr;
+    }
+
+    size_t get_published_blk_size() const {
+        return blk_index.size();
+    }
+
     bool is_cmd_fetched(const uint256_t &cmd_hash) {
-        return cmd_cache.count(cmd_hash);
+        auto it = cmd_cache.find(cmd_hash);
+        return it != cmd_cache.end() && it->second.cmd;
     }
 
-    const command_t &add_cmd(const command_t &cmd) {
-        return cmd_cache.insert(std::make_pair(cmd->get_hash(), cmd)).first->second;
+    /** Hold `cmd`, of `nbytes` (its serialized size if 0), submitted and
+     * not decided yet. Kept until settle_cmd(), and while a block refers
+     * to it; after that, until over the budget. */
+    command_t add_cmd(const command_t &cmd, size_t nbytes = 0) {
+        auto &e = cmd_cache.try_emplace(cmd->get_hash(),
+                                        CmdEntry{nullptr, 0, 0, false}).first->second;
+        if (e.cmd) return e.cmd;
+        if (!nbytes)
+        {
+            DataStream s;
+            s << *cmd;
+            nbytes = s.size();
+        }
+        e.cmd = cmd;
+        e.nbytes = nbytes;
+        e.pending = true;
+        cmd_bytes += nbytes;
+        return cmd;
+    }
+
+    /** The command is decided: it only stays for the blocks referring to
+     * it, or the budget. */
+    void settle_cmd(const uint256_t &cmd_hash) {
+        auto it = cmd_cache.find(cmd_hash);
+        if (it == cmd_cache.end() || !it->second.pending) return;
+        it->second.pending = false;
+        if (!is_evictable(it->second)) return;
+        cmd_unref.push_back(cmd_hash);
+        evict_cmds();
     }
 
     command_t find_cmd(const uint256_t &cmd_hash) {
         auto it = cmd_cache.find(cmd_hash);
-        return it == cmd_cache.end() ? nullptr: it->second;
+        return it == cmd_cache.end() ? nullptr : it->second.cmd;
     }
 
     size_t get_cmd_cache_size() {
         return cmd_cache.size();
     }
+    size_t get_cmd_bytes() const { return cmd_bytes; }
+    void set_cmd_budget(size_t budget) {
+        cmd_budget = budget;
+        evict_cmds();
+    }
     size_t get_blk_cache_size() {
         return blk_cache.size();
     }
 
-    bool try_release_cmd(const command_t &cmd) {
-        if (cmd.get_cnt() == 2) /* only referred by cmd and the storage */
-        {
-            const auto &cmd_hash = cmd->get_hash();
-            cmd_cache.erase(cmd_hash);
-            return true;
-        }
-        return false;
-    }
-
     bool try_release_blk(const block_t &blk) {
-        if (blk.get_cnt() == 2) /* only referred by blk and the storage */
+        const auto &blk_hash = blk->get_hash();
+        /* only referred by blk and the storage (and the index) */
+        if (blk.get_cnt() == (blk_index.count(blk_hash) ? 3 : 2))
         {
-            const auto &blk_hash = blk->get_hash();
+            blk_index.erase(blk_hash);
 #ifdef HOTSTUFF_PROTO_LOG
             HOTSTUFF_LOG_INFO("releasing blk %.10s", get_hex(blk_hash).c_str());
 #endif
-//            for (const auto &cmd: blk->get_cmds())
-//                try_release_cmd(cmd);
+            unref_cmds(blk);
             blk_cache.erase(blk_hash);
             return true;
         }
@@ -0,0 +1,332 @@
+/**
+ * Copyright 2018 VMware
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HOTSTUFF_HASHMAP_H
+#define _HOTSTUFF_HASHMAP_H
+
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace hotstuff {
+
+/** An open-addressing hash map for keys that are uniformly random already,
+ * such as uint256_t hashes: Hash(key) is used as is, without mixing.
+ * Entries are stored inline (no allocation per entry), and each slot has a
+ * one-byte tag (7 bits of the hash, or empty/deleted) so that a lookup
+ * compares the 16 tags of a group at once (with SSE2 where available) and
+ * only touches the keys whose tags match.
+ *
+ * Unlike std::unordered_map, an insertion may move the entries: it
+ * invalidates all iterators and references into the map. Erasure only
+ * invalidates those to the erased entry. */
+template<typename K, typename V, typename Hash = std::hash<K>>
+class FlatHashMap {
+    public:
+    using key_type = K;
+    using mapped_type = V;
+    using value_type = std::pair<const K, V>;
+
+    private:
+    static const size_t width = 16;
+    static const int8_t ctrl_empty = -128;
+    static const int8_t ctrl_deleted = -2;
+
+    /** a group of `width` tags */
+    struct Group {
+#ifdef __SSE2__
+        __m128i ctrl;
+        Group(const int8_t *p):
+            ctrl(_mm_load_si128(reinterpret_cast<const __m128i *>(p))) {}
+        uint32_t match(int8_t tag) const {
+            return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(tag)));
+        }
+        /** empty or deleted: the tags with the high bit set */
+        uint32_t match_free() const { return _mm_movemask_epi8(ctrl); }
+#else
+        const int8_t *ctrl;
+        Group(const int8_t *p): ctrl(p) {}
+        uint32_t match(int8_t tag) const {
+            uint32_t m = 0;
+            for (size_t i = 0; i < width; i++)
+                if (ctrl[i] == tag) m |= 1u << i;
+            return m;
+        }
+        uint32_t match_free() const {
+            uint32_t m = 0;
+            for (size_t i = 0; i < width; i++)
+                if (ctrl[i] < 0) m |= 1u << i;
+            return m;
+        }
+#endif
+        uint32_t match_empty() const { return match(ctrl_empty); }
+    };
+
+    int8_t *ctrl;
+    value_type *slots;
+    /** a power of two */
+    size_t ngroups;
+    size_t nitems;
+    /** inserts left before a rehash: deleted slots are not reused for
+     * free, so that there is always an empty slot to end a probe */
+    size_t growth_left;
+
+    static const size_t npos = size_t(-1);
+
+    static int8_t get_tag(size_t h) { return (int8_t)(h >> (sizeof(size_t) * 8 - 7)); }
+
+    size_t capacity() const { return ngroups * width; }
+
+    /** Visit the groups in the probe sequence of `h` until `f` returns
+     * true. The triangular steps reach every group. */
+    template<typename F>
+    void probe(size_t h, F f) const {
+        const size_t mask = ngroups - 1;
+        size_t g = h & mask;
+        for (size_t i = 1; !f(g * width, Group(ctrl + g * width)); i++)
+            g = (g + i) & mask;
+    }
+
+    size_t find_index(const K &key, size_t h) const {
+        if (!ngroups) return npos;
+        const int8_t tag = get_tag(h);
+        size_t idx = npos;
+        probe(h, [&](size_t base, const Group &grp) {
+            for (uint32_t m = grp.match(tag); m; m &= m - 1)
+            {
+                size_t i = base + __builtin_ctz(m);
+                if (slots[i].first == key)
+                {
+                    idx = i;
+                    return true;
+                }
+            }
+            return grp.match_empty() != 0;
+        });
+        return idx;
+    }
+
+    size_t find_free(size_t h) const {
+        size_t idx = npos;
+        probe(h, [&](size_t base, const Group &grp) {
+            uint32_t m = grp.match_free();
+            if (m) idx = base + __builtin_ctz(m);
+            return m != 0;
+        });
+        return idx;
+    }
+
+    void alloc(size_t n) {
+        ngroups = n;
+        ctrl = static_cast<int8_t *>(::operator new(capacity(),
+                                    std::align_val_t(width)));
+        slots = static_cast<value_type *>(::operator new(capacity() * sizeof(value_type)));
+        for (size_t i = 0; i < capacity(); i++) ctrl[i] = ctrl_empty;
+        growth_left = capacity() - capacity() / 8 - nitems;
+    }
+
+    void release() {
+        if (!ngroups) return;
+        for (size_t i = 0; i < capacity(); i++)
+            if (ctrl[i] >= 0) slots[i].~value_type();
+        ::operator delete(ctrl, std::align_val_t(width));
+        ::operator delete(slots);
+        ctrl = nullptr;
+        slots = nullptr;
+        ngroups = 0;
+    }
+
+    void resize(size_t n) {
+        int8_t *old_ctrl = ctrl;
+        value_type *old_slots = slots;
+        size_t old_cap = capacity();
+        alloc(n);
+        for (size_t i = 0; i < old_cap; i++)
+        {
+            if (old_ctrl[i] < 0) continue;
+            value_type &v = old_slots[i];
+            size_t h = Hash()(v.first);
+            size_t idx = find_free(h);
+            new (slots + idx) value_type(v.first, std::move(v.second));
+            ctrl[idx] = get_tag(h);
+            v.~value_type();
+        }
+        if (old_cap)
+        {
+            ::operator delete(old_ctrl, std::align_val_t(width));
+            ::operator delete(old_slots);
+        }
+    }
+
+    void erase_index(size_t idx) {
+        slots[idx].~value_type();
+        nitems--;
+        /* no probe goes past a group with an empty slot, so the slot can
+         * be emptied instead of being left as a tombstone */
+        if (Group(ctrl + idx / width * width).match_empty())
+        {
+            ctrl[idx] = ctrl_empty;
+            growth_left++;
+        }
+        else
+            ctrl[idx] = ctrl_deleted;
+    }
+
+    template<bool is_const>
+    class iter_base {
+        friend FlatHashMap;
+        template<bool> friend class iter_base;
+        using map_t = typename std::conditional<is_const,
+                                const FlatHashMap, FlatHashMap>::type;
+        using ref_t = typename std::conditional<is_const,
+                                const value_type &, value_type &>::type;
+        using ptr_t = typename std::conditional<is_const,
+                                const value_type *, value_type *>::type;
+        map_t *m;
+        size_t idx;
+        void skip() {
+            while (idx < m->capacity() && m->ctrl[idx] < 0) idx++;
+        }
+        iter_base(map_t *m, size_t idx): m(m), idx(idx) {}
+        public:
+        iter_base(): m(nullptr), idx(0) {}
+        iter_base(const iter_base &) = default;
+        iter_base &operator=(const iter_base &) = default;
+        /* iterator to const_iterator (a template, so that it is not taken
+         * for the copy constructor of iterator) */
+        template<bool c = is_const, typename std::enable_if<c, int>::type = 0>
+        iter_base(const iter_base<false> &other): m(other.m), idx(other.idx) {}
+        ref_t operator*() const { return m->slots[idx]; }
+        ptr_t operator->() const { return &m->slots[idx]; }
+        iter_base &operator++() { idx++; skip(); return *this; }
+        iter_base operator++(int) { auto t = *this; ++*this; return t; }
+        bool operator==(const iter_base &other) const { return idx == other.idx; }
+        bool operator!=(const iter_base &other) const { return idx != other.idx; }
+    };
+
+    public:
+    using iterator = iter_base<false>;
+    using const_iterator = iter_base<true>;
+
+    FlatHashMap(): ctrl(nullptr), slots(nullptr),
+                    ngroups(0), nitems(0), growth_left(0) {}
+
+    FlatHashMap(const FlatHashMap &) = delete;
+    FlatHashMap &operator=(const FlatHashMap &) = delete;
+
+    FlatHashMap(FlatHashMap &&other):
+            ctrl(other.ctrl), slots(other.slots), ngroups(other.ngroups),
+            nitems(other.nitems), growth_left(other.growth_left) {
+        other.ctrl = nullptr;
+        other.slots = nullptr;
+        other.ngroups = other.nitems = other.growth_left = 0;
+    }
+
+    ~FlatHashMap() { release(); }
+
+    iterator begin() { iterator it(this, 0); it.skip(); return it; }
+    iterator end() { return iterator(this, capacity()); }
+    const_iterator begin() const { const_iterator it(this, 0); it.skip(); return it; }
+    const_iterator end() const { return const_iterator(this, capacity()); }
+
+    size_t size() const { return nitems; }
+    bool empty() const { return !nitems; }
+
+    iterator find(const K &key) {
+        size_t idx = find_index(key, Hash()(key));
+        return idx == npos ? end() : iterator(this, idx);
+    }
+
+    const_iterator find(const K &key) const {
+        size_t idx = find_index(key, Hash()(key));
+        return idx == npos ? end() : const_iterator(this, idx);
+    }
+
+    size_t count(const K &key) const {
+        return find_index(key, Hash()(key)) != npos;
+    }
+
+    template<typename... Args>
+    std::pair<iterator, bool> try_emplace(const K &key, Args &&...args) {
+        size_t h = Hash()(key);
+        size_t idx = find_index(key, h);
+        if (idx != npos) return std::make_pair(iterator(this, idx), false);
+        if (!ngroups) resize(1);
+        idx = find_free(h);
+        if (!growth_left && ctrl[idx] == ctrl_empty)
+        {
+            /* grow, unless it is the tombstones that fill the table */
+            resize(nitems >= capacity() * 7 / 16 ? ngroups << 1 : ngroups);
+            idx = find_free(h);
+        }
+        new (slots + idx) value_type(std::piecewise_construct,
+                                    std::forward_as_tuple(key),
+                                    std::forward_as_tuple(std::forward<Args>(args)...));
+        if (ctrl[idx] == ctrl_empty) growth_left--;
+        ctrl[idx] = get_tag(h);
+        nitems++;
+        return std::make_pair(iterator(this, idx), true);
+    }
+
+    template<typename P>
+    std::pair<iterator, bool> insert(P &&p) {
+        return try_emplace(p.first, std::forward<P>(p).second);
+    }
+
+    V &operator[](const K &key) {
+        return try_emplace(key).first->second;
+    }
+
+    iterator erase(const_iterator it) {
+        erase_index(it.idx);
+        iterator next(this, it.idx);
+        next.skip();
+        return next;
+    }
+
+    iterator erase(iterator it) { return erase(const_iterator(it)); }
+
+    size_t erase(const K &key) {
+        size_t idx = find_index(key, Hash()(key));
+        if (idx == npos) return 0;
+        erase_index(idx);
+        return 1;
+    }
+
+    void clear() {
+        release();
+        nitems = 0;
+        growth_left = 0;
+    }
+
+    /** Make room for `n` entries without further rehashing. */
+    void reserve(size_t n) {
+        size_t g = 1;
+        while (g * width - g * width / 8 < n) g <<= 1;
+        if (g > ngroups) resize(g);
+    }
+};
+
+}
+
+#endif
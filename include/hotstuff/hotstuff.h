@@ -18,6 +18,13 @@
 #ifndef _HOTSTUFF_CORE_H
 #define _HOTSTUFF_CORE_H
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
 #include <queue>
 #include <unordered_map>
 #include <unordered_set>
@@ -28,6 +35,9 @@
 #include "hotstuff/util.h"
 #include "hotstuff/consensus.h"
 #include "hotstuff/liveness.h"
+#include "hotstuff/ring.h"
+#include "hotstuff/order.h"
+#include "hotstuff/iblt.h"
 
 namespace hotstuff {
 
@@ -38,6 +48,53 @@ using salticidae::_2;
 
 const double ent_waiting_timeout = 10;
 const double double_inf = 1e10;
+/** catch-up by ranges: blocks per page, pages in flight, how many missing
+ * ancestors in a row trigger a range fetch, and the largest page served */
+const uint32_t blk_range_page = 128;
+const size_t blk_range_window = 4;
+const uint32_t blk_range_min_gap = 2;
+const uint32_t blk_range_page_max = 1024;
+/** bounds and the default (for peers never asked before) of the delay
+ * after which a stalled block fetch is hedged to another peer */
+const double fetch_hedge_min = 0.01;
+const double fetch_hedge_default = 1;
+/** the most ancestors pushed to a peer along with a proposal */
+const size_t blk_push_max = 8;
+/** state transfer: bytes per snapshot chunk, chunk requests in flight, and
+ * how many rounds of asking for a snapshot before replaying the chain */
+const size_t snapshot_chunk_size = 256 << 10;
+const size_t snapshot_chunk_window = 4;
+const size_t snapshot_sync_retries = 3;
+/** payload batches: the most commands in one, the largest payload of a
+ * command, how many batches only heard of (acknowledged by others but not
+ * received) are tracked, how many executed ones are kept to serve, and the
+ * bytes of undecided batches taken as pushed by one peer, and in all */
+const size_t batch_max_cmds = 65536;
+const size_t batch_max_payload = 1 << 20;
+const size_t batch_unheld_max = 4096;
+const size_t batch_retain_max = 1024;
+const size_t batch_peer_bytes_max = 64 << 20;
+const size_t batch_bytes_max = 1 << 30;
+/** command ingestion: the slots of the ring, and the most commands taken
+ * off it at once */
+const size_t cmd_ring_size = 1 << 16;
+const size_t cmd_drain_max = 256;
+/** the bytes of a short id in a block body */
+const size_t short_id_bytes = 6;
+/** mempool reconciliation: the cells of the first table sent to a peer,
+ * the most in any table, and the least time between two requests from a
+ * peer that are answered (each takes a pass over the mempool) */
+const size_t recon_cells_min = 96;
+const size_t recon_cells_max = 1 << 15;
+const double recon_req_gap_min = 0.1;
+/** The highest wire format version this replica speaks: 0 is the original
+ * fixed-width encoding, 1 adds the compact encodings below, 2 adds block
+ * bodies as short ids, 3 adds mempool reconciliation, 4 makes the hash of a
+ * block commit to its body digest rather than to its commands. */
+const uint8_t wire_version = 4;
+/** Peers announcing an older version are refused: they would compute other
+ * hashes for the same blocks. */
+const uint8_t wire_version_min = 4;
 
 /** Network message format for HotStuff. */
 struct MsgPropose {
@@ -49,6 +106,11 @@ struct MsgPropose {
     MsgPropose(DataStream &&s): serialized(std::move(s)) {}
     /** Parse the serialized data to blks now, with `hsc->storage`. */
     void postponed_parse(HotStuffCore *hsc);
+    /** Parse and pre-hash without touching `hsc->storage`, so that it can
+     * run on a worker thread. */
+    void decode(HotStuffCore *hsc);
+    /** Add the decoded block to `hsc->storage` (on the event loop). */
+    void finish_parse(HotStuffCore *hsc);
 };
 
 struct MsgVote {
@@ -58,15 +120,21 @@ struct MsgVote {
     MsgVote(const Vote &);
     MsgVote(DataStream &&s): serialized(std::move(s)) {}
     void postponed_parse(HotStuffCore *hsc);
+    void decode(HotStuffCore *hsc);
 };
 
+/* Status, NewView and their compact variant append the sender's delivery
+ * watermark (highest delivered height), which old replicas ignore; it reads
+ * as 0 when absent. */
 struct MsgStatus {
     static const opcode_t opcode = 0x4;
     DataStream serialized;
     Status status;
-    MsgStatus(const Status &);
+    uint32_t watermark;
+    MsgStatus(const Status &, uint32_t watermark = 0);
     MsgStatus(DataStream &&s): serialized(std::move(s)) {}
     void postponed_parse(HotStuffCore *hsc);
+    void decode(HotStuffCore *hsc);
 };
 
 struct MsgBlame {
@@ -76,6 +144,7 @@ struct MsgBlame {
     MsgBlame(const Blame &);
     MsgBlame(DataStream &&s): serialized(std::move(s)) {}
     void postponed_parse(HotStuffCore *hsc);
+    void decode(HotStuffCore *hsc);
 };
 
 struct MsgBlameNotify {
@@ -85,6 +154,7 @@ struct MsgBlameNotify {
     MsgBlameNotify(const BlameNotify &);
     MsgBlameNotify(DataStream &&s): serialized(std::move(s)) {}
     void postponed_parse(HotStuffCore *hsc);
+    void decode(HotStuffCore *hsc);
 };
 
 struct MsgNotify {
@@ -94,15 +164,18 @@ struct MsgNotify {
     MsgNotify(const Notify &);
     MsgNotify(DataStream &&s): serialized(std::move(s)) {}
     void postponed_parse(HotStuffCore *hsc);
+    void decode(HotStuffCore *hsc);
 };
 
 struct MsgNewView {
     static const opcode_t opcode = 0x08;
     DataStream serialized;
     Status status;
-    MsgNewView(const Status &);
+    uint32_t watermark;
+    MsgNewView(const Status &, uint32_t watermark = 0);
     MsgNewView(DataStream &&s): serialized(std::move(s)) {}
     void postponed_parse(HotStuffCore *hsc);
+    void decode(HotStuffCore *hsc);
 };
 
 struct MsgReqBlock {
@@ -119,13 +192,407 @@ struct MsgRespBlock {
     static const opcode_t opcode = 0x3;
     DataStream serialized;
     std::vector<block_t> blks;
-    MsgRespBlock(const std::vector<block_t> &blks);
+    /** requested blocks the sender does not have */
+    std::vector<uint256_t> missing;
+    MsgRespBlock(const std::vector<block_t> &blks,
+                const std::vector<uint256_t> &missing = {});
     MsgRespBlock(DataStream &&s): serialized(std::move(s)) {}
     void postponed_parse(HotStuffCore *hsc);
+    void decode(HotStuffCore *hsc);
+    void finish_parse(HotStuffCore *hsc);
+};
+
+/** Announces the highest wire format version the sender understands. Each
+ * side sends it when a connection comes up, and uses compact encodings towards
+ * a peer only after hearing version >= 1 from it, so old replicas keep
+ * receiving the original format. */
+struct MsgHello {
+    static const opcode_t opcode = 0x09;
+    DataStream serialized;
+    uint8_t version;
+    MsgHello(uint8_t version);
+    MsgHello(DataStream &&s);
+};
+
+/** Requests a page of the first-parent ancestors of `blk_hash`: skipping
+ * `offset` blocks from `blk_hash` (itself included) downwards, the next
+ * `count` blocks, stopping below `min_height`. Pages are addressed by offset
+ * because the requester cannot know the heights of blocks it has not
+ * delivered (heights are not part of the wire format). */
+struct MsgReqBlockRange {
+    static const opcode_t opcode = 0x0a;
+    DataStream serialized;
+    uint256_t blk_hash;
+    uint32_t min_height;
+    uint32_t offset;
+    uint32_t count;
+    MsgReqBlockRange(const uint256_t &blk_hash, uint32_t min_height,
+                    uint32_t offset, uint32_t count);
+    MsgReqBlockRange(DataStream &&s);
+};
+
+/** One page of a range fetch, bottom-up (each block is the first parent
+ * of the next). The request's `blk_hash` and `offset` are echoed back to
+ * identify the page. */
+struct MsgRespBlockRange {
+    static const opcode_t opcode = 0x0b;
+    DataStream serialized;
+    uint256_t blk_hash;
+    uint32_t offset;
+    std::vector<block_t> blks;
+    MsgRespBlockRange(const uint256_t &blk_hash, uint32_t offset,
+                    const std::vector<block_t> &blks);
+    MsgRespBlockRange(DataStream &&s): serialized(std::move(s)) {}
+    void postponed_parse(HotStuffCore *hsc);
+    void decode(HotStuffCore *hsc);
+    void finish_parse(HotStuffCore *hsc);
+};
+
+/** Asks for the header of the sender's latest checkpoint snapshot. */
+struct MsgReqSnapshot {
+    static const opcode_t opcode = 0x0c;
+    DataStream serialized;
+    MsgReqSnapshot() = default;
+    MsgReqSnapshot(DataStream &&) {}
+};
+
+/** The header of a checkpoint snapshot (empty if there is none). */
+struct MsgSnapshot {
+    static const opcode_t opcode = 0x0d;
+    DataStream serialized;
+    Snapshot snapshot;
+    MsgSnapshot(const Snapshot &);
+    MsgSnapshot(DataStream &&s): serialized(std::move(s)) {}
+    void postponed_parse(HotStuffCore *hsc);
+    void decode(HotStuffCore *hsc);
+};
+
+/** Requests chunk `idx` of the snapshot with digest `digest`. */
+struct MsgReqSnapshotChunk {
+    static const opcode_t opcode = 0x0e;
+    DataStream serialized;
+    uint256_t digest;
+    uint32_t idx;
+    MsgReqSnapshotChunk(const uint256_t &digest, uint32_t idx);
+    MsgReqSnapshotChunk(DataStream &&s);
+};
+
+/** A chunk of the application state of a snapshot. */
+struct MsgSnapshotChunk {
+    static const opcode_t opcode = 0x0f;
+    DataStream serialized;
+    uint256_t digest;
+    uint32_t idx;
+    bytearray_t data;
+    /** hash of `data`, computed by decode() */
+    uint256_t data_hash;
+    MsgSnapshotChunk(const uint256_t &digest, uint32_t idx,
+                    const bytearray_t &data);
+    MsgSnapshotChunk(DataStream &&s): serialized(std::move(s)) {}
+    void postponed_parse(HotStuffCore *hsc);
+    void decode(HotStuffCore *hsc);
+};
+
+/* Compact (version 1) encodings of the high-volume messages: varint counts,
+ * certificate obj_hashes elided whenever they can be derived from the
+ * enclosing message, and QC signer sets sent as bare bitmaps. They use their
+ * own opcodes so that a message is always self-describing on the wire. */
+
+struct MsgProposeCompact {
+    static const opcode_t opcode = 0x10;
+    DataStream serialized;
+    Proposal proposal;
+    MsgProposeCompact(const Proposal &);
+    MsgProposeCompact(DataStream &&s): serialized(std::move(s)) {}
+    void postponed_parse(HotStuffCore *hsc);
+    void decode(HotStuffCore *hsc);
+    void finish_parse(HotStuffCore *hsc);
+};
+
+struct MsgVoteCompact {
+    static const opcode_t opcode = 0x11;
+    DataStream serialized;
+    Vote vote;
+    MsgVoteCompact(const Vote &);
+    MsgVoteCompact(DataStream &&s): serialized(std::move(s)) {}
+    void postponed_parse(HotStuffCore *hsc);
+    void decode(HotStuffCore *hsc);
+};
+
+struct MsgRespBlockCompact {
+    static const opcode_t opcode = 0x13;
+    DataStream serialized;
+    std::vector<block_t> blks;
+    std::vector<uint256_t> missing;
+    MsgRespBlockCompact(const std::vector<block_t> &blks,
+                        const std::vector<uint256_t> &missing = {});
+    MsgRespBlockCompact(DataStream &&s): serialized(std::move(s)) {}
+    void postponed_parse(HotStuffCore *hsc);
+    void decode(HotStuffCore *hsc);
+    void finish_parse(HotStuffCore *hsc);
+};
+
+struct MsgStatusCompact {
+    static const opcode_t opcode = 0x14;
+    DataStream serialized;
+    Status status;
+    uint32_t watermark;
+    MsgStatusCompact(const Status &, uint32_t watermark = 0);
+    MsgStatusCompact(DataStream &&s): serialized(std::move(s)) {}
+    void postponed_parse(HotStuffCore *hsc);
+    void decode(HotStuffCore *hsc);
+};
+
+/** A proposal carrying only the block header: the receiver can deliver the
+ * block and vote before the body (MsgBlockBody) arrives. */
+struct MsgProposeHeader {
+    static const opcode_t opcode = 0x15;
+    DataStream serialized;
+    Proposal proposal;
+    MsgProposeHeader(const Proposal &);
+    MsgProposeHeader(DataStream &&s): serialized(std::move(s)) {}
+    void postponed_parse(HotStuffCore *hsc);
+    void decode(HotStuffCore *hsc);
+    void finish_parse(HotStuffCore *hsc);
+};
+
+/** The body (commands) of a block sent header-first. */
+struct MsgBlockBody {
+    static const opcode_t opcode = 0x16;
+    DataStream serialized;
+    uint256_t blk_hash;
+    std::vector<uint256_t> cmds;
+    /** digest of `cmds`, computed by decode() */
+    uint256_t body_digest;
+    MsgBlockBody(const block_t &blk);
+    MsgBlockBody(DataStream &&s): serialized(std::move(s)) {}
+    void postponed_parse(HotStuffCore *hsc);
+    void decode(HotStuffCore *hsc);
+};
+
+/** Short ids of the commands in the body of a block: SipHash-2-4 keyed by
+ * the block hash, which no client knows in advance, cut to short_id_bytes.
+ * They are usually distinct within a block and against the commands a
+ * replica has seen (a wrong match fails the body digest). */
+class ShortIdKey {
+    uint64_t k0, k1;
+    public:
+    ShortIdKey(const uint256_t &blk_hash) {
+        bytearray_t b = blk_hash;
+        k0 = k1 = 0;
+        for (size_t i = 0; i < 8; i++)
+        {
+            k0 |= (uint64_t)b[i] << (8 * i);
+            k1 |= (uint64_t)b[8 + i] << (8 * i);
+        }
+    }
+    uint64_t operator()(const uint256_t &cmd_hash) const {
+        bytearray_t b = cmd_hash;
+        return siphash24(k0, k1, b.data(), b.size()) &
+                ((1ULL << (8 * short_id_bytes)) - 1);
+    }
+};
+
+/** For hash maps keyed by short ids, whose high bits are zero. */
+struct ShortIdHash {
+    size_t operator()(uint64_t sid) const {
+        return sid * 0x9e3779b97f4a7c15ULL;
+    }
+};
+
+/** The body of a block sent header-first, as short ids. The receiver
+ * matches them against the commands it holds and asks the sender for the
+ * rest (MsgReqBodyCmds). */
+struct MsgBlockBodyShort {
+    static const opcode_t opcode = 0x12;
+    DataStream serialized;
+    uint256_t blk_hash;
+    std::vector<uint64_t> sids;
+    MsgBlockBodyShort(const uint256_t &blk_hash, const std::vector<uint64_t> &sids);
+    MsgBlockBodyShort(DataStream &&s);
+};
+
+/** Asks for the commands at some positions of a block body. */
+struct MsgReqBodyCmds {
+    static const opcode_t opcode = 0x1a;
+    DataStream serialized;
+    uint256_t blk_hash;
+    std::vector<uint32_t> idx;
+    MsgReqBodyCmds(const uint256_t &blk_hash, const std::vector<uint32_t> &idx);
+    MsgReqBodyCmds(DataStream &&s);
+};
+
+/** The commands asked for by MsgReqBodyCmds, in the same order. */
+struct MsgRespBodyCmds {
+    static const opcode_t opcode = 0x1b;
+    DataStream serialized;
+    uint256_t blk_hash;
+    std::vector<uint32_t> idx;
+    std::vector<uint256_t> cmds;
+    MsgRespBodyCmds(const uint256_t &blk_hash, const std::vector<uint32_t> &idx,
+                    const std::vector<uint256_t> &cmds);
+    MsgRespBodyCmds(DataStream &&s);
+};
+
+/** The pending commands of the sender, as an IBLT, for the receiver to
+ * reconcile with its own. */
+struct MsgReconReq {
+    static const opcode_t opcode = 0x1c;
+    DataStream serialized;
+    uint32_t round;
+    IBLT iblt;
+    /** whether the table is well-formed */
+    bool ok;
+    MsgReconReq(uint32_t round, const IBLT &iblt);
+    MsgReconReq(DataStream &&s);
+};
+
+/** The outcome of a reconciliation: if the difference could be listed, the
+ * commands the requester lacks (with their sizes), and the size of the
+ * whole difference. */
+struct MsgReconResp {
+    static const opcode_t opcode = 0x1d;
+    DataStream serialized;
+    uint32_t round;
+    bool ok;
+    uint32_t ndiff;
+    std::vector<std::pair<uint256_t, uint32_t>> cmds;
+    MsgReconResp(uint32_t round, bool ok, uint32_t ndiff,
+                const std::vector<std::pair<uint256_t, uint32_t>> &cmds);
+    MsgReconResp(DataStream &&s);
+};
+
+/** A batch of client commands, with their payloads, disseminated by the
+ * replica that received them ahead of their ordering. With batching on,
+ * blocks carry the digests of batches instead of command hashes. */
+struct Batch {
+    std::vector<uint256_t> cmds;
+    std::vector<bytearray_t> payloads;
+    /** the total size of the payloads */
+    size_t nbytes;
+    Batch(): nbytes(0) {}
+};
+
+/** Disseminates a batch; its digest is the hash of the encoding. */
+struct MsgBatch {
+    static const opcode_t opcode = 0x17;
+    DataStream serialized;
+    Batch batch;
+    /** computed by decode() */
+    uint256_t digest;
+    MsgBatch(const Batch &batch);
+    MsgBatch(DataStream &&s): serialized(std::move(s)) {}
+    void postponed_parse(HotStuffCore *hsc);
+    void decode(HotStuffCore *hsc);
+};
+
+/** Tells every replica that the sender holds a batch. */
+struct MsgBatchAck {
+    static const opcode_t opcode = 0x18;
+    DataStream serialized;
+    uint256_t digest;
+    MsgBatchAck(const uint256_t &digest);
+    MsgBatchAck(DataStream &&s);
+};
+
+/** Asks for batches needed to execute a block. */
+struct MsgReqBatch {
+    static const opcode_t opcode = 0x19;
+    DataStream serialized;
+    std::vector<uint256_t> digests;
+    MsgReqBatch(const std::vector<uint256_t> &digests);
+    MsgReqBatch(DataStream &&s);
 };
 
 using promise::promise_t;
 
+/** Decodes a received message on a VeriPool worker: certificates, blocks and
+ * their hashes are all computed off the event loop, which then only has to
+ * register the result and drive the state machine. */
+template<typename M>
+class MsgDecodeTask: public VeriTask {
+    RcObj<M> msg;
+    HotStuffCore *hsc;
+    /** where to add the decoding CPU time (in ns), if not null */
+    std::atomic<uint64_t> *cost_ns;
+    public:
+    MsgDecodeTask(const RcObj<M> &msg, HotStuffCore *hsc,
+                std::atomic<uint64_t> *cost_ns = nullptr):
+        msg(msg), hsc(hsc), cost_ns(cost_ns) {}
+    bool verify() override {
+#ifdef HOTSTUFF_MSG_STAT
+        double cost = 0;
+        /* destroyed after the timer, so it sees the final cost */
+        struct Charge {
+            double &cost;
+            std::atomic<uint64_t> *cost_ns;
+            ~Charge() { if (cost_ns) *cost_ns += (uint64_t)(cost * 1e9); }
+        } charge{cost, cost_ns};
+        CPUTimer timer(cost);
+#endif
+        try {
+            msg->decode(hsc);
+        } catch (std::exception &e) {
+            HOTSTUFF_LOG_WARN("dropping ill-formed message (opcode %02x): %s",
+                                M::opcode, e.what());
+            return false;
+        }
+        return true;
+    }
+};
+
+/** Runs a piece of work on a VeriPool worker, for jobs that only touch
+ * thread-safe state (e.g. EntityStorage::find_published_blk()). */
+class OffloadTask: public VeriTask {
+    std::function<bool()> work;
+    public:
+    OffloadTask(std::function<bool()> &&work): work(std::move(work)) {}
+    bool verify() override { return work(); }
+};
+
+#ifdef HOTSTUFF_MSG_STAT
+/** Traffic and handler cost of one message type within a stat period. */
+struct MsgTypeStat {
+    /** message sizes are binned by powers of two: < 128B, < 256B, ...,
+     * and >= 64KB in the last bin */
+    static const size_t nbins = 11;
+    uint32_t nsent;
+    uint32_t nrecv;
+    uint64_t nsentb;
+    uint64_t nrecvb;
+    uint32_t size_hist[nbins];
+    /** CPU time of the handler on the event loop */
+    double cpu_sec;
+
+    MsgTypeStat() { clear(); }
+
+    void clear() {
+        nsent = nrecv = 0;
+        nsentb = nrecvb = 0;
+        std::fill(size_hist, size_hist + nbins, 0);
+        cpu_sec = 0;
+    }
+
+    static size_t get_bin(size_t size) {
+        size_t b = 0;
+        for (size >>= 7; size && b + 1 < nbins; size >>= 1) b++;
+        return b;
+    }
+
+    void add_sent(size_t size, size_t ncopies = 1) {
+        nsent += ncopies;
+        nsentb += size * ncopies;
+        size_hist[get_bin(size)] += ncopies;
+    }
+
+    void add_recv(size_t size) {
+        nrecv++;
+        nrecvb += size;
+        size_hist[get_bin(size)]++;
+    }
+};
+#endif
+
 class HotStuffBase;
 
 template<EntityType ent_type>
@@ -135,6 +602,8 @@ class FetchContext: public promise_t {
     MsgReqBlock fetch_msg;
     const uint256_t ent_hash;
     std::unordered_set<NetAddr> replica_ids;
+    /** when the request was (last) sent to each peer */
+    std::unordered_map<NetAddr, std::chrono::steady_clock::time_point> sent;
     inline void timeout_cb(TimerEvent &);
     public:
     FetchContext(const FetchContext &) = delete;
@@ -145,8 +614,68 @@ class FetchContext: public promise_t {
     ~FetchContext() {}
 
     inline void send(const NetAddr &replica_id);
+    /** Send to `replica_id` and hedge to another peer if it is too slow. */
+    inline void fetch_from(const NetAddr &replica_id);
     inline void reset_timeout();
     inline void add_replica(const NetAddr &replica_id, bool fetch_now = true);
+    /** Account the response from `replica_id` in its fetch statistics. */
+    inline void on_response(const NetAddr &replica_id);
+    /** `replica_id` does not have the entity: ask someone else now. */
+    inline void on_missing(const NetAddr &replica_id);
+    /** Ask the next best peer not asked yet; false if there is none. */
+    inline bool hedge();
+    /** Whether every replica has been asked. */
+    inline bool asked_all() const;
+};
+
+/** Fetch latency and reliability of a peer, used to pick whom to ask. */
+class PeerFetchStat {
+    static const size_t nsamples = 64;
+    /** the latest round-trip times, in seconds */
+    double rtt[nsamples];
+    size_t nrtt;
+    size_t pos;
+    double nreq;
+    double nresp;
+
+    public:
+    PeerFetchStat(): nrtt(0), pos(0), nreq(0), nresp(0) {}
+
+    void add_request() {
+        /* let old history fade */
+        if (++nreq > 256)
+        {
+            nreq /= 2;
+            nresp /= 2;
+        }
+    }
+
+    void add_response(double sec) {
+        nresp++;
+        rtt[pos] = sec;
+        pos = (pos + 1) % nsamples;
+        if (nrtt < nsamples) nrtt++;
+    }
+
+    size_t get_nsamples() const { return nrtt; }
+
+    double get_rtt_quantile(double q) const {
+        if (!nrtt) return 0;
+        std::vector<double> v(rtt, rtt + nrtt);
+        auto k = v.begin() + std::min(nrtt - 1, (size_t)(q * nrtt));
+        std::nth_element(v.begin(), k, v.end());
+        return *k;
+    }
+
+    double get_success_rate() const {
+        return nreq ? std::min(1.0, nresp / nreq) : 1;
+    }
+
+    /** The expected time to get an answer (lower is better). */
+    double get_score() const {
+        double t = nrtt ? get_rtt_quantile(0.5) : fetch_hedge_default;
+        return t / std::max(get_success_rate(), 0.05);
+    }
 };
 
 class BlockDeliveryContext: public promise_t {
@@ -165,6 +694,389 @@ class BlockDeliveryContext: public promise_t {
     }
 };
 
+/** Commands not decided yet, kept by every replica so that whoever becomes
+ * the proposer can propose them. A command is taken while it is in a block
+ * that is not decided yet (proposed by anyone), and is given back if that
+ * block is abandoned; it leaves the pool once decided. */
+class Mempool {
+    public:
+    using clock_t = std::chrono::steady_clock;
+
+    private:
+    struct Entry {
+        bool taken;
+        /** the size of the command as reported by the client side */
+        uint32_t size;
+        uint32_t client;
+        clock_t::time_point arrival;
+    };
+    FlatHashMap<uint256_t, Entry> cmds;
+    /* the commands not taken, oldest first; may also hold stale entries,
+     * which are skipped */
+    std::deque<uint256_t> order;
+    /** the order to propose them in, if not the above */
+    std::unique_ptr<CmdOrder> policy;
+    size_t nfree;
+    size_t nfree_bytes;
+
+    bool is_free(const uint256_t &h) const {
+        auto it = cmds.find(h);
+        return it != cmds.end() && !it->second.taken;
+    }
+
+    void compact() {
+        std::deque<uint256_t> live;
+        for (const auto &h: order)
+            if (is_free(h)) live.push_back(h);
+        order.swap(live);
+        if (policy)
+            policy->compact([this](const uint256_t &h) { return is_free(h); });
+    }
+
+    /** when the stale entries outnumber the live ones */
+    void maybe_compact() {
+        if (order.size() > 2 * nfree + 1024 ||
+            (policy && policy->size() > 2 * nfree + 1024))
+            compact();
+    }
+
+    void set_taken(Entry &e, bool taken) {
+        e.taken = taken;
+        if (taken)
+        {
+            nfree--;
+            nfree_bytes -= e.size;
+        }
+        else
+        {
+            nfree++;
+            nfree_bytes += e.size;
+        }
+    }
+
+    /** drop the stale entries in front */
+    void skip_stale() {
+        while (!order.empty())
+        {
+            auto it = cmds.find(order.front());
+            if (it != cmds.end() && !it->second.taken) break;
+            order.pop_front();
+        }
+    }
+
+    public:
+    Mempool(): nfree(0), nfree_bytes(0) {}
+
+    /** Propose the commands in the order of `p` instead of the oldest
+     * first (nullptr to go back to that). */
+    void set_order(std::unique_ptr<CmdOrder> p) {
+        policy = std::move(p);
+        if (!policy) return;
+        for (const auto &h: order)
+        {
+            auto it = cmds.find(h);
+            if (it != cmds.end() && !it->second.taken)
+                policy->push(h, it->second.client, false);
+        }
+    }
+
+    /** @return false if the command is already in the pool */
+    bool add(const uint256_t &cmd_hash, uint32_t size, bool taken = false,
+            uint32_t client = 0) {
+        if (!cmds.insert(std::make_pair(cmd_hash,
+                        Entry{true, size, client, clock_t::now()})).second)
+            return false;
+        if (taken) return true;
+        set_taken(cmds.find(cmd_hash)->second, false);
+        order.push_back(cmd_hash);
+        if (policy) policy->push(cmd_hash, client, false);
+        return true;
+    }
+
+    /** Take up to `n` commands, in the order of the policy if there is
+     * one and the oldest first otherwise, and (unless 0) no more than
+     * `max_bytes` of them (but at least one). */
+    std::vector<uint256_t> take(size_t n, size_t max_bytes = 0) {
+        std::vector<uint256_t> ret;
+        size_t nbytes = 0;
+        if (policy)
+        {
+            uint256_t h;
+            policy->begin_block(n);
+            while (ret.size() < n && policy->peek(h))
+            {
+                auto it = cmds.find(h);
+                if (it == cmds.end() || it->second.taken)
+                {
+                    policy->pop(0);
+                    continue;
+                }
+                auto &e = it->second;
+                if (max_bytes && !ret.empty() && nbytes + e.size > max_bytes)
+                    break;
+                nbytes += e.size;
+                set_taken(e, true);
+                ret.push_back(h);
+                /* a command of unknown size still counts */
+                policy->pop(std::max(e.size, (uint32_t)1));
+            }
+            return ret;
+        }
+        while (ret.size() < n)
+        {
+            skip_stale();
+            if (order.empty()) break;
+            auto &e = cmds.find(order.front())->second;
+            if (max_bytes && !ret.empty() && nbytes + e.size > max_bytes)
+                break;
+            nbytes += e.size;
+            set_taken(e, true);
+            ret.push_back(order.front());
+            order.pop_front();
+        }
+        return ret;
+    }
+
+    /** The commands are in a block proposed by someone. Those not in the
+     * pool yet are kept as taken, so that they are not proposed again if
+     * they arrive here later. */
+    void mark_taken(const std::vector<uint256_t> &cmd_hashes) {
+        for (const auto &h: cmd_hashes)
+        {
+            auto it = cmds.find(h);
+            if (it == cmds.end())
+                cmds.insert(std::make_pair(h, Entry{true, 0, 0, clock_t::now()}));
+            else if (!it->second.taken)
+                set_taken(it->second, true);
+        }
+        maybe_compact();
+    }
+
+    /** The commands are back for proposing, ahead of the newer ones. */
+    void untake(const std::vector<uint256_t> &cmd_hashes) {
+        for (auto h = cmd_hashes.rbegin(); h != cmd_hashes.rend(); h++)
+        {
+            auto it = cmds.find(*h);
+            if (it == cmds.end() || !it->second.taken) continue;
+            set_taken(it->second, false);
+            order.push_front(*h);
+            if (policy) policy->push(*h, it->second.client, true);
+        }
+    }
+
+    /** The command is decided. */
+    void remove(const uint256_t &cmd_hash) {
+        auto it = cmds.find(cmd_hash);
+        if (it == cmds.end()) return;
+        if (!it->second.taken) set_taken(it->second, true);
+        cmds.erase(it);
+        maybe_compact();
+    }
+
+    /** Drop the command unless it is in a block. @return true if dropped */
+    bool remove_free(const uint256_t &cmd_hash) {
+        if (!is_free(cmd_hash)) return false;
+        remove(cmd_hash);
+        return true;
+    }
+
+    /** When the oldest command not taken arrived (if there is one). */
+    bool get_oldest_arrival(clock_t::time_point &t) {
+        skip_stale();
+        if (order.empty()) return false;
+        t = cmds.find(order.front())->second.arrival;
+        return true;
+    }
+
+    size_t size() const { return cmds.size(); }
+    /** the number of commands not taken */
+    size_t get_nfree() const { return nfree; }
+    /** their total size */
+    size_t get_nfree_bytes() const { return nfree_bytes; }
+
+    /** Call `f` with the hash of every command in the pool, taken or not. */
+    template<typename F>
+    void for_each(F f) const {
+        for (const auto &p: cmds) f(p.first);
+    }
+
+    /** Call `f` with the hash and size of every command not taken. */
+    template<typename F>
+    void for_each_free(F f) const {
+        for (const auto &p: cmds)
+            if (!p.second.taken) f(p.first, p.second.size);
+    }
+};
+
+/** The most recently decided commands with their decisions, so that a
+ * command submitted again, or relayed through several replicas, is answered
+ * instead of being proposed a second time. The oldest ones are forgotten
+ * once the window would take more than its memory budget. */
+class DecidedWindow {
+    FlatHashMap<uint256_t, Finality> fins;
+    std::deque<uint256_t> order;
+    size_t capacity;
+    /** how many were ever added */
+    uint64_t nadded;
+
+    void evict() {
+        while (order.size() > capacity)
+        {
+            fins.erase(order.front());
+            order.pop_front();
+        }
+    }
+
+    public:
+    /** the memory taken per command, counting the slack of the table (up
+     * to half empty after growing) and of the queue */
+    static const size_t entry_bytes =
+        2 * (sizeof(std::pair<const uint256_t, Finality>) + 1) + sizeof(uint256_t);
+
+    DecidedWindow(size_t budget = 64 << 20): nadded(0) { set_budget(budget); }
+
+    void set_budget(size_t budget) {
+        capacity = std::max(budget / entry_bytes, (size_t)1);
+        evict();
+    }
+
+    void add(const Finality &fin) {
+        if (!fins.insert(std::make_pair(fin.cmd_hash, fin)).second) return;
+        order.push_back(fin.cmd_hash);
+        nadded++;
+        evict();
+    }
+
+    /** Copies the decision on `cmd_hash` into `fin` if it is known. */
+    bool find(const uint256_t &cmd_hash, Finality &fin) const {
+        auto it = fins.find(cmd_hash);
+        if (it == fins.end()) return false;
+        fin = it->second;
+        return true;
+    }
+
+    size_t count(const uint256_t &cmd_hash) const { return fins.count(cmd_hash); }
+    size_t size() const { return fins.size(); }
+    /** A command not decided by the time get_nadded() reaches this, if
+     * added now, would no longer be told apart from one decided before. */
+    uint64_t get_horizon() const { return nadded + capacity; }
+    uint64_t get_nadded() const { return nadded; }
+};
+
+/** The bulk (catch-up) traffic lane. Consensus messages are sent straight
+ * to the connection, while bulk responses are queued per peer, served
+ * round-robin and released by a token bucket. A syncing peer can
+ * therefore never fill the shared send queue ahead of votes, notifies and
+ * blames. A rate of 0 disables shaping. */
+class BulkLane {
+    public:
+    using send_cb_t = std::function<void()>;
+
+    private:
+    using clock_t = std::chrono::steady_clock;
+    struct Item {
+        size_t size;
+        send_cb_t send;
+    };
+    struct PeerQueue {
+        std::queue<Item> items;
+        size_t nbytes = 0;
+    };
+
+    TimerEvent timer;
+    bool timer_armed;
+    std::unordered_map<NetAddr, PeerQueue> queues;
+    /** peers with queued items, in round-robin order */
+    std::queue<NetAddr> ready;
+    /** bytes per second */
+    double rate;
+    /** maximum bytes released at once */
+    double burst;
+    double tokens;
+    clock_t::time_point last_refill;
+    /** bytes a single peer may have queued */
+    size_t peer_quota;
+    size_t nqueued;
+    size_t nqueued_bytes;
+
+    void refill() {
+        auto now = clock_t::now();
+        tokens = std::min(burst, tokens +
+            std::chrono::duration<double>(now - last_refill).count() * rate);
+        last_refill = now;
+    }
+
+    void drain() {
+        refill();
+        while (!ready.empty() && tokens > 0)
+        {
+            auto addr = ready.front();
+            ready.pop();
+            auto &q = queues[addr];
+            auto item = std::move(q.items.front());
+            q.items.pop();
+            q.nbytes -= item.size;
+            nqueued--;
+            nqueued_bytes -= item.size;
+            tokens -= item.size;
+            item.send();
+            if (!q.items.empty()) ready.push(addr);
+        }
+        if (!ready.empty() && !timer_armed)
+        {
+            timer_armed = true;
+            timer.add(std::max(1e-3, -tokens / rate));
+        }
+    }
+
+    public:
+    BulkLane(const EventContext &ec):
+        timer(ec, [this](TimerEvent &) {
+            timer_armed = false;
+            drain();
+        }),
+        timer_armed(false), rate(0), burst(0), tokens(0),
+        last_refill(clock_t::now()), peer_quota(4 << 20),
+        nqueued(0), nqueued_bytes(0) {}
+
+    BulkLane(const BulkLane &) = delete;
+    BulkLane &operator=(const BulkLane &) = delete;
+
+    void set_rate(double _rate, double _burst) {
+        rate = _rate;
+        burst = std::max(_burst, 1.0);
+        tokens = burst;
+        last_refill = clock_t::now();
+    }
+
+    void set_peer_quota(size_t quota) { peer_quota = quota; }
+
+    /** Whether `addr` may queue more (always true when unshaped). */
+    bool has_quota(const NetAddr &addr) const {
+        if (rate <= 0) return true;
+        auto it = queues.find(addr);
+        return it == queues.end() || it->second.nbytes < peer_quota;
+    }
+
+    /** Send a bulk message of `size` bytes to `addr` once the budget allows. */
+    void enqueue(const NetAddr &addr, size_t size, send_cb_t send) {
+        if (rate <= 0)
+        {
+            send();
+            return;
+        }
+        auto &q = queues[addr];
+        if (q.items.empty()) ready.push(addr);
+        q.items.push(Item{size, std::move(send)});
+        q.nbytes += size;
+        nqueued++;
+        nqueued_bytes += size;
+        drain();
+    }
+
+    size_t size() const { return nqueued; }
+    size_t size_bytes() const { return nqueued_bytes; }
+};
 
 /** HotStuff protocol (with network implementation). */
 class HotStuffBase: public HotStuffCore {
@@ -176,22 +1088,40 @@ class HotStuffBase: public HotStuffCore {
 
     public:
     using Net = PeerNetwork<opcode_t>;
-    using commit_cb_t = std::function<void(const Finality &)>;
 
     protected:
     /** the binding address in replica network */
     NetAddr listen_addr;
-    /** the block size */
+    /** the most commands in a block */
     size_t blk_size;
     /** libevent handle */
     EventContext ec;
     salticidae::ThreadCall tcall;
     VeriPool vpool;
     std::vector<NetAddr> peers;
+    /** peers still speaking wire version 0 / already upgraded to version 1 */
+    std::vector<NetAddr> legacy_peers;
+    std::vector<NetAddr> compact_peers;
+    /** the wire format versions announced by the peers */
+    std::unordered_map<NetAddr, uint8_t> peer_version;
     std::unordered_map<uint32_t, TimerEvent> commit_timers;
     TimerEvent blame_timer;
     TimerEvent viewtrans_timer;
     TimerEvent status_timer;
+    /** rate-shaped lane for block responses */
+    BulkLane bulk_lane;
+    /** pending commands, held by every replica */
+    Mempool mempool;
+    /** recently decided commands, against duplicates */
+    DecidedWindow decided;
+    /** Admission control: the commands taken by exec_command() and not
+     * decided yet (counted from any thread), and the most of them (0: no
+     * limit). They bound decision_waiting and the app's
+     * own bookkeeping of the clients waiting. */
+    std::atomic<size_t> cmd_admitted;
+    size_t cmd_admitted_max;
+    /** commands turned away as busy */
+    mutable std::atomic<uint32_t> part_cmd_busy;
 
     private:
     /** whether libevent handle is owned by itself */
@@ -203,16 +1133,288 @@ class HotStuffBase: public HotStuffCore {
 #endif
     pacemaker_bt pmaker;
     /* queues for async tasks */
-    std::unordered_map<const uint256_t, BlockFetchContext> blk_fetch_waiting;
-    std::unordered_map<const uint256_t, BlockDeliveryContext> blk_delivery_waiting;
-    std::unordered_map<const uint256_t, commit_cb_t> decision_waiting;
-    using cmd_queue_t = salticidae::MPSCQueueEventDriven<std::pair<uint256_t, commit_cb_t>>;
-    cmd_queue_t cmd_pending;
-    std::queue<uint256_t> cmd_pending_buffer;
+    FlatHashMap<uint256_t, BlockFetchContext> blk_fetch_waiting;
+    FlatHashMap<uint256_t, BlockDeliveryContext> blk_delivery_waiting;
+    /** Blocks to be delivered -> a promise resolved to true if a verified
+     * QC certifies a descendant of them (or themselves). Such a block is
+     * bound to the certified one by hash links, so during catch-up only the
+     * newest QC has its signatures checked. */
+    std::unordered_map<const uint256_t, promise_t> blk_vouched;
+    /** the completion handles of the commands submitted here, and those
+     * of any more submissions of the same commands */
+    FlatHashMap<uint256_t, uint64_t> decision_waiting;
+    std::unordered_multimap<uint256_t, uint64_t> decision_waiting_dup;
+    /** a slot of the ingestion ring */
+    struct PendingCmd {
+        uint256_t cmd_hash;
+        uint32_t cmd_size;
+        /** who the command is from, as far as fair ordering goes */
+        uint32_t client;
+        uint64_t handle;
+        /** only with batching on; owned by the slot */
+        bytearray_t *payload;
+        /** the command itself, for the command store, if given */
+        command_t cmd;
+    };
+    using cmd_ring_t = MPSCRing<PendingCmd>;
+    cmd_ring_t cmd_pending;
+    /** votes and blames whose verification is under way, so that their
+     * duplicates are not verified again */
+    std::unordered_map<const uint256_t, std::unordered_set<ReplicaID>> vote_inflight;
+    std::unordered_set<ReplicaID> blame_inflight;
+
+    /** A paged fetch of the ancestors of a block, requested from one peer
+     * with up to blk_range_window pages in flight. */
+    struct RangeFetch {
+        NetAddr peer;
+        /** nothing below the highest delivered height is requested */
+        uint32_t min_height;
+        /** offset of the next page to request */
+        uint32_t next_offset;
+        size_t ninflight;
+        /** set once the fetched blocks reach what we already have, or
+         * the peer has nothing further */
+        bool done;
+        /** block fetches held back while this range covers them */
+        std::vector<uint256_t> deferred;
+        TimerEvent timeout;
+    };
+    std::unordered_map<const uint256_t, RangeFetch> range_fetching;
+    /** blocks on the chain of an active range fetch -> its anchor */
+    std::unordered_map<const uint256_t, uint256_t> range_members;
+    /** Blocks delivered header-only, waiting for their bodies (or bodies
+     * that arrived before their headers). */
+    struct BodyWaiting {
+        NetAddr peer;
+        /** a body received ahead of its header */
+        bool early;
+        uint256_t body_digest;
+        std::vector<uint256_t> cmds;
+        TimerEvent timeout;
+    };
+    std::unordered_map<const uint256_t, BodyWaiting> body_waiting;
+    /** whether bodies go to the peers that take them as short ids */
+    bool short_ids;
+    /** Bodies received as short ids, waiting for the commands that did
+     * not match anything here. */
+    struct ShortBody {
+        std::vector<uint256_t> cmds;
+        std::vector<uint32_t> missing;
+        /** the proposer, asked for the missing ones */
+        NetAddr peer;
+        TimerEvent timeout;
+    };
+    std::unordered_map<const uint256_t, ShortBody> short_bodies;
+
+    /** Payload dissemination, decoupled from ordering (off if batch_size
+     * is 0). Commands from clients are packed into batches, which workers
+     * encode and hash before they are broadcast. Every replica tells all
+     * the others which batches it holds; a batch held by f + 1 replicas
+     * goes into the mempool by its digest, so blocks only order digests.
+     * A committed block is executed once all its batches are here, fetched
+     * if need be. */
+    size_t batch_size;
+    double batch_wait;
+    Batch batch_out;
+    TimerEvent batch_timer;
+    struct BatchEntry {
+        /** null while the batch is only heard of */
+        RcObj<Batch> batch;
+        std::unordered_set<NetAddr> holders;
+        bool available;
+        /** counted in nbatch_bytes until decided */
+        bool pending;
+        /** the peer it was pushed by, null if ours or asked for */
+        NetAddr origin;
+        BatchEntry(): available(false), pending(false) {}
+    };
+    FlatHashMap<uint256_t, BatchEntry> batches;
+    size_t nbatch_unheld;
+    /** the bytes of the undecided batches held, in all and by pusher */
+    size_t nbatch_bytes;
+    std::unordered_map<NetAddr, size_t> batch_pushed;
+    /** executed batches, kept for a while for the replicas behind */
+    std::deque<uint256_t> batch_retired;
+    /** batches wanted for execution -> how many times asked for */
+    std::unordered_map<const uint256_t, size_t> batch_fetching;
+    TimerEvent batch_fetch_timer;
+
+    /** Mempool reconciliation, for clients that do not send commands to
+     * every replica (off if recon_period is 0, or with batching, which
+     * disseminates the commands already). Every period, the commands here
+     * not in a block go as an IBLT to the next peer in turn, which lists
+     * the difference from its own, takes what it lacks and sends back what
+     * we lack. The table for a peer is sized after the last difference
+     * found, and doubled after a failure. A command learned this way takes
+     * an admission slot, is not passed on, and is dropped if it is not in a
+     * block before the decided window has moved past it. */
+    double recon_period;
+    TimerEvent recon_timer;
+    size_t recon_next;
+    uint32_t recon_round;
+    struct ReconPeer {
+        size_t ncells;
+        /** the round waiting for a response, 0 if none */
+        uint32_t round;
+        /** when its last request was answered */
+        Mempool::clock_t::time_point last_req;
+    };
+    std::unordered_map<NetAddr, ReconPeer> recon_peers;
+    /** the commands learned and not decided -> their horizon in `decided` */
+    FlatHashMap<uint256_t, uint64_t> recon_learned;
+    std::deque<std::pair<uint64_t, uint256_t>> recon_learned_order;
+
+    /** the highest height each peer is known to have delivered, from the
+     * watermarks it sends, its votes and what has been pushed to it */
+    std::unordered_map<const NetAddr, uint32_t> peer_watermark;
+    /** per-peer latency of block fetches */
+    mutable std::unordered_map<const NetAddr, PeerFetchStat> fetch_stat;
+
+    /** The peer in `candidates`, and not in `excluded`, expected to answer a
+     * fetch the fastest; nullptr if there is none. */
+    template<typename C, typename E>
+    const NetAddr *pick_fetch_peer(const C &candidates, const E &excluded) {
+        const NetAddr *best = nullptr;
+        double best_score = 0;
+        for (const auto &addr: candidates)
+        {
+            if (excluded.count(addr)) continue;
+            double score = fetch_stat[addr].get_score();
+            if (!best || score < best_score)
+            {
+                best = &addr;
+                best_score = score;
+            }
+        }
+        return best;
+    }
+
+    /** How long to wait for `addr` before hedging a fetch. */
+    double get_hedge_delay(const NetAddr &addr) {
+        const auto &st = fetch_stat[addr];
+        if (st.get_nsamples() < 8) return fetch_hedge_default;
+        return std::min(std::max(st.get_rtt_quantile(0.95) * 1.5, fetch_hedge_min),
+                        ent_waiting_timeout);
+    }
+    /** the highest height delivered so far */
+    uint32_t delivered_height;
+
+    /** A block is proposed as soon as `target` commands or `max_bytes` of
+     * them (0: no limit) are pending, or the oldest one has waited for
+     * `max_wait` seconds (0: forever). The target moves within
+     * [1, blk_size]: up while commands queue up, down while blocks take
+     * much longer to commit than they can. */
+    struct BlockAssembly {
+        size_t target;
+        size_t max_bytes;
+        double max_wait;
+        TimerEvent deadline;
+        /** own blocks not yet committed -> when they were proposed */
+        FlatHashMap<uint256_t, Mempool::clock_t::time_point> proposed;
+        /** moving average and minimum of their commit latency */
+        double latency;
+        double latency_min;
+    } assembly;
+
+    /** checkpoints: committed heights between two of them (0 disables),
+     * and the latest one with its application state */
+    uint32_t snapshot_interval;
+    Snapshot snapshot;
+    uint256_t snapshot_digest;
+    std::vector<bytearray_t> snapshot_chunks;
+
+    /** Bootstrap from a snapshot vouched for by f + 1 replicas, so that a
+     * lagging or new replica does not replay the chain from genesis. */
+    struct SnapshotSync {
+        bool enabled;
+        bool active;
+        size_t nretry;
+        /** snapshot headers by digest, with the replicas offering them */
+        std::unordered_map<const uint256_t,
+            std::pair<Snapshot, std::unordered_set<NetAddr>>> offers;
+        /** the digest being downloaded (null while still collecting) */
+        uint256_t digest;
+        std::vector<NetAddr> sources;
+        std::vector<bytearray_t> chunks;
+        std::vector<bool> received;
+        size_t nreceived;
+        size_t next_chunk;
+        size_t ninflight;
+        /** rotates the chunk sources on every retry */
+        size_t round;
+        TimerEvent timeout;
+    } ssync;
+
+    void note_watermark(const NetAddr &addr, uint32_t height) {
+        auto &wm = peer_watermark[addr];
+        wm = std::max(wm, height);
+    }
+    /** Wait for the body of the header-only block `blk` announced by
+     * `peer`, fetching the full block if it is late, from `peer` first and
+     * then from the other replicas. */
+    void wait_body(const block_t &blk, const NetAddr &peer);
+    /** Stop waiting for, and fetching, the body of a header-only block. */
+    void drop_body_fetch(const uint256_t &blk_hash);
+    void fill_body(const block_t &blk, std::vector<uint256_t> &&cmds);
+    /** A body has arrived, whatever its encoding. */
+    void on_body(const uint256_t &blk_hash, std::vector<uint256_t> &&cmds,
+                const uint256_t &body_digest);
+    /** Send the body of `blk` to the compact peers. */
+    void multicast_body(const block_t &blk);
+    uint8_t get_peer_version(const NetAddr &addr) const {
+        auto it = peer_version.find(addr);
+        return it == peer_version.end() ? 0 : it->second;
+    }
+    /** Start a reconciliation round with the next peer. */
+    void recon_step();
+    /** the IBLT of the commands not in a block */
+    IBLT make_recon_iblt(size_t ncells, uint64_t salt) const;
+    /** Take the commands a peer found we lack. */
+    void recon_learn(const std::vector<std::pair<uint256_t, uint32_t>> &cmds);
+    /** Drop the learned commands the decided window has moved past. */
+    void recon_expire();
+    /** Admission control, then hand `e` over to the event loop. */
+    bool admit_cmd(const PendingCmd &e);
+    void wait_decision(const uint256_t &cmd_hash, uint64_t handle);
+    /** Free the admission slot of a command and report it. */
+    void finish_cmd(const Finality &fin, uint64_t handle);
+    void add_to_batch(const uint256_t &cmd_hash, bytearray_t &&payload);
+    /** Encode and broadcast the batch being filled. */
+    void seal_batch();
+    /** Keep `batch`, pushed by `origin` (null if ours or asked for).
+     * @return false if it was held already, or is over the bounds */
+    bool hold_batch(const uint256_t &digest, RcObj<Batch> &&batch,
+                    const NetAddr &origin = NetAddr());
+    /** Stop counting a held batch against the bounds, once decided. */
+    void settle_batch(BatchEntry &e);
+    void note_batch_holder(const uint256_t &digest, const NetAddr &holder);
+    /** Ask for the batches in `digests` not asked for yet. */
+    void fetch_batches(const std::vector<uint256_t> &digests);
+    /** Ask (again) for `digests`, each from a replica known to hold it, or
+     * any other one. */
+    void request_batches(const std::vector<uint256_t> &digests);
+    /** Decide a command (or batch digest) of a committed block, executing
+     * it unless the block is covered by a snapshot. */
+    void decide(Finality &&fin, bool execute);
+    void decide_cmd(Finality &&fin, bool execute);
+    /** Propose the blocks due from the mempool if this replica is the
+     * proposer, and set the deadline for the next one. */
+    void propose_from_mempool();
+    /** Take up to `assembly.target` commands and propose them. */
+    void propose_batch();
+    void adapt_blk_target(const block_t &blk);
+    /* a replica can become the proposer without new commands arriving */
+    void reg_mempool_hqc_update();
+    void reg_mempool_view_change();
+    /** Push to each peer the ancestors of `blk` it is known to lack, ahead
+     * of the proposal of `blk`. */
+    void push_missing_blks(const block_t &blk);
 
     /* statistics */
     uint64_t fetched;
     uint64_t delivered;
+    /** signature verifications skipped by the pre-verification filters */
+    uint64_t verify_avoided;
     mutable uint64_t nsent;
     mutable uint64_t nrecv;
 
@@ -221,21 +1423,47 @@ class HotStuffBase: public HotStuffCore {
     mutable uint32_t part_delivered;
     mutable uint32_t part_decided;
     mutable uint32_t part_gened;
+    mutable uint32_t part_verify_avoided;
+    mutable uint32_t part_pushed;
+    mutable uint32_t part_vouched;
+    mutable uint32_t part_abandoned;
+    mutable uint32_t part_dup_cmds;
+    /** short ids resolved here / asked for */
+    mutable uint32_t part_sid_hit;
+    mutable uint32_t part_sid_miss;
+    mutable uint32_t part_recon_rounds;
+    mutable uint32_t part_recon_failed;
+    mutable uint32_t part_recon_learned;
+    mutable uint64_t part_recon_bytes;
     mutable double part_delivery_time;
     mutable double part_delivery_time_min;
     mutable double part_delivery_time_max;
     mutable std::unordered_map<const NetAddr, uint32_t> part_fetched_replica;
+#ifdef HOTSTUFF_MSG_STAT
+    mutable std::unordered_map<opcode_t, MsgTypeStat> part_msg_stat;
+    /** CPU time (ns) spent by the workers decoding each message type */
+    mutable std::array<std::atomic<uint64_t>, 256> part_decode_ns;
+#endif
+
+    void stat_sent(opcode_t opcode, size_t size, size_t ncopies = 1) {
+#ifdef HOTSTUFF_MSG_STAT
+        part_msg_stat[opcode].add_sent(size, ncopies);
+#endif
+    }
 
     void on_fetch_cmd(const command_t &cmd);
     void on_fetch_blk(const block_t &blk);
     void on_deliver_blk(const block_t &blk);
 
     /** deliver consensus message: <propose> */
-    inline void propose_handler(MsgPropose &&, const Net::conn_t &);
+    template<typename M>
+    inline void propose_handler(M &&, const Net::conn_t &);
     /** deliver consensus message: <vote> */
-    inline void vote_handler(MsgVote &&, const Net::conn_t &);
+    template<typename M>
+    inline void vote_handler(M &&, const Net::conn_t &);
     inline void notify_handler(MsgNotify &&, const Net::conn_t &);
-    inline void status_handler(MsgStatus &&, const Net::conn_t &);
+    template<typename M>
+    inline void status_handler(M &&, const Net::conn_t &);
     inline void blame_handler(MsgBlame &&, const Net::conn_t &);
     inline void blamenotify_handler(MsgBlameNotify &&, const Net::conn_t &);
 
@@ -244,18 +1472,161 @@ class HotStuffBase: public HotStuffCore {
     /** fetches full block data */
     inline void req_blk_handler(MsgReqBlock &&, const Net::conn_t &);
     /** receives a block */
-    inline void resp_blk_handler(MsgRespBlock &&, const Net::conn_t &);
+    template<typename M>
+    inline void resp_blk_handler(M &&, const Net::conn_t &);
+    /** receives the body of a block sent header-first */
+    inline void blk_body_handler(MsgBlockBody &&, const Net::conn_t &);
+    /** receives the body of a block as short ids */
+    inline void blk_body_short_handler(MsgBlockBodyShort &&, const Net::conn_t &);
+    /** serves the commands of a body that short ids did not resolve */
+    inline void req_body_cmds_handler(MsgReqBodyCmds &&, const Net::conn_t &);
+    inline void resp_body_cmds_handler(MsgRespBodyCmds &&, const Net::conn_t &);
+    /** reconciles the mempool with a peer's */
+    inline void recon_req_handler(MsgReconReq &&, const Net::conn_t &);
+    inline void recon_resp_handler(MsgReconResp &&, const Net::conn_t &);
+    /** receives a batch, from the replica that made it or on request */
+    inline void batch_handler(MsgBatch &&, const Net::conn_t &);
+    /** learns that a replica holds a batch */
+    inline void batch_ack_handler(MsgBatchAck &&, const Net::conn_t &);
+    /** serves batches */
+    inline void req_batch_handler(MsgReqBatch &&, const Net::conn_t &);
+    /** learns the wire format version of a peer */
+    inline void hello_handler(MsgHello &&, const Net::conn_t &);
+    /** serves a page of ancestors */
+    inline void req_blk_range_handler(MsgReqBlockRange &&, const Net::conn_t &);
+    /** receives a page of ancestors */
+    inline void resp_blk_range_handler(MsgRespBlockRange &&, const Net::conn_t &);
+
+    /** Fetch the ancestors of `anchor` (the missing first parent of `blk`)
+     * in pages. */
+    RangeFetch *start_range_fetch(const block_t &blk, const uint256_t &anchor,
+                            const NetAddr &replica_id);
+    /** Keep up to blk_range_window pages of a range fetch in flight. */
+    void pump_range_fetch(const uint256_t &anchor);
+    /** Release the held-back fetches and forget the range fetch. */
+    void finish_range_fetch(const uint256_t &anchor);
+    /** The active range fetch whose chain contains `blk_hash`, if any. */
+    RangeFetch *find_range_fetch(const uint256_t &blk_hash);
+    promise_t _async_deliver_blk(const uint256_t &blk_hash, const NetAddr &replica_id,
+                                bool fetch_now, uint32_t depth);
+    /** Let the delivery of `blk_hash` skip its QC check if `pm` resolves
+     * to true. */
+    void add_vouch(const uint256_t &blk_hash, const promise_t &pm);
+    /** The vouching promise for `blk_hash` (resolved to false if none). */
+    promise_t take_vouch(const uint256_t &blk_hash);
+
+    /** serves the header of the latest snapshot */
+    inline void req_snapshot_handler(MsgReqSnapshot &&, const Net::conn_t &);
+    /** collects snapshot offers */
+    inline void snapshot_handler(MsgSnapshot &&, const Net::conn_t &);
+    /** serves a chunk of the latest snapshot */
+    inline void req_snapshot_chunk_handler(MsgReqSnapshotChunk &&, const Net::conn_t &);
+    /** receives a chunk of the snapshot being downloaded */
+    inline void snapshot_chunk_handler(MsgSnapshotChunk &&, const Net::conn_t &);
+
+    /** Take a checkpoint at the executed block `blk`, if one is due. */
+    void take_snapshot(const block_t &blk);
+    void start_snapshot_sync();
+    /** Start downloading the chunks of the offer with `digest`. */
+    void begin_snapshot_download(const uint256_t &digest);
+    /** Keep up to snapshot_chunk_window chunk requests in flight. */
+    void pump_snapshot_sync();
+    void on_snapshot_sync_timeout();
+    void finish_snapshot_sync();
 
     inline promise_t verify_notify(Notify &notify);
+    void avoid_verify() {
+        verify_avoided++;
+        part_verify_avoided++;
+    }
+
+    /** Run `msg->decode()` on the worker pool; resolves to false if the
+     * message is ill-formed. */
+    template<typename M>
+    promise_t async_decode(const RcObj<M> &msg) {
+#ifdef HOTSTUFF_MSG_STAT
+        return vpool.verify(new MsgDecodeTask<M>(msg, this, &part_decode_ns[M::opcode]));
+#else
+        return vpool.verify(new MsgDecodeTask<M>(msg, this));
+#endif
+    }
+
+    promise_t async_run(std::function<bool()> &&work) {
+        return vpool.verify(new OffloadTask(std::move(work)));
+    }
+
+    /** Look up `blk_hashes` and encode the response to a block request on a
+     * worker, then queue it for `replica` on the bulk lane. */
+    template<typename M>
+    void serve_blks(std::vector<uint256_t> &&blk_hashes, const NetAddr &replica);
 
     template<typename T, typename M>
     void _do_broadcast(const T &t) {
-        //M m(t);
-        pn.multicast_msg(M(t), peers);
+        M m(t);
+        stat_sent(M::opcode, m.serialized.size(), peers.size());
+        pn.multicast_msg(m, peers);
         //for (const auto &replica: peers)
         //    pn.send_msg(m, replica);
     }
 
+    /** Broadcast with the encoding each peer negotiated. */
+    template<typename T, typename M, typename MC>
+    void _do_broadcast(const T &t) {
+        if (!legacy_peers.empty())
+        {
+            M m(t);
+            stat_sent(M::opcode, m.serialized.size(), legacy_peers.size());
+            pn.multicast_msg(m, legacy_peers);
+        }
+        if (!compact_peers.empty())
+        {
+            MC m(t);
+            stat_sent(MC::opcode, m.serialized.size(), compact_peers.size());
+            pn.multicast_msg(m, compact_peers);
+        }
+    }
+
+    template<typename T, typename M, typename U>
+    void _do_broadcast(const T &t, const U &u) {
+        M m(t, u);
+        stat_sent(M::opcode, m.serialized.size(), peers.size());
+        pn.multicast_msg(m, peers);
+    }
+
+    template<typename M>
+    void _do_send(const M &m, const NetAddr &addr) {
+        stat_sent(M::opcode, m.serialized.size());
+        pn.send_msg(m, addr);
+    }
+
+    bool is_compact_peer(const NetAddr &addr) const {
+        return std::find(compact_peers.begin(), compact_peers.end(), addr) != compact_peers.end();
+    }
+
+    /** Send to one peer with the encoding it negotiated. */
+    template<typename T, typename M, typename MC>
+    void _do_send(const T &t, const NetAddr &addr) {
+        if (is_compact_peer(addr))
+            _do_send(MC(t), addr);
+        else
+            _do_send(M(t), addr);
+    }
+
+    template<typename T, typename M, typename MC, typename U>
+    void _do_send(const T &t, const U &u, const NetAddr &addr) {
+        if (is_compact_peer(addr))
+            _do_send(MC(t, u), addr);
+        else
+            _do_send(M(t, u), addr);
+    }
+
+    template<typename M>
+    void _do_send_bulk(const RcObj<M> &m, const NetAddr &addr) {
+        bulk_lane.enqueue(addr, m->serialized.size(), [this, m, addr]() {
+            _do_send(*m, addr);
+        });
+    }
+
     void do_broadcast_proposal(const Proposal&) override;
 
 
@@ -270,10 +1641,10 @@ class HotStuffBase: public HotStuffCore {
                 //on_receive_vote(vote);
             }
             else
-                pn.send_msg(MsgVote(vote), get_config().get_addr(proposer));
+                _do_send<Vote, MsgVote, MsgVoteCompact>(vote, get_config().get_addr(proposer));
         });
 #else
-        _do_broadcast<Vote, MsgVote>(vote);
+        _do_broadcast<Vote, MsgVote, MsgVoteCompact>(vote);
 #endif
 
     }
@@ -294,7 +1665,7 @@ class HotStuffBase: public HotStuffCore {
     }
 
     void do_broadcast_new_view(const Status &status) override {
-        _do_broadcast<Status, MsgNewView>(status);
+        _do_broadcast<Status, MsgNewView>(status, delivered_height);
     }
 
     void do_status(const Status &status) override;
@@ -312,14 +1683,31 @@ class HotStuffBase: public HotStuffCore {
     void stop_status_timer() override;
 
     void do_decide(Finality &&) override;
+    void do_skip(const block_t &blk) override;
     void do_consensus(const block_t &blk) override;
+    void do_commit(const block_t &blk, bool certified) override;
+    void do_abandon(const block_t &blk) override;
+    bool is_payload_ready(const block_t &blk) override;
+    bool is_vote_ready(const block_t &blk) override;
 
     protected:
 
+    /** Called on every checkpoint, right after the checkpointed block is
+     * executed: returns the serialized application state. */
+    virtual bytearray_t get_app_snapshot() { return bytearray_t(); }
+    /** Called to replace the application state with one returned by
+     * get_app_snapshot() on another replica. */
+    virtual void install_app_snapshot(const bytearray_t &) {}
+
     /** Called to replicate the execution of a command, the application should
      * implement this to make transition for the application state. */
     virtual void state_machine_execute(const Finality &) = 0;
 
+    /** Called with the decision on a command submitted through
+     * exec_command(), and the handle it was submitted with (once per
+     * submission). */
+    virtual void do_cmd_done(const Finality &, uint64_t /*handle*/) {}
+
     public:
     HotStuffBase(uint32_t blk_size,
             ReplicaID rid,
@@ -334,14 +1722,84 @@ class HotStuffBase: public HotStuffCore {
 
     /* the API for HotStuffBase */
 
-    /* Submit the command to be decided. */
-    void exec_command(uint256_t cmd_hash, commit_cb_t callback);
+    /* Submit the command to be decided, on behalf of `client`. Thread-safe.
+     * Its decision is reported to do_cmd_done() along with `handle`.
+     * @return false if the replica is too busy to take it */
+    bool exec_command(const uint256_t &cmd_hash, uint64_t handle,
+                    uint32_t cmd_size = 0, uint32_t client = 0);
+    /* Same as above, with the payload of the command, disseminated in a
+     * batch if batching is on. */
+    bool exec_command(const uint256_t &cmd_hash, bytearray_t &&payload,
+                    uint64_t handle, uint32_t client = 0);
+    /* Same as the first, with the command kept in the command store (see
+     * find_cmd()) until decided, and while blocks refer to it. */
+    bool exec_command(const command_t &cmd, uint64_t handle,
+                    uint32_t cmd_size = 0, uint32_t client = 0);
+    /** How many more commands exec_command() would take now. Thread-safe. */
+    uint32_t get_cmd_credit() const {
+        if (!cmd_admitted_max) return UINT32_MAX;
+        size_t n = cmd_admitted.load();
+        return n < cmd_admitted_max ?
+            (uint32_t)std::min(cmd_admitted_max - n, (size_t)UINT32_MAX) : 0;
+    }
     void start(std::vector<std::pair<NetAddr, pubkey_bt>> &&replicas,double delta, bool ec_loop = false);
 
     size_t size() const { return peers.size(); }
     const auto &get_decision_waiting() const { return decision_waiting; }
     ThreadCall &get_tcall() { return tcall; }
     PaceMaker *get_pace_maker() { return pmaker.get(); }
+    /** Limit block responses to `rate` bytes/sec with bursts of up to `burst`
+     * bytes (0 disables shaping). */
+    void set_bulk_rate(double rate, double burst) { bulk_lane.set_rate(rate, burst); }
+    /** Limit how many bytes of block responses a single peer may have
+     * queued; beyond that its requests are answered as missing. */
+    void set_bulk_peer_quota(size_t quota) { bulk_lane.set_peer_quota(quota); }
+    /** Propose once `max_bytes` of commands (0: no limit) are pending, or
+     * once the oldest has waited for `max_wait` seconds (0: no deadline),
+     * whichever comes before the command count. */
+    void set_blk_assembly(size_t max_bytes, double max_wait) {
+        assembly.max_bytes = max_bytes;
+        assembly.max_wait = max_wait;
+    }
+    /** Propose the pending commands in the order of `order`, such as a
+     * FairOrder, rather than the oldest first. */
+    void set_cmd_order(std::unique_ptr<CmdOrder> order) {
+        mempool.set_order(std::move(order));
+    }
+    /** Disseminate the commands in batches of up to `size` (0 disables),
+     * each sent at most `wait` seconds after its first command. Either all
+     * replicas batch or none does. */
+    void set_batching(size_t size, double wait) {
+        batch_size = size;
+        batch_wait = wait;
+    }
+    bool is_batching() const { return batch_size > 0; }
+    /** Send block bodies as short ids to the peers that take them, which
+     * pays off when the replicas usually hold the commands already. */
+    void set_short_ids(bool enabled) { short_ids = enabled; }
+    /** Reconcile the pending commands with a peer every `period` seconds
+     * (0 disables). */
+    void set_recon_period(double period) { recon_period = period; }
+    /** Hold up to `budget` bytes of decided commands that no block refers
+     * to in the command store (0 for no limit). */
+    void set_cmd_budget(size_t budget) { storage->set_cmd_budget(budget); }
+    /** The command decided as `cmd_hash`, if it is in the store: always,
+     * from state_machine_execute(), for one submitted here. */
+    command_t find_cmd(const uint256_t &cmd_hash) {
+        return storage->find_cmd(cmd_hash);
+    }
+    /** Turn commands away once `max` of them are waiting for a decision
+     * (0: no limit). */
+    void set_max_pending_cmds(size_t max) { cmd_admitted_max = max; }
+    /** Spend up to `budget` bytes on remembering decided commands against
+     * duplicates. */
+    void set_dedup_budget(size_t budget) { decided.set_budget(budget); }
+    /** Take a checkpoint snapshot every `interval` committed heights (0
+     * disables). */
+    void set_snapshot_interval(uint32_t interval) { snapshot_interval = interval; }
+    /** Whether start() first tries to catch up from a snapshot. */
+    void set_snapshot_sync(bool enabled) { ssync.enabled = enabled; }
+    bool is_snapshot_syncing() const { return ssync.active; }
     void print_stat() const;
     virtual void do_elected() {}
 //#ifdef SYNCHS_AUTOCLI
@@ -354,7 +1812,7 @@ class HotStuffBase: public HotStuffCore {
     /** Returns a promise resolved (with block_t blk) when Block is fetched. */
     promise_t async_fetch_blk(const uint256_t &blk_hash, const NetAddr *replica_id, bool fetch_now = true);
     /** Returns a promise resolved (with block_t blk) when Block is delivered (i.e. prefix is fetched). */
-    promise_t async_deliver_blk(const uint256_t &blk_hash,  const NetAddr &replica_id);
+    promise_t async_deliver_blk(const uint256_t &blk_hash,  const NetAddr &replica_id, bool fetch_now = true);
 };
 
 /** HotStuff protocol (templated by cryptographic implementation). */
@@ -380,6 +1838,12 @@ class HotStuff: public HotStuffBase {
         return pc;
     }
 
+    part_cert_bt parse_part_cert_compact(DataStream &s, const uint256_t &obj_hash) override {
+        PartCert *pc = new PartCertType();
+        pc->unserialize_compact(s, obj_hash);
+        return pc;
+    }
+
     quorum_cert_bt create_quorum_cert(const uint256_t &blk_hash) override {
         return new QuorumCertType(get_config(), blk_hash);
     }
@@ -390,6 +1854,12 @@ class HotStuff: public HotStuffBase {
         return qc;
     }
 
+    quorum_cert_bt parse_quorum_cert_compact(DataStream &s, const uint256_t &obj_hash) override {
+        QuorumCert *qc = new QuorumCertType();
+        qc->unserialize_compact(s, obj_hash);
+        return qc;
+    }
+
     public:
     HotStuff(uint32_t blk_size,
             ReplicaID rid,
@@ -426,7 +1896,8 @@ FetchContext<ent_type>::FetchContext(FetchContext && other):
         hs(other.hs),
         fetch_msg(std::move(other.fetch_msg)),
         ent_hash(other.ent_hash),
-        replica_ids(std::move(other.replica_ids)) {
+        replica_ids(std::move(other.replica_ids)),
+        sent(std::move(other.sent)) {
     other.timeout.del();
     timeout = TimerEvent(hs->ec,
             std::bind(&FetchContext::timeout_cb, this, _1));
@@ -441,8 +1912,23 @@ inline void FetchContext<ENT_TYPE_CMD>::timeout_cb(TimerEvent &) {
     reset_timeout();
 }
 
+template<EntityType ent_type>
+bool FetchContext<ent_type>::hedge() {
+    /* try the best holder we have not asked yet, then any other replica, as
+     * all of them are likely to have it */
+    const NetAddr *next = hs->pick_fetch_peer(replica_ids, sent);
+    if (!next)
+        next = hs->pick_fetch_peer(hs->peers, sent);
+    if (!next) return false;
+    HOTSTUFF_LOG_DEBUG("hedging fetch %.10s to %s",
+            get_hex(ent_hash).c_str(), std::string(*next).c_str());
+    fetch_from(*next);
+    return true;
+}
+
 template<>
 inline void FetchContext<ENT_TYPE_BLK>::timeout_cb(TimerEvent &) {
+    if (hedge()) return;
     HOTSTUFF_LOG_WARN("block fetching %.10s timeout", get_hex(ent_hash).c_str());
     for (const auto &replica_id: replica_ids)
         send(replica_id);
@@ -464,7 +1950,36 @@ FetchContext<ent_type>::FetchContext(
 template<EntityType ent_type>
 void FetchContext<ent_type>::send(const NetAddr &replica_id) {
     hs->part_fetched_replica[replica_id]++;
-    hs->pn.send_msg(fetch_msg, replica_id);
+    hs->fetch_stat[replica_id].add_request();
+    sent[replica_id] = std::chrono::steady_clock::now();
+    hs->_do_send(fetch_msg, replica_id);
+}
+
+template<EntityType ent_type>
+void FetchContext<ent_type>::fetch_from(const NetAddr &replica_id) {
+    send(replica_id);
+    timeout.del();
+    timeout.add(hs->get_hedge_delay(replica_id));
+}
+
+template<EntityType ent_type>
+bool FetchContext<ent_type>::asked_all() const {
+    for (const auto &addr: hs->peers)
+        if (!sent.count(addr)) return false;
+    return true;
+}
+
+template<EntityType ent_type>
+void FetchContext<ent_type>::on_missing(const NetAddr &) {
+    hedge();
+}
+
+template<EntityType ent_type>
+void FetchContext<ent_type>::on_response(const NetAddr &replica_id) {
+    auto it = sent.find(replica_id);
+    if (it == sent.end()) return;
+    hs->fetch_stat[replica_id].add_response(std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - it->second).count());
 }
 
 template<EntityType ent_type>
@@ -474,9 +1989,9 @@ void FetchContext<ent_type>::reset_timeout() {
 
 template<EntityType ent_type>
 void FetchContext<ent_type>::add_replica(const NetAddr &replica_id, bool fetch_now) {
-    if (replica_ids.empty() && fetch_now)
-        send(replica_id);
     replica_ids.insert(replica_id);
+    if (sent.empty() && fetch_now)
+        fetch_from(*hs->pick_fetch_peer(replica_ids, sent));
 }
 
 }
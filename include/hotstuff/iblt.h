@@ -0,0 +1,212 @@
+/**
+ * Copyright 2018 VMware
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HOTSTUFF_IBLT_H
+#define _HOTSTUFF_IBLT_H
+
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+#include "hotstuff/type.h"
+
+namespace hotstuff {
+
+/** An invertible Bloom lookup table of command hashes, each with a 32-bit
+ * value (the size of the command). Two parties build one of the same size
+ * and salt over their sets; after subtracting one from the other, only the
+ * symmetric difference is left, and it can be listed as long as it is not
+ * much larger than the number of cells, whatever the size of the sets.
+ * Each element goes to one cell in each of `nhash` subtables, at positions
+ * drawn from a hash keyed by the salt. */
+class IBLT {
+    public:
+    static const size_t nhash = 3;
+    /** the bytes of a cell on the wire */
+    static const size_t cell_bytes = 48;
+
+    private:
+    using key_t = std::array<uint64_t, 4>;
+
+    struct Cell {
+        int32_t count;
+        uint32_t value_sum;
+        uint64_t check_sum;
+        key_t key_sum;
+        Cell(): count(0), value_sum(0), check_sum(0), key_sum{} {}
+        bool is_empty() const {
+            return !count && !value_sum && !check_sum &&
+                !(key_sum[0] | key_sum[1] | key_sum[2] | key_sum[3]);
+        }
+    };
+
+    std::vector<Cell> cells;
+    uint64_t salt;
+
+    static key_t to_key(const uint256_t &h) {
+        bytearray_t b = h;
+        key_t k;
+        for (size_t i = 0; i < 4; i++)
+        {
+            k[i] = 0;
+            for (size_t j = 0; j < 8; j++)
+                k[i] |= (uint64_t)b[i * 8 + j] << (8 * j);
+        }
+        return k;
+    }
+
+    static void get_bytes(const key_t &k, uint8_t *b) {
+        for (size_t i = 0; i < 4; i++)
+            for (size_t j = 0; j < 8; j++)
+                b[i * 8 + j] = k[i] >> (8 * j);
+    }
+
+    static uint256_t from_key(const key_t &k) {
+        bytearray_t b(32);
+        get_bytes(k, b.data());
+        return uint256_t(b);
+    }
+
+    uint64_t get_check(const key_t &k) const {
+        uint8_t b[32];
+        get_bytes(k, b);
+        return siphash24(salt, ~salt, b, sizeof(b));
+    }
+
+    /** the cells of `k`, one per subtable */
+    std::array<size_t, nhash> get_pos(const key_t &k) const {
+        uint8_t b[32];
+        get_bytes(k, b);
+        uint64_t h = siphash24(salt, salt, b, sizeof(b));
+        const size_t sub = cells.size() / nhash;
+        std::array<size_t, nhash> pos;
+        for (size_t i = 0; i < nhash; i++)
+        {
+            pos[i] = i * sub + (h % sub);
+            h = h / sub ^ (h * 0x9e3779b97f4a7c15ULL);
+        }
+        return pos;
+    }
+
+    void toggle(const key_t &k, uint32_t value, int32_t count) {
+        uint64_t check = get_check(k);
+        for (auto p: get_pos(k))
+        {
+            auto &c = cells[p];
+            c.count += count;
+            c.value_sum ^= value;
+            c.check_sum ^= check;
+            for (size_t i = 0; i < 4; i++) c.key_sum[i] ^= k[i];
+        }
+    }
+
+    public:
+    /** `ncells` is rounded up to a multiple of nhash. */
+    IBLT(size_t ncells, uint64_t salt):
+        cells((ncells + nhash - 1) / nhash * nhash), salt(salt) {
+        if (cells.empty()) cells.resize(nhash);
+    }
+
+    size_t size() const { return cells.size(); }
+
+    void insert(const uint256_t &h, uint32_t value) { toggle(to_key(h), value, 1); }
+
+    /** Take the elements of `other` (of the same size and salt) out. */
+    void subtract(const IBLT &other) {
+        for (size_t i = 0; i < cells.size(); i++)
+        {
+            auto &c = cells[i];
+            const auto &o = other.cells[i];
+            c.count -= o.count;
+            c.value_sum ^= o.value_sum;
+            c.check_sum ^= o.check_sum;
+            for (size_t j = 0; j < 4; j++) c.key_sum[j] ^= o.key_sum[j];
+        }
+    }
+
+    /** List the elements left after subtract(): those only on this side
+     * go to `mine`, those only on the other to `theirs`. Destroys the
+     * table. @return false if the difference is too large to list */
+    bool decode(std::vector<std::pair<uint256_t, uint32_t>> &mine,
+                std::vector<std::pair<uint256_t, uint32_t>> &theirs) {
+        std::vector<size_t> pure;
+        auto is_pure = [this](const Cell &c) {
+            return (c.count == 1 || c.count == -1) &&
+                c.check_sum == get_check(c.key_sum);
+        };
+        for (size_t i = 0; i < cells.size(); i++)
+            if (is_pure(cells[i])) pure.push_back(i);
+        while (!pure.empty())
+        {
+            size_t i = pure.back();
+            pure.pop_back();
+            /* peeled through another cell meanwhile */
+            if (!is_pure(cells[i])) continue;
+            const Cell c = cells[i];
+            (c.count == 1 ? mine : theirs).push_back(
+                std::make_pair(from_key(c.key_sum), c.value_sum));
+            toggle(c.key_sum, c.value_sum, -c.count);
+            for (auto p: get_pos(c.key_sum))
+                if (is_pure(cells[p])) pure.push_back(p);
+            /* more than there can be: a corrupt table */
+            if (mine.size() + theirs.size() > cells.size()) return false;
+        }
+        for (const auto &c: cells)
+            if (!c.is_empty()) return false;
+        return true;
+    }
+
+    void serialize(DataStream &s) const {
+        s << htole(salt);
+        put_varint(s, cells.size());
+        for (const auto &c: cells)
+        {
+            s << htole((uint32_t)c.count) << htole(c.value_sum)
+              << htole(c.check_sum);
+            for (auto w: c.key_sum) s << htole(w);
+        }
+    }
+
+    /** @return false if the table is larger than `max_cells` */
+    bool unserialize(DataStream &s, size_t max_cells) {
+        s >> salt;
+        salt = letoh(salt);
+        uint64_t n = get_varint(s);
+        if (n > max_cells || n % nhash || !n) return false;
+        cells.resize(n);
+        for (auto &c: cells)
+        {
+            uint32_t count;
+            s >> count >> c.value_sum >> c.check_sum;
+            c.count = (int32_t)letoh(count);
+            c.value_sum = letoh(c.value_sum);
+            c.check_sum = letoh(c.check_sum);
+            for (auto &w: c.key_sum)
+            {
+                s >> w;
+                w = letoh(w);
+            }
+        }
+        return true;
+    }
+
+    uint64_t get_salt() const { return salt; }
+};
+
+}
+
+#endif
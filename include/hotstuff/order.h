@@ -0,0 +1,298 @@
+/**
+ * Copyright 2018 VMware
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HOTSTUFF_ORDER_H
+#define _HOTSTUFF_ORDER_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "hotstuff/type.h"
+
+namespace hotstuff {
+
+/** A min-heap with `D` children per node, on one vector: with D = 4 the
+ * children of a node share a cache line or two, and the tree is half as
+ * deep as a binary one, which is what sift-down pays for. */
+template<typename T, typename Less = std::less<T>, size_t D = 4>
+class DaryHeap {
+    std::vector<T> v;
+
+    void sift_up(size_t i) {
+        T x = std::move(v[i]);
+        while (i)
+        {
+            size_t p = (i - 1) / D;
+            if (!Less()(x, v[p])) break;
+            v[i] = std::move(v[p]);
+            i = p;
+        }
+        v[i] = std::move(x);
+    }
+
+    void sift_down(size_t i) {
+        const size_t n = v.size();
+        T x = std::move(v[i]);
+        for (;;)
+        {
+            size_t c = i * D + 1;
+            if (c >= n) break;
+            size_t m = c;
+            for (size_t j = c + 1; j < std::min(c + D, n); j++)
+                if (Less()(v[j], v[m])) m = j;
+            if (!Less()(v[m], x)) break;
+            v[i] = std::move(v[m]);
+            i = m;
+        }
+        v[i] = std::move(x);
+    }
+
+    public:
+    bool empty() const { return v.empty(); }
+    size_t size() const { return v.size(); }
+    const T &top() const { return v.front(); }
+
+    void push(T x) {
+        v.push_back(std::move(x));
+        sift_up(v.size() - 1);
+    }
+
+    void pop() {
+        v.front() = std::move(v.back());
+        v.pop_back();
+        if (!v.empty()) sift_down(0);
+    }
+
+    /** Same as pop() then push(x), in one pass. */
+    void replace_top(T x) {
+        v.front() = std::move(x);
+        sift_down(0);
+    }
+
+    void clear() { v.clear(); }
+};
+
+/** The order in which the commands of a mempool are proposed. The mempool
+ * keeps the commands; an order only keeps their hashes and may be left
+ * with ones already taken or decided, which the mempool pops as stale. */
+class CmdOrder {
+    public:
+    using live_t = std::function<bool(const uint256_t &)>;
+
+    virtual ~CmdOrder() = default;
+    /** A command from `client` comes in, or (`front`) is back from an
+     * abandoned block, to be proposed before that client's newer ones. */
+    virtual void push(const uint256_t &cmd_hash, uint32_t client, bool front) = 0;
+    /** Picking the commands of a block of up to `n` starts. */
+    virtual void begin_block(size_t /*n*/) {}
+    /** @return false if there is nothing left to propose */
+    virtual bool peek(uint256_t &cmd_hash) = 0;
+    /** Remove what peek() returned, charging `cost` bytes to its client
+     * (0 for a stale entry). */
+    virtual void pop(uint32_t cost) = 0;
+    /** Drop the entries for which `live` is false. */
+    virtual void compact(const live_t &live) = 0;
+    virtual size_t size() const = 0;
+};
+
+/** Per-client fair ordering. Each client has its own queue; the clients
+ * with commands are kept in a heap by priority class first (lower is
+ * served first), then by the bytes they had proposed (start-time fair
+ * queueing), so that a client sending large or many commands cannot crowd
+ * out the others of its class. Optionally, no client gets more than a
+ * share of a block while another one has commands waiting. */
+class FairOrder: public CmdOrder {
+    struct Client {
+        std::deque<uint256_t> q;
+        uint8_t cls;
+        /** virtual start time: bytes served, caught up to the clock
+         * whenever the client becomes active */
+        uint64_t vtime;
+        /** commands taken for the current block */
+        uint32_t nblk;
+        /** in the heap, or parked for the current block */
+        bool active;
+    };
+
+    struct Item {
+        uint8_t cls;
+        uint64_t vtime;
+        uint32_t client;
+        bool operator<(const Item &other) const {
+            if (cls != other.cls) return cls < other.cls;
+            if (vtime != other.vtime) return vtime < other.vtime;
+            return client < other.client;
+        }
+    };
+
+    std::unordered_map<uint32_t, Client> clients;
+    std::unordered_map<uint32_t, uint8_t> classes;
+    DaryHeap<Item> heap;
+    /** the clients that used up their share of the current block */
+    std::vector<uint32_t> parked;
+    /** the clients picked from for the current block */
+    std::vector<uint32_t> touched;
+    /** per class, the virtual time of the last client served */
+    std::unordered_map<uint8_t, uint64_t> vnow;
+    size_t nentries;
+    /** the largest share of a block for one client (0 for no limit) */
+    double share;
+    /** the same, in commands, for the current block */
+    size_t blk_cap;
+
+    Client &get_client(uint32_t client) {
+        auto it = clients.find(client);
+        if (it == clients.end())
+        {
+            auto c = classes.find(client);
+            it = clients.insert(std::make_pair(client,
+                Client{{}, c == classes.end() ? default_cls : c->second,
+                        0, 0, false})).first;
+        }
+        return it->second;
+    }
+
+    void activate(uint32_t client, Client &c) {
+        if (c.active) return;
+        c.active = true;
+        auto &t = vnow[c.cls];
+        if (c.vtime < t) c.vtime = t;
+        heap.push(Item{c.cls, c.vtime, client});
+    }
+
+    void unpark() {
+        for (auto client: parked)
+        {
+            auto &c = clients.find(client)->second;
+            heap.push(Item{c.cls, c.vtime, client});
+        }
+        parked.clear();
+    }
+
+    public:
+    /** the class of the clients not given one */
+    static const uint8_t default_cls = 1;
+
+    FairOrder(double share = 0):
+        nentries(0), share(share), blk_cap(0) {}
+
+    /** Put `client` in priority class `cls`. */
+    void set_class(uint32_t client, uint8_t cls) {
+        classes[client] = cls;
+        auto it = clients.find(client);
+        if (it != clients.end() && !it->second.active) it->second.cls = cls;
+    }
+
+    void push(const uint256_t &cmd_hash, uint32_t client, bool front) override {
+        auto &c = get_client(client);
+        if (front) c.q.push_front(cmd_hash);
+        else c.q.push_back(cmd_hash);
+        nentries++;
+        activate(client, c);
+    }
+
+    void begin_block(size_t n) override {
+        for (auto client: touched)
+        {
+            auto it = clients.find(client);
+            if (it != clients.end()) it->second.nblk = 0;
+        }
+        touched.clear();
+        unpark();
+        blk_cap = share > 0 ? std::max((size_t)1, (size_t)std::ceil(n * share)) : 0;
+    }
+
+    bool peek(uint256_t &cmd_hash) override {
+        for (;;)
+        {
+            if (heap.empty())
+            {
+                /* nobody else is waiting: no reason to hold them back */
+                if (parked.empty()) return false;
+                unpark();
+                blk_cap = 0;
+            }
+            auto &c = clients.find(heap.top().client)->second;
+            if (blk_cap && c.nblk >= blk_cap)
+            {
+                parked.push_back(heap.top().client);
+                heap.pop();
+                continue;
+            }
+            cmd_hash = c.q.front();
+            return true;
+        }
+    }
+
+    void pop(uint32_t cost) override {
+        uint32_t client = heap.top().client;
+        auto &c = clients.find(client)->second;
+        c.q.pop_front();
+        nentries--;
+        if (cost)
+        {
+            if (!c.nblk++) touched.push_back(client);
+            auto &t = vnow[c.cls];
+            if (t < c.vtime) t = c.vtime;
+            c.vtime += cost;
+        }
+        if (c.q.empty())
+        {
+            c.active = false;
+            heap.pop();
+        }
+        else if (cost)
+            heap.replace_top(Item{c.cls, c.vtime, client});
+    }
+
+    void compact(const live_t &live) override {
+        heap.clear();
+        parked.clear();
+        nentries = 0;
+        for (auto it = clients.begin(); it != clients.end();)
+        {
+            auto &c = it->second;
+            std::deque<uint256_t> q;
+            for (const auto &h: c.q)
+                if (live(h)) q.push_back(h);
+            c.q.swap(q);
+            nentries += c.q.size();
+            c.active = !c.q.empty();
+            if (c.active)
+                heap.push(Item{c.cls, c.vtime, it->first});
+            /* forgotten only if it is owed nothing */
+            else if (c.vtime <= vnow[c.cls] && !c.nblk)
+            {
+                it = clients.erase(it);
+                continue;
+            }
+            it++;
+        }
+    }
+
+    size_t size() const override { return nentries; }
+};
+
+}
+
+#endif
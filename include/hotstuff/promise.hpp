@@ -29,6 +29,7 @@
 #include <memory>
 #include <functional>
 #include <type_traits>
+#include <stdexcept>
 
 #if __cplusplus >= 201703L
 #ifdef __has_include
@@ -0,0 +1,217 @@
+/**
+ * Copyright 2018 VMware
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HOTSTUFF_RCU_H
+#define _HOTSTUFF_RCU_H
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+#include <functional>
+
+namespace hotstuff {
+
+/** A hash map written by a single thread and read by any number of threads
+ * without locking, RCU-style: buckets are linked lists that the writer
+ * changes with single atomic stores, and an unlinked node (or an outgrown
+ * bucket array) is freed only after every reader that might still see it
+ * has left.
+ * Readers are tracked with two counters, one per epoch parity; the writer
+ * advances the epoch and frees what was retired before once the counter of
+ * the old epoch drops to zero. */
+template<typename K, typename V, typename Hash = std::hash<K>>
+class RCUHashMap {
+    struct Node {
+        const K key;
+        const V val;
+        std::atomic<Node *> next;
+        Node(const K &key, const V &val, Node *next):
+            key(key), val(val), next(next) {}
+    };
+
+    struct Table {
+        const size_t nbuckets;
+        std::atomic<Node *> *buckets;
+        Table(size_t nbuckets):
+            nbuckets(nbuckets), buckets(new std::atomic<Node *>[nbuckets]) {
+            for (size_t i = 0; i < nbuckets; i++) buckets[i] = nullptr;
+        }
+        ~Table() { delete [] buckets; }
+        std::atomic<Node *> &bucket(const K &key) const {
+            return buckets[Hash()(key) & (nbuckets - 1)];
+        }
+    };
+
+    std::atomic<Table *> table;
+    size_t nitems;
+
+    mutable std::atomic<uint64_t> epoch;
+    mutable std::atomic<size_t> nreaders[2];
+    /* things unlinked during an epoch, by its parity */
+    std::vector<Node *> retired_nodes[2];
+    std::vector<Table *> retired_tables[2];
+    /* the epoch whose readers the writer is waiting for */
+    bool draining;
+    uint64_t drain_epoch;
+
+    class ReadGuard {
+        std::atomic<size_t> *cnt;
+        public:
+        ReadGuard(const RCUHashMap &m) {
+            for (;;)
+            {
+                uint64_t e = m.epoch.load();
+                cnt = &m.nreaders[e & 1];
+                cnt->fetch_add(1);
+                /* the writer may have moved on and no longer wait for us */
+                if (m.epoch.load() == e) break;
+                cnt->fetch_sub(1);
+            }
+        }
+        ~ReadGuard() { cnt->fetch_sub(1); }
+    };
+
+    static Node *find_node(const Table *t, const K &key) {
+        for (Node *n = t->bucket(key).load(); n; n = n->next.load())
+            if (n->key == key) return n;
+        return nullptr;
+    }
+
+    void free_retired(size_t parity) {
+        for (auto n: retired_nodes[parity]) delete n;
+        for (auto t: retired_tables[parity]) delete t;
+        retired_nodes[parity].clear();
+        retired_tables[parity].clear();
+    }
+
+    /** Free what no reader can see any more, and start a new epoch when
+     * there is something left to free. Never blocks. */
+    void collect() {
+        if (draining)
+        {
+            if (nreaders[drain_epoch & 1].load()) return;
+            free_retired(drain_epoch & 1);
+            draining = false;
+        }
+        uint64_t e = epoch.load();
+        if (retired_nodes[e & 1].empty() && retired_tables[e & 1].empty())
+            return;
+        draining = true;
+        drain_epoch = e;
+        epoch.store(e + 1);
+        if (!nreaders[e & 1].load())
+        {
+            free_retired(e & 1);
+            draining = false;
+        }
+    }
+
+    void retire(Node *n) { retired_nodes[epoch.load() & 1].push_back(n); }
+
+    void grow() {
+        Table *old = table.load();
+        Table *t = new Table(old->nbuckets << 1);
+        /* the old lists stay intact for the readers still walking them */
+        for (size_t i = 0; i < old->nbuckets; i++)
+            for (Node *n = old->buckets[i].load(); n; n = n->next.load())
+            {
+                auto &b = t->bucket(n->key);
+                b.store(new Node(n->key, n->val, b.load()));
+                retire(n);
+            }
+        table.store(t);
+        retired_tables[epoch.load() & 1].push_back(old);
+    }
+
+    public:
+    RCUHashMap(size_t nbuckets = 1024):
+            table(nullptr), nitems(0), epoch(0),
+            draining(false), drain_epoch(0) {
+        size_t n = 1;
+        while (n < nbuckets) n <<= 1;
+        table = new Table(n);
+        nreaders[0] = nreaders[1] = 0;
+    }
+
+    RCUHashMap(const RCUHashMap &) = delete;
+    RCUHashMap &operator=(const RCUHashMap &) = delete;
+
+    ~RCUHashMap() {
+        free_retired(0);
+        free_retired(1);
+        Table *t = table.load();
+        for (size_t i = 0; i < t->nbuckets; i++)
+            for (Node *n = t->buckets[i].load(); n;)
+            {
+                Node *next = n->next.load();
+                delete n;
+                n = next;
+            }
+        delete t;
+    }
+
+    /** Thread-safe. Copies the value of `key` into `val` if there is one. */
+    bool find(const K &key, V &val) const {
+        ReadGuard g(*this);
+        Node *n = find_node(table.load(), key);
+        if (!n) return false;
+        val = n->val;
+        return true;
+    }
+
+    /** Writer only. */
+    bool count(const K &key) const {
+        return find_node(table.load(), key) != nullptr;
+    }
+
+    /** Writer only. Does nothing if `key` is already there. */
+    bool insert(const K &key, const V &val) {
+        Table *t = table.load();
+        if (find_node(t, key)) return false;
+        auto &b = t->bucket(key);
+        /* the node is complete before the store makes it reachable */
+        b.store(new Node(key, val, b.load()));
+        if (++nitems > t->nbuckets) grow();
+        collect();
+        return true;
+    }
+
+    /** Writer only. */
+    bool erase(const K &key) {
+        Table *t = table.load();
+        std::atomic<Node *> *prev = &t->bucket(key);
+        for (Node *n = prev->load(); n; n = n->next.load())
+        {
+            if (n->key == key)
+            {
+                /* readers already on `n` still find their way through it */
+                prev->store(n->next.load());
+                retire(n);
+                nitems--;
+                collect();
+                return true;
+            }
+            prev = &n->next;
+        }
+        return false;
+    }
+
+    size_t size() const { return nitems; }
+};
+
+}
+
+#endif
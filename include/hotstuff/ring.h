@@ -0,0 +1,151 @@
+/**
+ * Copyright 2018 VMware
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HOTSTUFF_RING_H
+#define _HOTSTUFF_RING_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "hotstuff/type.h"
+
+namespace hotstuff {
+
+/** A bounded queue for many producer threads and one consumer, on a ring of
+ * slots allocated up front: elements are copied into and out of the slots,
+ * nothing is allocated per element, and a full ring is reported to the
+ * producer instead of growing. Each slot has a sequence number telling
+ * whether it is free for the producer at a given position or ready for the
+ * consumer (Vyukov's bounded queue).
+ * The consumer runs on an event loop and is woken through a pipe, written
+ * only when it may have gone idle. */
+template<typename T>
+class MPSCRing {
+    struct Slot {
+        std::atomic<size_t> seq;
+        T val;
+    };
+
+    Slot *slots;
+    size_t mask;
+    /* apart, as the producers and the consumer write them */
+    alignas(64) std::atomic<size_t> tail;
+    alignas(64) size_t head;
+    /** set by the consumer before it drains, cleared by the first producer
+     * that wakes it up afterwards */
+    std::atomic<bool> idle;
+    int fds[2];
+    FdEvent ev;
+
+    void notify() {
+        uint8_t b = 1;
+        /* a full pipe means a wakeup is pending anyway */
+        if (::write(fds[1], &b, 1) < 0) return;
+    }
+
+    public:
+    using func_t = std::function<bool(MPSCRing &)>;
+
+    /** `capacity` is rounded up to a power of two. */
+    MPSCRing(size_t capacity): tail(0), head(0), idle(false) {
+        size_t n = 1;
+        while (n < capacity) n <<= 1;
+        mask = n - 1;
+        slots = new Slot[n];
+        for (size_t i = 0; i < n; i++) slots[i].seq = i;
+        if (::pipe(fds) < 0)
+            throw HotStuffError("cannot create the pipe of a ring");
+        for (int fd: fds)
+            ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+
+    MPSCRing(const MPSCRing &) = delete;
+    MPSCRing &operator=(const MPSCRing &) = delete;
+
+    ~MPSCRing() {
+        ev.clear();
+        ::close(fds[0]);
+        ::close(fds[1]);
+        delete [] slots;
+    }
+
+    /** Thread-safe. @return false if the ring is full */
+    bool try_enqueue(const T &val) {
+        size_t pos = tail.load(std::memory_order_relaxed);
+        Slot *s;
+        for (;;)
+        {
+            s = &slots[pos & mask];
+            size_t seq = s->seq.load(std::memory_order_acquire);
+            auto diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0)
+            {
+                if (tail.compare_exchange_weak(pos, pos + 1,
+                                            std::memory_order_relaxed))
+                    break;
+            }
+            /* the consumer has not freed the slot from the last round */
+            else if (diff < 0)
+                return false;
+            else
+                pos = tail.load(std::memory_order_relaxed);
+        }
+        s->val = val;
+        s->seq.store(pos + 1, std::memory_order_release);
+        if (idle.exchange(false)) notify();
+        return true;
+    }
+
+    /** Consumer only. Moves up to `max` elements, in order, to `out`.
+     * @return how many */
+    size_t dequeue_bulk(T *out, size_t max) {
+        size_t n = 0;
+        for (; n < max; n++, head++)
+        {
+            Slot &s = slots[head & mask];
+            if (s.seq.load(std::memory_order_acquire) != head + 1) break;
+            /* nothing is held on to by a free slot */
+            out[n] = std::move(s.val);
+            /* free for the producer one round later */
+            s.seq.store(head + mask + 1, std::memory_order_release);
+        }
+        return n;
+    }
+
+    /** Drain with `func` on the loop of `ec`; it returns true if it left
+     * elements for later, to be called again after the other events. */
+    void reg_handler(const EventContext &ec, func_t func) {
+        ev = FdEvent(ec, fds[0], [this, func=std::move(func)](int, int) {
+            uint8_t buf[64];
+            while (::read(fds[0], buf, sizeof(buf)) > 0);
+            /* whatever is enqueued from here on either is seen by func or
+             * wakes us again */
+            idle.store(true);
+            if (func(*this)) notify();
+        });
+        ev.add(FdEvent::READ);
+        /* elements may have come before the handler */
+        notify();
+    }
+};
+
+}
+
+#endif
@@ -74,6 +74,67 @@ class Cloneable {
 using ReplicaID = uint16_t;
 using opcode_t = uint8_t;
 
+/** Write an unsigned integer in the LEB128 form (7 bits per byte, the MSB
+ * marks continuation), used by the compact wire format. */
+inline void put_varint(DataStream &s, uint64_t x) {
+    while (x >= 0x80)
+    {
+        s << (uint8_t)(x | 0x80);
+        x >>= 7;
+    }
+    s << (uint8_t)x;
+}
+
+/** Read an unsigned integer written by put_varint(). */
+inline uint64_t get_varint(DataStream &s) {
+    uint64_t x = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7)
+    {
+        uint8_t b;
+        s >> b;
+        x |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) return x;
+    }
+    throw std::ios_base::failure("ill-formed varint");
+}
+
+/** SipHash-2-4 of `len` bytes under the key (k0, k1): a keyed hash for short
+ * identifiers that a party not knowing the key cannot make collide. */
+inline uint64_t siphash24(uint64_t k0, uint64_t k1, const uint8_t *data, size_t len) {
+    uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+    uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+    uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+    auto rotl = [](uint64_t x, int b) { return (x << b) | (x >> (64 - b)); };
+    auto round = [&]() {
+        v0 += v1; v1 = rotl(v1, 13); v1 ^= v0; v0 = rotl(v0, 32);
+        v2 += v3; v3 = rotl(v3, 16); v3 ^= v2;
+        v0 += v3; v3 = rotl(v3, 21); v3 ^= v0;
+        v2 += v1; v1 = rotl(v1, 17); v1 ^= v2; v2 = rotl(v2, 32);
+    };
+    /* little-endian words, whatever the host order */
+    auto load = [](const uint8_t *p, size_t n) {
+        uint64_t w = 0;
+        for (size_t i = 0; i < n; i++) w |= (uint64_t)p[i] << (8 * i);
+        return w;
+    };
+    const uint8_t *end = data + (len & ~(size_t)7);
+    for (; data != end; data += 8)
+    {
+        uint64_t m = load(data, 8);
+        v3 ^= m;
+        round(); round();
+        v0 ^= m;
+    }
+    uint64_t b = ((uint64_t)len << 56) | load(data, len & 7);
+    v3 ^= b;
+    round(); round();
+    v0 ^= b;
+    v2 ^= 0xff;
+    round(); round(); round(); round();
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
 }
 
 #endif
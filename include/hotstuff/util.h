@@ -17,6 +17,8 @@
 #ifndef _HOTSTUFF_UTIL_H
 #define _HOTSTUFF_UTIL_H
 
+#include <ctime>
+
 #include "hotstuff/config.h"
 #include "salticidae/util.h"
 
@@ -77,6 +79,37 @@ extern Logger logger;
 
 #define HOTSTUFF_LOG_ERROR(...) hotstuff::logger.error(__VA_ARGS__)
 
+#ifdef HOTSTUFF_MSG_STAT
+/** CPU time consumed so far by the calling thread, in seconds. */
+inline double thread_cpu_time() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/** Adds the CPU time spent in its scope to `acc`. Nested timers on the same
+ * thread are ignored, so the time is only charged once. */
+class CPUTimer {
+    static thread_local bool running;
+    double &acc;
+    double start;
+    bool outermost;
+    public:
+    CPUTimer(double &acc): acc(acc), start(0), outermost(!running) {
+        if (outermost)
+        {
+            running = true;
+            start = thread_cpu_time();
+        }
+    }
+    ~CPUTimer() {
+        if (!outermost) return;
+        acc += thread_cpu_time() - start;
+        running = false;
+    }
+};
+#endif
+
 #ifdef HOTSTUFF_BLK_PROFILE
 class BlockProfiler {
     enum BlockState {
@@ -82,6 +82,8 @@ bool HotStuffCore::on_deliver_blk(const block_t &blk) {
     tails.insert(blk);
 
     blk->delivered = true;
+    if (blk->body_delivered) storage->publish_blk(blk);
+    undecided.insert(std::make_pair(blk->height, blk));
     LOG_DEBUG("deliver %s", std::string(*blk).c_str());
     return true;
 }
@@ -131,13 +133,119 @@ void HotStuffCore::check_commit(const block_t &blk) {
         if(blk->decision == 1)
             continue;
         blk->decision = 1;
+        /* certified without us */
+        vote_waiting.erase(blk);
 //        do_consensus(blk);
         LOG_PROTO("commit %s", std::string(*blk).c_str());
+        exec_waiting.push(blk);
+    }
+    b_exec = blk;
+    exec_committed();
+    gc_forks();
+}
+
+void HotStuffCore::gc_forks() {
+    const uint32_t h = b_exec->height;
+    std::vector<block_t> abandoned;
+    /* in the order of height, so a block is judged after its parent: only
+     * b_exec's ancestors and descendants can still be committed */
+    for (auto it = undecided.begin(); it != undecided.end();)
+    {
+        const block_t &blk = it->second;
+        bool dead;
+        if (it->first <= h)
+            dead = blk->decision != 1;
+        else
+        {
+            const block_t &p = blk->parents[0];
+            if (p->height == h) dead = p != b_exec;
+            else dead = p->decision == -1;
+        }
+        if (dead)
+        {
+            blk->decision = -1;
+            abandoned.push_back(blk);
+        }
+        if (dead || it->first <= h)
+            it = undecided.erase(it);
+        else
+            it++;
+    }
+    /* children first, so nothing left behind points to a released block */
+    for (auto it = abandoned.rbegin(); it != abandoned.rend(); it++)
+        release_abandoned(*it);
+    /* retry those that were still referred to */
+    for (auto it = gc_pinned.begin(); it != gc_pinned.end();)
+    {
+        block_t blk = storage->find_blk(*it);
+        if (!blk || try_release(blk))
+            it = gc_pinned.erase(it);
+        else
+            it++;
+    }
+    if (!abandoned.empty())
+        LOG_PROTO("abandoned %lu blocks below height %u, %lu pinned",
+                abandoned.size(), h, gc_pinned.size());
+}
+
+void HotStuffCore::release_abandoned(const block_t &blk) {
+    auto tit = tails.find(blk);
+    /* tails are ordered by height only */
+    if (tit != tails.end() && *tit == blk) tails.erase(tit);
+    auto pit = proposals.find(blk->height);
+    if (pit != proposals.end())
+    {
+        pit->second.erase(blk);
+        if (pit->second.empty()) proposals.erase(pit);
+    }
+    qc_waiting.erase(blk);
+    vote_waiting.erase(blk);
+    do_abandon(blk);
+    if (!try_release(blk))
+        gc_pinned.insert(blk->get_hash());
+}
+
+bool HotStuffCore::try_release(const block_t &blk) {
+    /* the mark holds a reference too */
+    auto fit = finished_propose.find(blk);
+    bool marked = fit != finished_propose.end() && fit->second;
+    if (fit != finished_propose.end()) finished_propose.erase(fit);
+    if (!storage->try_release_blk(blk))
+    {
+        /* still held, so it may come back as a proposal: keep it marked
+         * as seen, and its links intact */
+        if (marked) finished_propose[blk] = true;
+        return false;
+    }
+    /* out of the storage: it no longer keeps its ancestors alive */
+    blk->parents.clear();
+    blk->qc_ref = nullptr;
+    return true;
+}
+
+void HotStuffCore::exec_committed() {
+    while (!exec_waiting.empty())
+    {
+        block_t blk = exec_waiting.front();
+        if (!blk->body_delivered || !is_payload_ready(blk)) break;
+        exec_waiting.pop();
         for (size_t i = 0; i < blk->cmds.size(); i++)
             do_decide(Finality(id, 1, i, blk->height,
                                 blk->cmds[i], blk->get_hash()));
+        do_commit(blk, blk->self_qc &&
+                    (blk->voted.size() >= config.nmajority ||
+                    blk->cert_type == RESPONSIVE_CERT));
     }
-    b_exec = blk;
+}
+
+void HotStuffCore::on_deliver_body(const block_t &blk, std::vector<uint256_t> &&cmds) {
+    if (blk->body_delivered) return;
+    blk->cmds = std::move(cmds);
+    blk->body_delivered = true;
+    storage->on_blk_body(blk);
+    if (blk->delivered) storage->publish_blk(blk);
+    on_vote_ready();
+    exec_committed();
 }
 
 // 2. Vote
@@ -277,9 +385,12 @@ void HotStuffCore::on_receive_proposal(const Proposal &prop) {
 //    reset_blame_timer(2*config.delta);
 
     block_t bnew = prop.blk;
+    /* a replayed proposal of an abandoned fork */
+    if (bnew->decision == -1) return;
     if (finished_propose[bnew]) return;
     sanity_check_delivered(bnew);
-    if (bnew->qc_ref)
+    /* a qc trusted by hash link only is not adopted, nor relayed as hqc */
+    if (bnew->qc_ref && !bnew->qc_unchecked)
         update_hqc(bnew->qc_ref, bnew->qc, hqc_ancestor.first, hqc_ancestor.second);
     bool opinion = false;
     auto &pslot = proposals[bnew->height];
@@ -314,8 +425,28 @@ void HotStuffCore::on_receive_proposal(const Proposal &prop) {
     finished_propose[bnew] = true;
     on_receive_proposal_(prop);
     // check if the proposal extends the highest certified block
-    if (opinion && !vote_disabled) _vote(bnew);
+    if (opinion && !vote_disabled)
+    {
+        if (is_vote_ready(bnew)) _vote(bnew);
+        else vote_waiting.insert(bnew);
+    }
+}
 
+void HotStuffCore::on_vote_ready() {
+    for (auto it = vote_waiting.begin(); it != vote_waiting.end();)
+    {
+        const block_t &blk = *it;
+        /* settled, or of a past view, meanwhile */
+        if (view_trans || vote_disabled || blk->decision || blk->view != view)
+            it = vote_waiting.erase(it);
+        else if (is_vote_ready(blk))
+        {
+            block_t b = blk;
+            it = vote_waiting.erase(it);
+            _vote(b);
+        }
+        else it++;
+    }
 }
 
 void HotStuffCore::on_receive_vote(const Vote &vote) {
@@ -367,6 +498,24 @@ void HotStuffCore::on_receive_vote(const Vote &vote) {
     }
 }
 
+bool HotStuffCore::is_vote_useful(const Vote &vote) const {
+    if (!config.has_replica(vote.voter)) return false;
+    block_t blk = storage->find_blk(vote.blk_hash);
+    if (!blk) return true;
+    return blk->voted.size() < config.nresponsive &&
+            !blk->voted.count(vote.voter);
+}
+
+bool HotStuffCore::is_notify_useful(const Notify &notify) const {
+    block_t blk = storage->find_blk(notify.blk_hash);
+    return !blk || blk->decision != 1;
+}
+
+bool HotStuffCore::is_blame_useful(const Blame &blame) const {
+    return config.has_replica(blame.blamer) && !view_trans && blamed.size() < config.nmajority &&
+            !blamed.count(blame.blamer);
+}
+
 void HotStuffCore::on_receive_notify(const Notify &notify) {
     block_t blk = get_delivered_blk(notify.blk_hash);
 
@@ -462,6 +611,49 @@ void HotStuffCore::on_receive_new_view(const Status &status) {
 }
 
 
+bool HotStuffCore::install_snapshot(const Snapshot &snap) {
+    if (snap.height <= b_exec->height) return false;
+    block_t blk = storage->add_blk(snap.blk);
+    if (blk->delivered) return false;
+    /* the ancestors delivered here are committed as well: they must not be
+     * swept as forks below (nor their commands proposed again) */
+    std::vector<block_t> chain;
+    const auto &phashes = blk->parent_hashes;
+    for (block_t b = phashes.empty() ? nullptr : storage->find_blk(phashes[0]);
+            b && b->delivered && b->decision == 0; b = b->parents[0])
+    {
+        b->decision = 1;
+        chain.push_back(b);
+    }
+    /* whatever was waiting for execution is covered by the snapshot, as is
+     * the chain above it */
+    std::vector<block_t> skipped;
+    for (; !exec_waiting.empty(); exec_waiting.pop())
+        skipped.push_back(exec_waiting.front());
+    skipped.insert(skipped.end(), chain.rbegin(), chain.rend());
+    /* the ancestors are never fetched: nothing walks below b_exec */
+    blk->parents.clear();
+    blk->qc_ref = nullptr;
+    blk->height = snap.height;
+    blk->self_qc = snap.qc->clone();
+    blk->delivered = true;
+    blk->decision = 1;
+    if (blk->body_delivered) storage->publish_blk(blk);
+    b_exec = blk;
+    hqc = std::make_pair(blk, snap.qc->clone());
+    hqc_ancestor = std::make_pair(nullptr, nullptr);
+    tails.clear();
+    tails.insert(blk);
+    vheight = std::max(vheight, blk->height);
+    LOG_INFO("installed %s", std::string(snap).c_str());
+    /* not executed here: only settled, so that nothing waits for them */
+    for (const auto &b: skipped) do_skip(b);
+    do_skip(blk);
+    gc_forks();
+    on_hqc_update();
+    return true;
+}
+
 void HotStuffCore::on_commit_timeout(const block_t &blk) { check_commit(blk); }
 
 void HotStuffCore::on_blame_timeout() {
@@ -474,6 +666,7 @@ void HotStuffCore::on_viewtrans_timeout() {
     view++;
     view_trans = false;
     proposals.clear();
+    vote_waiting.clear();
     blame_qc = create_quorum_cert(Blame::proof_obj_hash(view));
     blamed.clear();
 
@@ -512,6 +705,7 @@ void HotStuffCore::on_init(uint32_t nfaulty, double delta) {
     b0->qc->compute();
     b0->self_qc = b0->qc->clone();
     b0->qc_ref = b0;
+    storage->publish_blk(b0);
     hqc = std::make_pair(b0, b0->qc->clone());
     hqc_ancestor = std::make_pair(nullptr, nullptr);
 }
@@ -529,7 +723,20 @@ void HotStuffCore::prune(uint32_t staleness) {
         auto &blk = s.top();
         if (blk->parents.empty())
         {
-            storage->try_release_blk(blk);
+            /* long settled: no equivocation to tell at its height */
+            proposals.erase(blk->height);
+            qc_waiting.erase(blk);
+            const uint256_t blk_hash = blk->get_hash();
+            if (try_release(blk))
+            {
+                pruned.insert(blk_hash);
+                pruned_order.push_back(blk_hash);
+                if (pruned_order.size() > blk_pruned_max)
+                {
+                    pruned.erase(pruned_order.front());
+                    pruned_order.pop_front();
+                }
+            }
             s.pop();
             continue;
         }
@@ -14,6 +14,8 @@
  * limitations under the License.
  */
 
+#include <limits>
+
 #include "hotstuff/entity.h"
 #include "hotstuff/crypto.h"
 
@@ -63,4 +65,37 @@ promise_t QuorumCertSecp256k1::verify(const ReplicaConfig &config, VeriPool &vpo
     });
 }
 
+void QuorumCertSecp256k1::serialize_compact(DataStream &s) const {
+    size_t nbits = rids.size();
+    put_varint(s, nbits);
+    for (size_t i = 0; i < nbits; i += 8)
+    {
+        uint8_t byte = 0;
+        for (size_t j = i; j < std::min(i + 8, nbits); j++)
+            if (rids.get(j)) byte |= 1 << (j - i);
+        s << byte;
+    }
+    for (size_t i = 0; i < nbits; i++)
+        if (rids.get(i)) s << sigs.at(i);
+}
+
+void QuorumCertSecp256k1::unserialize_compact(DataStream &s, const uint256_t &_obj_hash) {
+    obj_hash = _obj_hash;
+    size_t nbits = get_varint(s);
+    if (nbits > (size_t)std::numeric_limits<ReplicaID>::max() + 1)
+        throw std::invalid_argument("ill-formed signer bitmap");
+    rids = salticidae::Bits(nbits);
+    rids.clear();
+    sigs.clear();
+    for (size_t i = 0; i < nbits; i += 8)
+    {
+        uint8_t byte;
+        s >> byte;
+        for (size_t j = i; j < std::min(i + 8, nbits); j++)
+            if (byte & (1 << (j - i))) rids.set(j);
+    }
+    for (size_t i = 0; i < nbits; i++)
+        if (rids.get(i)) s >> sigs[i];
+}
+
 }
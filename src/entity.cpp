@@ -47,6 +47,8 @@ void Block::unserialize(DataStream &s, HotStuffCore *hsc) {
     cmds.resize(n);
     for (auto &cmd: cmds)
         s >> cmd;
+    body_digest = get_body_digest(cmds);
+    body_delivered = true;
 //    for (auto &cmd: cmds)
 //        cmd = hsc->parse_cmd(s);
     s >> flag;
@@ -67,18 +69,104 @@ void Block::unserialize(DataStream &s, HotStuffCore *hsc) {
     this->hash = _get_hash();
 }
 
+void Block::serialize_compact(DataStream &s) const {
+    _serialize_compact(s, false);
+}
+
+void Block::serialize_header(DataStream &s) const {
+    _serialize_compact(s, true);
+}
+
+void Block::_serialize_compact(DataStream &s, bool header_only) const {
+    put_varint(s, parent_hashes.size());
+    for (const auto &hash: parent_hashes)
+        s << hash;
+    if (header_only)
+        s << body_digest;
+    else
+    {
+        put_varint(s, cmds.size());
+        for (auto cmd: cmds)
+            s << cmd;
+    }
+    if (qc)
+    {
+        bool derivable = qc->get_obj_hash() == Vote::proof_obj_hash(qc_ref_hash);
+        s << (uint8_t)(derivable ? 1 : 2) << qc_ref_hash;
+        if (!derivable) s << qc->get_obj_hash();
+        qc->serialize_compact(s);
+    }
+    else
+        s << (uint8_t)0;
+    put_varint(s, extra.size());
+    s << extra;
+}
+
+void Block::unserialize_compact(DataStream &s, HotStuffCore *hsc) {
+    _unserialize_compact(s, hsc, false);
+}
+
+void Block::unserialize_header(DataStream &s, HotStuffCore *hsc) {
+    _unserialize_compact(s, hsc, true);
+}
+
+void Block::_unserialize_compact(DataStream &s, HotStuffCore *hsc, bool header_only) {
+    uint64_t n;
+    uint8_t flag;
+    n = get_varint(s);
+    parent_hashes.resize(n);
+    for (auto &hash: parent_hashes)
+        s >> hash;
+    cmds.clear();
+    if (header_only)
+    {
+        s >> body_digest;
+        /* nothing to wait for if the body is empty */
+        body_delivered = body_digest == get_body_digest(cmds);
+    }
+    else
+    {
+        n = get_varint(s);
+        cmds.resize(n);
+        for (auto &cmd: cmds)
+            s >> cmd;
+        body_digest = get_body_digest(cmds);
+        body_delivered = true;
+    }
+    s >> flag;
+    if (flag)
+    {
+        uint256_t obj_hash;
+        s >> qc_ref_hash;
+        if (flag == 1)
+            obj_hash = Vote::proof_obj_hash(qc_ref_hash);
+        else
+            s >> obj_hash;
+        qc = hsc->parse_quorum_cert_compact(s, obj_hash);
+    } else qc = nullptr;
+    n = get_varint(s);
+    if (n == 0)
+        extra.clear();
+    else
+    {
+        auto base = s.get_data_inplace(n);
+        extra = bytearray_t(base, base + n);
+    }
+    this->hash = _get_hash();
+}
+
 /** The following function removes qc from block hash.
  * qc could either be synchronous or responsive. So, the hash would change
  * if qc changes from synchronou to responsive.
+ * The commands enter through body_digest, so a header can be checked
+ * without its body.
  * **/
 uint256_t Block::_get_hash() {
     DataStream s;
     s << htole((uint32_t)parent_hashes.size());
     for (const auto &hash: parent_hashes)
         s << hash;
-    s << htole((uint32_t)cmds.size());
-    for (auto cmd: cmds)
-        s << cmd;
+    s << body_digest;
     if (qc)
         s << (uint8_t)1 << qc_ref_hash;
     else
@@ -24,6 +24,16 @@ using salticidae::static_pointer_cast;
 #define LOG_DEBUG HOTSTUFF_LOG_DEBUG
 #define LOG_WARN HOTSTUFF_LOG_WARN
 
+#ifdef HOTSTUFF_MSG_STAT
+/* count a received message and charge the CPU time of the enclosing scope
+ * to its type */
+#define MSG_RECV(op, size) part_msg_stat[op].add_recv(size)
+#define MSG_COST(op) CPUTimer _msg_cost(part_msg_stat[op].cpu_sec)
+#else
+#define MSG_RECV(op, size) ((void)0)
+#define MSG_COST(op) ((void)0)
+#endif
+
 namespace hotstuff {
 
 const opcode_t MsgPropose::opcode;
@@ -32,6 +42,13 @@ void MsgPropose::postponed_parse(HotStuffCore *hsc) {
     proposal.hsc = hsc;
     serialized >> proposal;
 }
+void MsgPropose::decode(HotStuffCore *hsc) {
+    proposal.hsc = hsc;
+    proposal.decode(serialized);
+}
+void MsgPropose::finish_parse(HotStuffCore *hsc) {
+    proposal.blk = hsc->storage->add_blk(proposal.blk);
+}
 
 const opcode_t MsgVote::opcode;
 MsgVote::MsgVote(const Vote &vote) { serialized << vote; }
@@ -39,12 +56,29 @@ void MsgVote::postponed_parse(HotStuffCore *hsc) {
     vote.hsc = hsc;
     serialized >> vote;
 }
+void MsgVote::decode(HotStuffCore *hsc) {
+    postponed_parse(hsc);
+    vote.check_obj_hash();
+}
 
 const opcode_t MsgStatus::opcode;
-MsgStatus::MsgStatus(const Status &status) { serialized << status; }
+MsgStatus::MsgStatus(const Status &status, uint32_t watermark):
+        watermark(watermark) {
+    serialized << status << htole(watermark);
+}
 void MsgStatus::postponed_parse(HotStuffCore *hsc) {
     status.hsc = hsc;
     serialized >> status;
+    watermark = 0;
+    if (serialized.size())
+    {
+        serialized >> watermark;
+        watermark = letoh(watermark);
+    }
+}
+void MsgStatus::decode(HotStuffCore *hsc) {
+    postponed_parse(hsc);
+    status.check_obj_hash();
 }
 
 const opcode_t MsgBlame::opcode;
@@ -53,6 +87,10 @@ void MsgBlame::postponed_parse(HotStuffCore *hsc) {
     blame.hsc = hsc;
     serialized >> blame;
 }
+void MsgBlame::decode(HotStuffCore *hsc) {
+    postponed_parse(hsc);
+    blame.check_obj_hash();
+}
 
 const opcode_t MsgBlameNotify::opcode;
 MsgBlameNotify::MsgBlameNotify(const BlameNotify &bn) { serialized << bn; }
@@ -60,6 +98,7 @@ void MsgBlameNotify::postponed_parse(HotStuffCore *hsc) {
     bn.hsc = hsc;
     serialized >> bn;
 }
+void MsgBlameNotify::decode(HotStuffCore *hsc) { postponed_parse(hsc); }
 
 const opcode_t MsgNotify::opcode;
 MsgNotify::MsgNotify(const hotstuff::Notify &notify) {serialized << notify;}
@@ -67,12 +106,29 @@ void MsgNotify::postponed_parse(HotStuffCore *hsc) {
     notify.hsc = hsc;
     serialized >> notify;
 }
+void MsgNotify::decode(HotStuffCore *hsc) {
+    postponed_parse(hsc);
+    notify.check_obj_hash();
+}
 
 const opcode_t MsgNewView::opcode;
-MsgNewView::MsgNewView(const Status &status) { serialized << status; }
+MsgNewView::MsgNewView(const Status &status, uint32_t watermark):
+        watermark(watermark) {
+    serialized << status << htole(watermark);
+}
 void MsgNewView::postponed_parse(HotStuffCore *hsc) {
     status.hsc = hsc;
     serialized >> status;
+    watermark = 0;
+    if (serialized.size())
+    {
+        serialized >> watermark;
+        watermark = letoh(watermark);
+    }
+}
+void MsgNewView::decode(HotStuffCore *hsc) {
+    postponed_parse(hsc);
+    status.check_obj_hash();
 }
 
 const opcode_t MsgReqBlock::opcode;
@@ -91,12 +147,22 @@ MsgReqBlock::MsgReqBlock(DataStream &&s) {
 }
 
 const opcode_t MsgRespBlock::opcode;
-MsgRespBlock::MsgRespBlock(const std::vector<block_t> &blks) {
+MsgRespBlock::MsgRespBlock(const std::vector<block_t> &blks,
+                        const std::vector<uint256_t> &missing) {
     serialized << htole((uint32_t)blks.size());
     for (auto blk: blks) serialized << *blk;
+    /* appended, so that older replicas just ignore it */
+    if (missing.empty()) return;
+    serialized << htole((uint32_t)missing.size());
+    for (const auto &h: missing) serialized << h;
 }
 
 void MsgRespBlock::postponed_parse(HotStuffCore *hsc) {
+    decode(hsc);
+    finish_parse(hsc);
+}
+
+void MsgRespBlock::decode(HotStuffCore *hsc) {
     uint32_t size;
     serialized >> size;
     size = letoh(size);
@@ -105,13 +171,435 @@ void MsgRespBlock::postponed_parse(HotStuffCore *hsc) {
     {
         Block _blk;
         _blk.unserialize(serialized, hsc);
-        blk = hsc->storage->add_blk(std::move(_blk), hsc->get_config());
+        blk = new Block(std::move(_blk));
+    }
+    if (!serialized.size()) return;
+    serialized >> size;
+    size = letoh(size);
+    if (size > blk_range_page_max)
+        throw std::invalid_argument("too many missing blocks");
+    missing.resize(size);
+    for (auto &h: missing) serialized >> h;
+}
+
+void MsgRespBlock::finish_parse(HotStuffCore *hsc) {
+    for (auto &blk: blks)
+        blk = hsc->storage->add_blk(blk);
+}
+
+const opcode_t MsgHello::opcode;
+MsgHello::MsgHello(uint8_t version): version(version) { serialized << version; }
+MsgHello::MsgHello(DataStream &&s) { s >> version; }
+
+const opcode_t MsgReqBlockRange::opcode;
+MsgReqBlockRange::MsgReqBlockRange(const uint256_t &blk_hash, uint32_t min_height,
+                                uint32_t offset, uint32_t count):
+        blk_hash(blk_hash), min_height(min_height),
+        offset(offset), count(count) {
+    serialized << blk_hash << htole(min_height)
+                << htole(offset) << htole(count);
+}
+
+MsgReqBlockRange::MsgReqBlockRange(DataStream &&s) {
+    s >> blk_hash >> min_height >> offset >> count;
+    min_height = letoh(min_height);
+    offset = letoh(offset);
+    count = letoh(count);
+}
+
+const opcode_t MsgRespBlockRange::opcode;
+MsgRespBlockRange::MsgRespBlockRange(const uint256_t &blk_hash, uint32_t offset,
+                                    const std::vector<block_t> &blks) {
+    serialized << blk_hash << htole(offset) << htole((uint32_t)blks.size());
+    for (auto blk: blks) serialized << *blk;
+}
+
+void MsgRespBlockRange::postponed_parse(HotStuffCore *hsc) {
+    decode(hsc);
+    finish_parse(hsc);
+}
+
+void MsgRespBlockRange::decode(HotStuffCore *hsc) {
+    uint32_t size;
+    serialized >> blk_hash >> offset >> size;
+    offset = letoh(offset);
+    size = letoh(size);
+    if (size > blk_range_page_max)
+        throw std::invalid_argument("too many blocks in a range page");
+    blks.resize(size);
+    for (auto &blk: blks)
+    {
+        Block _blk;
+        _blk.unserialize(serialized, hsc);
+        blk = new Block(std::move(_blk));
+    }
+}
+
+void MsgRespBlockRange::finish_parse(HotStuffCore *hsc) {
+    for (auto &blk: blks)
+        blk = hsc->storage->add_blk(blk);
+}
+
+const opcode_t MsgReqSnapshot::opcode;
+
+const opcode_t MsgSnapshot::opcode;
+MsgSnapshot::MsgSnapshot(const Snapshot &snapshot) { serialized << snapshot; }
+
+void MsgSnapshot::postponed_parse(HotStuffCore *hsc) {
+    snapshot.hsc = hsc;
+    serialized >> snapshot;
+}
+
+void MsgSnapshot::decode(HotStuffCore *hsc) { postponed_parse(hsc); }
+
+const opcode_t MsgReqSnapshotChunk::opcode;
+MsgReqSnapshotChunk::MsgReqSnapshotChunk(const uint256_t &digest, uint32_t idx):
+        digest(digest), idx(idx) {
+    serialized << digest << htole(idx);
+}
+
+MsgReqSnapshotChunk::MsgReqSnapshotChunk(DataStream &&s) {
+    s >> digest >> idx;
+    idx = letoh(idx);
+}
+
+const opcode_t MsgSnapshotChunk::opcode;
+MsgSnapshotChunk::MsgSnapshotChunk(const uint256_t &digest, uint32_t idx,
+                                    const bytearray_t &data) {
+    serialized << digest << htole(idx)
+                << htole((uint32_t)data.size()) << data;
+}
+
+void MsgSnapshotChunk::postponed_parse(HotStuffCore *) {
+    uint32_t n;
+    serialized >> digest >> idx >> n;
+    idx = letoh(idx);
+    n = letoh(n);
+    if (n > snapshot_chunk_size)
+        throw std::invalid_argument("snapshot chunk too large");
+    auto base = serialized.get_data_inplace(n);
+    data = bytearray_t(base, base + n);
+    data_hash = get_hash(data);
+}
+
+void MsgSnapshotChunk::decode(HotStuffCore *hsc) { postponed_parse(hsc); }
+
+const opcode_t MsgProposeCompact::opcode;
+MsgProposeCompact::MsgProposeCompact(const Proposal &proposal) {
+    proposal.serialize_compact(serialized);
+}
+void MsgProposeCompact::postponed_parse(HotStuffCore *hsc) {
+    proposal.hsc = hsc;
+    proposal.unserialize_compact(serialized);
+}
+void MsgProposeCompact::decode(HotStuffCore *hsc) {
+    proposal.hsc = hsc;
+    proposal.decode_compact(serialized);
+}
+void MsgProposeCompact::finish_parse(HotStuffCore *hsc) {
+    proposal.blk = hsc->storage->add_blk(proposal.blk);
+}
+
+const opcode_t MsgVoteCompact::opcode;
+MsgVoteCompact::MsgVoteCompact(const Vote &vote) { vote.serialize_compact(serialized); }
+void MsgVoteCompact::postponed_parse(HotStuffCore *hsc) {
+    vote.hsc = hsc;
+    vote.unserialize_compact(serialized);
+}
+void MsgVoteCompact::decode(HotStuffCore *hsc) {
+    postponed_parse(hsc);
+    vote.check_obj_hash();
+}
+
+const opcode_t MsgStatusCompact::opcode;
+MsgStatusCompact::MsgStatusCompact(const Status &status, uint32_t watermark):
+        watermark(watermark) {
+    status.serialize_compact(serialized);
+    put_varint(serialized, watermark);
+}
+void MsgStatusCompact::postponed_parse(HotStuffCore *hsc) {
+    status.hsc = hsc;
+    status.unserialize_compact(serialized);
+    watermark = serialized.size() ? get_varint(serialized) : 0;
+}
+void MsgStatusCompact::decode(HotStuffCore *hsc) {
+    postponed_parse(hsc);
+    status.check_obj_hash();
+}
+
+const opcode_t MsgProposeHeader::opcode;
+MsgProposeHeader::MsgProposeHeader(const Proposal &proposal) {
+    proposal.serialize_header(serialized);
+}
+void MsgProposeHeader::postponed_parse(HotStuffCore *hsc) {
+    decode(hsc);
+    finish_parse(hsc);
+}
+void MsgProposeHeader::decode(HotStuffCore *hsc) {
+    proposal.hsc = hsc;
+    proposal.decode_header(serialized);
+}
+void MsgProposeHeader::finish_parse(HotStuffCore *hsc) {
+    proposal.blk = hsc->storage->add_blk(proposal.blk);
+}
+
+const opcode_t MsgBlockBody::opcode;
+MsgBlockBody::MsgBlockBody(const block_t &blk) {
+    const auto &cmds = blk->get_cmds();
+    serialized << blk->get_hash();
+    put_varint(serialized, cmds.size());
+    for (const auto &cmd: cmds) serialized << cmd;
+}
+void MsgBlockBody::postponed_parse(HotStuffCore *) {
+    serialized >> blk_hash;
+    uint64_t n = get_varint(serialized);
+    cmds.clear();
+    /* no reserve(): a bogus count runs out of data instead of memory */
+    for (uint64_t i = 0; i < n; i++)
+    {
+        uint256_t cmd;
+        serialized >> cmd;
+        cmds.push_back(cmd);
+    }
+    body_digest = Block::get_body_digest(cmds);
+}
+void MsgBlockBody::decode(HotStuffCore *hsc) { postponed_parse(hsc); }
+
+const opcode_t MsgBlockBodyShort::opcode;
+MsgBlockBodyShort::MsgBlockBodyShort(const uint256_t &blk_hash,
+                                    const std::vector<uint64_t> &sids) {
+    serialized << blk_hash;
+    put_varint(serialized, sids.size());
+    for (uint64_t sid: sids)
+    {
+        uint8_t b[short_id_bytes];
+        for (size_t i = 0; i < short_id_bytes; i++) b[i] = sid >> (8 * i);
+        serialized.put_data(b, b + short_id_bytes);
+    }
+}
+MsgBlockBodyShort::MsgBlockBodyShort(DataStream &&s) {
+    s >> blk_hash;
+    uint64_t n = get_varint(s);
+    /* no reserve(): a bogus count runs out of data instead of memory */
+    for (uint64_t i = 0; i < n; i++)
+    {
+        const uint8_t *b = s.get_data_inplace(short_id_bytes);
+        uint64_t sid = 0;
+        for (size_t j = 0; j < short_id_bytes; j++)
+            sid |= (uint64_t)b[j] << (8 * j);
+        sids.push_back(sid);
+    }
+}
+
+const opcode_t MsgReqBodyCmds::opcode;
+MsgReqBodyCmds::MsgReqBodyCmds(const uint256_t &blk_hash,
+                                const std::vector<uint32_t> &idx) {
+    serialized << blk_hash;
+    put_varint(serialized, idx.size());
+    for (uint32_t i: idx) put_varint(serialized, i);
+}
+MsgReqBodyCmds::MsgReqBodyCmds(DataStream &&s) {
+    s >> blk_hash;
+    uint64_t n = get_varint(s);
+    for (uint64_t i = 0; i < n; i++)
+        idx.push_back(get_varint(s));
+}
+
+const opcode_t MsgRespBodyCmds::opcode;
+MsgRespBodyCmds::MsgRespBodyCmds(const uint256_t &blk_hash,
+                                const std::vector<uint32_t> &idx,
+                                const std::vector<uint256_t> &cmds) {
+    serialized << blk_hash;
+    put_varint(serialized, idx.size());
+    for (size_t i = 0; i < idx.size(); i++)
+    {
+        put_varint(serialized, idx[i]);
+        serialized << cmds[i];
+    }
+}
+MsgRespBodyCmds::MsgRespBodyCmds(DataStream &&s) {
+    s >> blk_hash;
+    uint64_t n = get_varint(s);
+    for (uint64_t i = 0; i < n; i++)
+    {
+        uint256_t cmd;
+        idx.push_back(get_varint(s));
+        s >> cmd;
+        cmds.push_back(cmd);
+    }
+}
+
+const opcode_t MsgReconReq::opcode;
+MsgReconReq::MsgReconReq(uint32_t round, const IBLT &_iblt):
+        round(round), iblt(0, 0), ok(true) {
+    serialized << htole(round);
+    _iblt.serialize(serialized);
+}
+MsgReconReq::MsgReconReq(DataStream &&s): iblt(0, 0) {
+    s >> round;
+    round = letoh(round);
+    ok = iblt.unserialize(s, recon_cells_max);
+}
+
+const opcode_t MsgReconResp::opcode;
+MsgReconResp::MsgReconResp(uint32_t round, bool ok, uint32_t ndiff,
+                        const std::vector<std::pair<uint256_t, uint32_t>> &cmds):
+        round(round), ok(ok), ndiff(ndiff), cmds(cmds) {
+    serialized << htole(round) << (uint8_t)ok << htole(ndiff);
+    put_varint(serialized, cmds.size());
+    for (const auto &p: cmds) serialized << p.first << htole(p.second);
+}
+MsgReconResp::MsgReconResp(DataStream &&s) {
+    uint8_t _ok;
+    s >> round >> _ok >> ndiff;
+    round = letoh(round);
+    ndiff = letoh(ndiff);
+    ok = _ok;
+    uint64_t n = get_varint(s);
+    /* no table lists more */
+    n = std::min(n, (uint64_t)recon_cells_max);
+    cmds.resize(n);
+    for (auto &p: cmds)
+    {
+        s >> p.first >> p.second;
+        p.second = letoh(p.second);
+    }
+}
+
+const opcode_t MsgBatch::opcode;
+MsgBatch::MsgBatch(const Batch &batch) {
+    put_varint(serialized, batch.cmds.size());
+    for (size_t i = 0; i < batch.cmds.size(); i++)
+    {
+        const auto &payload = batch.payloads[i];
+        serialized << batch.cmds[i];
+        put_varint(serialized, payload.size());
+        serialized << payload;
+    }
+    digest = serialized.get_hash();
+}
+void MsgBatch::postponed_parse(HotStuffCore *) {
+    digest = serialized.get_hash();
+    uint64_t n = get_varint(serialized);
+    if (n > batch_max_cmds)
+        throw std::invalid_argument("batch too large");
+    batch = Batch();
+    for (uint64_t i = 0; i < n; i++)
+    {
+        uint256_t cmd;
+        serialized >> cmd;
+        uint64_t size = get_varint(serialized);
+        if (size > batch_max_payload)
+            throw std::invalid_argument("command payload too large");
+        auto base = serialized.get_data_inplace(size);
+        /* a payload is the command it is ordered as */
+        salticidae::SHA256 h;
+        h.update(base, size);
+        if (uint256_t(h.digest()) != cmd)
+            throw std::invalid_argument("command payload does not match its hash");
+        batch.cmds.push_back(cmd);
+        batch.payloads.push_back(bytearray_t(base, base + size));
+        batch.nbytes += size;
+    }
+}
+void MsgBatch::decode(HotStuffCore *hsc) { postponed_parse(hsc); }
+
+const opcode_t MsgBatchAck::opcode;
+MsgBatchAck::MsgBatchAck(const uint256_t &digest) { serialized << digest; }
+MsgBatchAck::MsgBatchAck(DataStream &&s) { s >> digest; }
+
+const opcode_t MsgReqBatch::opcode;
+MsgReqBatch::MsgReqBatch(const std::vector<uint256_t> &digests) {
+    put_varint(serialized, digests.size());
+    for (const auto &d: digests) serialized << d;
+}
+MsgReqBatch::MsgReqBatch(DataStream &&s) {
+    uint64_t n = get_varint(s);
+    /* the rest is not asked for */
+    n = std::min(n, (uint64_t)blk_range_page_max);
+    digests.resize(n);
+    for (auto &d: digests) s >> d;
+}
+
+const opcode_t MsgRespBlockCompact::opcode;
+MsgRespBlockCompact::MsgRespBlockCompact(const std::vector<block_t> &blks,
+                                        const std::vector<uint256_t> &missing) {
+    put_varint(serialized, blks.size());
+    for (auto blk: blks) blk->serialize_compact(serialized);
+    if (missing.empty()) return;
+    put_varint(serialized, missing.size());
+    for (const auto &h: missing) serialized << h;
+}
+
+void MsgRespBlockCompact::postponed_parse(HotStuffCore *hsc) {
+    decode(hsc);
+    finish_parse(hsc);
+}
+
+void MsgRespBlockCompact::decode(HotStuffCore *hsc) {
+    blks.resize(get_varint(serialized));
+    for (auto &blk: blks)
+    {
+        Block _blk;
+        _blk.unserialize_compact(serialized, hsc);
+        blk = new Block(std::move(_blk));
     }
+    if (!serialized.size()) return;
+    auto size = get_varint(serialized);
+    if (size > blk_range_page_max)
+        throw std::invalid_argument("too many missing blocks");
+    missing.resize(size);
+    for (auto &h: missing) serialized >> h;
+}
+
+void MsgRespBlockCompact::finish_parse(HotStuffCore *hsc) {
+    for (auto &blk: blks)
+        blk = hsc->storage->add_blk(blk);
 }
 
 // TODO: improve this function
-void HotStuffBase::exec_command(uint256_t cmd_hash, commit_cb_t callback) {
-    cmd_pending.enqueue(std::make_pair(cmd_hash, callback));
+bool HotStuffBase::exec_command(const uint256_t &cmd_hash, uint64_t handle,
+                                uint32_t cmd_size, uint32_t client) {
+    return admit_cmd(PendingCmd{cmd_hash, cmd_size, client, handle, nullptr, nullptr});
+}
+
+bool HotStuffBase::exec_command(const command_t &cmd, uint64_t handle,
+                                uint32_t cmd_size, uint32_t client) {
+    return admit_cmd(PendingCmd{cmd->get_hash(), cmd_size, client, handle,
+                                nullptr, cmd});
+}
+
+bool HotStuffBase::exec_command(const uint256_t &cmd_hash, bytearray_t &&payload,
+                                uint64_t handle, uint32_t client) {
+    if (!batch_size)
+        return exec_command(cmd_hash, handle, payload.size(), client);
+    PendingCmd e{cmd_hash, (uint32_t)payload.size(), client, handle,
+                new bytearray_t(std::move(payload)), nullptr};
+    if (admit_cmd(e)) return true;
+    delete e.payload;
+    return false;
+}
+
+bool HotStuffBase::admit_cmd(const PendingCmd &e) {
+    /* no room either way: busy */
+    if ((cmd_admitted.fetch_add(1) >= cmd_admitted_max && cmd_admitted_max) ||
+        !cmd_pending.try_enqueue(e))
+    {
+        cmd_admitted--;
+        part_cmd_busy++;
+        return false;
+    }
+    return true;
+}
+
+void HotStuffBase::wait_decision(const uint256_t &cmd_hash, uint64_t handle) {
+    if (!decision_waiting.insert(std::make_pair(cmd_hash, handle)).second)
+        decision_waiting_dup.insert(std::make_pair(cmd_hash, handle));
+}
+
+void HotStuffBase::finish_cmd(const Finality &fin, uint64_t handle) {
+    cmd_admitted--;
+    do_cmd_done(fin, handle);
 }
 
 void HotStuffBase::on_fetch_blk(const block_t &blk) {
@@ -126,8 +614,10 @@ void HotStuffBase::on_fetch_blk(const block_t &blk) {
     auto it = blk_fetch_waiting.find(blk_hash);
     if (it != blk_fetch_waiting.end())
     {
-        it->second.resolve(blk);
+        /* out of the map first: the callbacks may add to it */
+        promise_t pm = static_cast<promise_t &>(it->second);
         blk_fetch_waiting.erase(it);
+        pm.resolve(blk);
     }
 }
 
@@ -139,6 +629,9 @@ void HotStuffBase::on_deliver_blk(const block_t &blk) {
         assert(storage->is_blk_delivered(p));
     if ((valid = HotStuffCore::on_deliver_blk(blk)))
     {
+        delivered_height = std::max(delivered_height, blk->get_height());
+        /* not to be proposed again while the block may commit */
+        if (blk->is_body_delivered()) mempool.mark_taken(blk->get_cmds());
         LOG_DEBUG("block %.10s delivered",
                 get_hex(blk_hash).c_str());
         part_parent_size += blk->get_parent_hashes().size();
@@ -153,7 +646,9 @@ void HotStuffBase::on_deliver_blk(const block_t &blk) {
     auto it = blk_delivery_waiting.find(blk_hash);
     if (it != blk_delivery_waiting.end())
     {
-        auto &pm = it->second;
+        /* out of the map first: the callbacks may add to it */
+        BlockDeliveryContext pm(std::move(it->second));
+        blk_delivery_waiting.erase(it);
         if (valid)
         {
             pm.elapsed.stop(false);
@@ -169,7 +664,6 @@ void HotStuffBase::on_deliver_blk(const block_t &blk) {
             pm.reject(blk);
             // TODO: do we need to also free it from storage?
         }
-        blk_delivery_waiting.erase(it);
     }
 }
 
@@ -180,6 +674,9 @@ promise_t HotStuffBase::async_fetch_blk(const uint256_t &blk_hash,
         return promise_t([this, &blk_hash](promise_t pm){
             pm.resolve(storage->find_blk(blk_hash));
         });
+    /* released here, and so by the others: nobody would answer */
+    if (is_blk_pruned(blk_hash))
+        return promise_t([](promise_t pm) { pm.reject(); });
     auto it = blk_fetch_waiting.find(blk_hash);
     if (it == blk_fetch_waiting.end())
     {
@@ -197,7 +694,31 @@ promise_t HotStuffBase::async_fetch_blk(const uint256_t &blk_hash,
 }
 
 promise_t HotStuffBase::async_deliver_blk(const uint256_t &blk_hash,
-                                        const NetAddr &replica_id) {
+                                        const NetAddr &replica_id,
+                                        bool fetch_now) {
+    return _async_deliver_blk(blk_hash, replica_id, fetch_now, 0);
+}
+
+void HotStuffBase::add_vouch(const uint256_t &blk_hash, const promise_t &pm) {
+    /* only a block whose delivery is yet to start will consume it */
+    if (storage->is_blk_delivered(blk_hash) ||
+        blk_delivery_waiting.count(blk_hash) || is_blk_pruned(blk_hash))
+        return;
+    blk_vouched.insert(std::make_pair(blk_hash, pm));
+}
+
+promise_t HotStuffBase::take_vouch(const uint256_t &blk_hash) {
+    auto it = blk_vouched.find(blk_hash);
+    if (it == blk_vouched.end())
+        return promise_t([](promise_t &pm) { pm.resolve(false); });
+    auto pm = it->second;
+    blk_vouched.erase(it);
+    return pm;
+}
+
+promise_t HotStuffBase::_async_deliver_blk(const uint256_t &blk_hash,
+                                        const NetAddr &replica_id,
+                                        bool fetch_now, uint32_t depth) {
     if (storage->is_blk_delivered(blk_hash))
         return promise_t([this, &blk_hash](promise_t pm) {
             pm.resolve(storage->find_blk(blk_hash));
@@ -205,53 +726,155 @@ promise_t HotStuffBase::async_deliver_blk(const uint256_t &blk_hash,
     auto it = blk_delivery_waiting.find(blk_hash);
     if (it != blk_delivery_waiting.end())
         return static_cast<promise_t &>(it->second);
+    if (is_blk_pruned(blk_hash))
+        return promise_t([](promise_t pm) { pm.reject(); });
     BlockDeliveryContext pm{[](promise_t){}};
     it = blk_delivery_waiting.insert(std::make_pair(blk_hash, pm)).first;
     /* otherwise the on_deliver_batch will resolve */
-    async_fetch_blk(blk_hash, &replica_id).then([this, replica_id](block_t blk) {
-        /* qc_ref should be fetched */
+    async_fetch_blk(blk_hash, &replica_id, fetch_now).then([this, replica_id, depth](block_t blk) {
+        /* the ancestors may be on their way in a range fetch, in which case
+         * only fall back to per-block requests once it is over; a long run
+         * of missing ancestors starts one */
+        RangeFetch *rf = find_range_fetch(blk->get_hash());
+        const auto &parents = blk->get_parent_hashes();
+        if (!rf && !parents.empty() && depth + 1 >= blk_range_min_gap &&
+            !storage->is_blk_fetched(parents[0]) && !is_blk_pruned(parents[0]))
+            rf = start_range_fetch(blk, parents[0], replica_id);
+        auto defer = [this, rf](const uint256_t &h) {
+            if (rf && !storage->is_blk_fetched(h)) rf->deferred.push_back(h);
+        };
+        /* a block vouched for by a descendant skips its own QC check */
+        promise_t vouched = take_vouch(blk->get_hash());
+        promise_t valid = vouched.then([this, blk](bool v) {
+            if (v || blk == get_genesis())
+            {
+                if (v)
+                {
+                    part_vouched++;
+                    blk->set_qc_unchecked();
+                }
+                return promise_t([](promise_t &pm) { pm.resolve(true); });
+            }
+            return blk->verify(get_config(), vpool);
+        });
+        /* a valid QC certifies qc_ref, and so all of its ancestors; the
+         * other parents are only vouched for if blk itself is */
         std::vector<promise_t> pms;
         const auto &qc = blk->get_qc();
         if (qc)
-            pms.push_back(async_fetch_blk(blk->get_qc_ref_hash(), &replica_id));
+        {
+            add_vouch(blk->get_qc_ref_hash(), valid);
+            defer(blk->get_qc_ref_hash());
+            pms.push_back(async_fetch_blk(blk->get_qc_ref_hash(), &replica_id, !rf));
+        }
         /* the parents should be delivered */
         for (const auto &phash: blk->get_parent_hashes())
-            pms.push_back(async_deliver_blk(phash, replica_id));
-        if (blk != get_genesis())
-            pms.push_back(blk->verify(get_config(), vpool));
-        promise::all(pms).then([this, blk]() {
+        {
+            add_vouch(phash, vouched);
+            defer(phash);
+            pms.push_back(_async_deliver_blk(phash, replica_id, !rf, depth + 1));
+        }
+        pms.push_back(valid);
+        auto drop = [this, blk]() {
+            auto it = blk_delivery_waiting.find(blk->get_hash());
+            if (it == blk_delivery_waiting.end()) return;
+            promise_t pm = static_cast<promise_t &>(it->second);
+            blk_delivery_waiting.erase(it);
+            pm.reject(blk);
+        };
+        promise::all(pms).then([this, blk, drop](const promise::values_t values) {
+            if (!promise::any_cast<bool>(values.back()))
+            {
+                LOG_WARN("dropping %s with an invalid QC", std::string(*blk).c_str());
+                drop();
+                return;
+            }
             on_deliver_blk(blk);
+        }, [this, blk, drop]() {
+            /* on a fork below what was pruned: it can never be delivered */
+            LOG_WARN("dropping %s with a pruned ancestor", std::string(*blk).c_str());
+            drop();
         });
     });
     return static_cast<promise_t &>(pm);
 }
 
-void HotStuffBase::propose_handler(MsgPropose &&msg, const Net::conn_t &conn) {
-    const NetAddr &peer = conn->get_peer();
-    msg.postponed_parse(this);
-    auto &prop = msg.proposal;
-    block_t blk = prop.blk;
-    if (!blk) return;
-    promise::all(std::vector<promise_t>{
-        async_deliver_blk(blk->get_hash(), peer)
-    }).then([this, prop = std::move(prop)]() {
-        on_receive_proposal(prop);
+template<typename M>
+void HotStuffBase::propose_handler(M &&msg, const Net::conn_t &conn) {
+    MSG_RECV(M::opcode, msg.serialized.size());
+    MSG_COST(M::opcode);
+    /* blocks are not fetched below a snapshot being installed */
+    if (ssync.active) return;
+    const NetAddr peer = conn->get_peer();
+    RcObj<M> m(new M(std::move(msg)));
+    async_decode(m).then([this, m, peer](bool ok) {
+        MSG_COST(M::opcode);
+        if (!ok) return;
+        m->finish_parse(this);
+        auto &prop = m->proposal;
+        block_t blk = prop.blk;
+        /* nothing to do for a block on an abandoned fork */
+        if (!blk || blk->get_decision() == -1) return;
+        if (!blk->is_body_delivered()) wait_body(blk, peer);
+        promise::all(std::vector<promise_t>{
+            async_deliver_blk(blk->get_hash(), peer)
+        }).then([this, prop = std::move(prop), peer]() {
+            MSG_COST(M::opcode);
+            note_watermark(peer, prop.blk->get_height());
+            on_receive_proposal(prop);
+        });
     });
 }
 
-void HotStuffBase::vote_handler(MsgVote &&msg, const Net::conn_t &conn) {
-    const NetAddr &peer = conn->get_peer();
-    msg.postponed_parse(this);
-    //auto &vote = msg.vote;
-    RcObj<Vote> v(new Vote(std::move(msg.vote)));
-    promise::all(std::vector<promise_t>{
-        async_deliver_blk(v->blk_hash, peer),
-        v->verify(vpool),
-    }).then([this, v=std::move(v)](const promise::values_t values) {
-        if (!promise::any_cast<bool>(values[1]))
-            LOG_WARN("invalid vote from %d", v->voter);
-        else
-            on_receive_vote(*v);
+template<typename M>
+void HotStuffBase::vote_handler(M &&msg, const Net::conn_t &conn) {
+    MSG_RECV(M::opcode, msg.serialized.size());
+    MSG_COST(M::opcode);
+    if (ssync.active) return;
+    const NetAddr peer = conn->get_peer();
+    RcObj<M> m(new M(std::move(msg)));
+    async_decode(m).then([this, m, peer](bool ok) {
+        MSG_COST(M::opcode);
+        if (!ok) return;
+        RcObj<Vote> v(new Vote(std::move(m->vote)));
+        if (!is_vote_useful(*v))
+        {
+            avoid_verify();
+            return;
+        }
+        /* only a vote coming from the voter itself is tracked in flight, so
+         * that a forged copy cannot shadow the genuine one */
+        bool track = peer == get_config().get_addr(v->voter);
+        if (track && !vote_inflight[v->blk_hash].insert(v->voter).second)
+        {
+            avoid_verify();
+            return;
+        }
+        /* also on rejection (a block with an invalid QC), or the genuine
+         * copies of the vote would be dropped as in flight from then on */
+        auto release = [this, blk_hash = v->blk_hash, voter = v->voter, track]() {
+            if (!track) return;
+            auto it = vote_inflight.find(blk_hash);
+            if (it == vote_inflight.end()) return;
+            it->second.erase(voter);
+            if (it->second.empty()) vote_inflight.erase(it);
+        };
+        promise::all(std::vector<promise_t>{
+            async_deliver_blk(v->blk_hash, peer),
+            v->verify(vpool),
+        }).then([this, v=std::move(v), release](const promise::values_t values) {
+            MSG_COST(M::opcode);
+            release();
+            if (!promise::any_cast<bool>(values[1]))
+                LOG_WARN("invalid vote from %d", v->voter);
+            else
+            {
+                /* a replica only votes for blocks it has delivered */
+                note_watermark(get_config().get_addr(v->voter),
+                    promise::any_cast<block_t>(values[0])->get_height());
+                on_receive_vote(*v);
+            }
+        }, release);
     });
 }
 
@@ -265,83 +888,142 @@ promise_t HotStuffBase::verify_notify(Notify &notify){
 }
 
 void HotStuffBase::notify_handler(MsgNotify &&msg, const Net::conn_t &conn){
-    const NetAddr &peer = conn->get_peer();
+    MSG_RECV(MsgNotify::opcode, msg.serialized.size());
+    MSG_COST(MsgNotify::opcode);
+    if (ssync.active) return;
+    const NetAddr peer = conn->get_peer();
     if (peer.is_null()) return;
-    msg.postponed_parse(this);
-
-    RcObj<Notify> n(new Notify(std::move(msg.notify)));
+    RcObj<MsgNotify> m(new MsgNotify(std::move(msg)));
+    async_decode(m).then([this, m, peer](bool ok) {
+        MSG_COST(MsgNotify::opcode);
+        if (!ok) return;
+        RcObj<Notify> n(new Notify(std::move(m->notify)));
+        if (!is_notify_useful(*n))
+        {
+            /* only stops the commit timer of an already committed block */
+            avoid_verify();
+            on_receive_notify(*n);
+            return;
+        }
         promise::all(std::vector<promise_t>{
                 async_deliver_blk(n->blk_hash, peer),
                 verify_notify(*n)
         }).then([this, n, peer](const promise::values_t values) {
+            MSG_COST(MsgNotify::opcode);
             if (!promise::any_cast<bool>(values[1]))
                 LOG_WARN("invalid notify from %s", std::string(peer).c_str());
             else
                 on_receive_notify(*n);
         });
+    });
 }
 
-void HotStuffBase::status_handler(MsgStatus &&msg, const Net::conn_t &conn) {
-    const NetAddr &peer = conn->get_peer();
+template<typename M>
+void HotStuffBase::status_handler(M &&msg, const Net::conn_t &conn) {
+    MSG_RECV(M::opcode, msg.serialized.size());
+    MSG_COST(M::opcode);
+    if (ssync.active) return;
+    const NetAddr peer = conn->get_peer();
     if (peer.is_null()) return;
-    msg.postponed_parse(this);
-    RcObj<Status> s(new Status(std::move(msg.status)));
-    promise::all(std::vector<promise_t>{
-        async_deliver_blk(s->hqc_blk_hash, peer),
-        s->verify(vpool)
-    }).then([this, s, peer](const promise::values_t values) {
-        if (!promise::any_cast<bool>(values[1]))
-            LOG_WARN("invalid status message from %s", std::string(peer).c_str());
-        else
-            on_receive_status(*s);
+    RcObj<M> m(new M(std::move(msg)));
+    async_decode(m).then([this, m, peer](bool ok) {
+        MSG_COST(M::opcode);
+        if (!ok) return;
+        note_watermark(peer, m->watermark);
+        RcObj<Status> s(new Status(std::move(m->status)));
+        promise::all(std::vector<promise_t>{
+            async_deliver_blk(s->hqc_blk_hash, peer),
+            s->verify(vpool)
+        }).then([this, s, peer](const promise::values_t values) {
+            MSG_COST(M::opcode);
+            if (!promise::any_cast<bool>(values[1]))
+                LOG_WARN("invalid status message from %s", std::string(peer).c_str());
+            else
+                on_receive_status(*s);
+        });
     });
 }
 
 void HotStuffBase::blame_handler(MsgBlame &&msg, const Net::conn_t &conn) {
-    const NetAddr &peer = conn->get_peer();
+    MSG_RECV(MsgBlame::opcode, msg.serialized.size());
+    MSG_COST(MsgBlame::opcode);
+    const NetAddr peer = conn->get_peer();
     if (peer.is_null()) return;
-    msg.postponed_parse(this);
-    RcObj<Blame> b(new Blame(std::move(msg.blame)));
-    b->verify(vpool).then([this, b, peer](bool result) {
-        if (!result)
-            LOG_WARN("invalid blame message from %s", std::string(peer).c_str());
-        else
-            on_receive_blame(*b);
+    RcObj<MsgBlame> m(new MsgBlame(std::move(msg)));
+    async_decode(m).then([this, m, peer](bool ok) {
+        MSG_COST(MsgBlame::opcode);
+        if (!ok) return;
+        RcObj<Blame> b(new Blame(std::move(m->blame)));
+        if (!is_blame_useful(*b))
+        {
+            avoid_verify();
+            return;
+        }
+        bool track = peer == get_config().get_addr(b->blamer);
+        if (track && !blame_inflight.insert(b->blamer).second)
+        {
+            avoid_verify();
+            return;
+        }
+        b->verify(vpool).then([this, b, peer, track](bool result) {
+            MSG_COST(MsgBlame::opcode);
+            if (track) blame_inflight.erase(b->blamer);
+            if (!result)
+                LOG_WARN("invalid blame message from %s", std::string(peer).c_str());
+            else
+                on_receive_blame(*b);
+        });
     });
 }
 
 void HotStuffBase::blamenotify_handler(MsgBlameNotify &&msg, const Net::conn_t &conn) {
-    const NetAddr &peer = conn->get_peer();
+    MSG_RECV(MsgBlameNotify::opcode, msg.serialized.size());
+    MSG_COST(MsgBlameNotify::opcode);
+    if (ssync.active) return;
+    const NetAddr peer = conn->get_peer();
     if (peer.is_null()) return;
-    msg.postponed_parse(this);
-    RcObj<BlameNotify> bn(new BlameNotify(std::move(msg.bn)));
-    promise::all(std::vector<promise_t>{
-        async_deliver_blk(bn->hqc_hash, peer),
-        bn->verify(vpool)
-    }).then([this, bn, peer](promise::values_t values) {
-        auto result = promise::any_cast<bool>(values[1]);
-        if (!result)
-            LOG_WARN("invalid blamenotify message from %s", std::string(peer).c_str());
-        else
-            on_receive_blamenotify(*bn);
+    RcObj<MsgBlameNotify> m(new MsgBlameNotify(std::move(msg)));
+    async_decode(m).then([this, m, peer](bool ok) {
+        MSG_COST(MsgBlameNotify::opcode);
+        if (!ok) return;
+        RcObj<BlameNotify> bn(new BlameNotify(std::move(m->bn)));
+        promise::all(std::vector<promise_t>{
+            async_deliver_blk(bn->hqc_hash, peer),
+            bn->verify(vpool)
+        }).then([this, bn, peer](promise::values_t values) {
+            MSG_COST(MsgBlameNotify::opcode);
+            auto result = promise::any_cast<bool>(values[1]);
+            if (!result)
+                LOG_WARN("invalid blamenotify message from %s", std::string(peer).c_str());
+            else
+                on_receive_blamenotify(*bn);
+        });
     });
 }
 
 void HotStuffBase::new_view_handler(hotstuff::MsgNewView &&msg, const Net::conn_t &conn) {
-    const NetAddr &peer = conn->get_peer();
+    MSG_RECV(MsgNewView::opcode, msg.serialized.size());
+    MSG_COST(MsgNewView::opcode);
+    if (ssync.active) return;
+    const NetAddr peer = conn->get_peer();
     if (peer.is_null()) return;
-    msg.postponed_parse(this);
-    RcObj<Status> s(new Status(std::move(msg.status)));
-    promise::all(std::vector<promise_t>{
-            async_deliver_blk(s->hqc_blk_hash, peer),
-            s->verify(vpool)
-    }).then([this, s, peer](const promise::values_t values) {
-        if (!promise::any_cast<bool>(values[1]))
-            LOG_WARN("invalid status message from %s", std::string(peer).c_str());
-        else
-            on_receive_new_view(*s);
+    RcObj<MsgNewView> m(new MsgNewView(std::move(msg)));
+    async_decode(m).then([this, m, peer](bool ok) {
+        MSG_COST(MsgNewView::opcode);
+        if (!ok) return;
+        note_watermark(peer, m->watermark);
+        RcObj<Status> s(new Status(std::move(m->status)));
+        promise::all(std::vector<promise_t>{
+                async_deliver_blk(s->hqc_blk_hash, peer),
+                s->verify(vpool)
+        }).then([this, s, peer](const promise::values_t values) {
+            MSG_COST(MsgNewView::opcode);
+            if (!promise::any_cast<bool>(values[1]))
+                LOG_WARN("invalid status message from %s", std::string(peer).c_str());
+            else
+                on_receive_new_view(*s);
+        });
     });
-
 }
 
 
@@ -410,57 +1092,580 @@ void HotStuffBase::stop_status_timer() {
 
 
 void HotStuffBase::req_blk_handler(MsgReqBlock &&msg, const Net::conn_t &conn) {
+    MSG_RECV(MsgReqBlock::opcode, 4 + msg.blk_hashes.size() * 32);
+    MSG_COST(MsgReqBlock::opcode);
     const NetAddr replica = conn->get_peer();
-    auto &blk_hashes = msg.blk_hashes;
-    std::vector<promise_t> pms;
-    for (const auto &h: blk_hashes)
-        pms.push_back(async_fetch_blk(h, nullptr));
-    promise::all(pms).then([replica, this](const promise::values_t values) {
+    if (replica.is_null()) return;
+    /* answer right away with what we have, and tell the requester what we
+     * lack so that it can ask elsewhere; a peer over its quota gets the
+     * whole request back as missing */
+    if (!bulk_lane.has_quota(replica))
+    {
+        auto &missing = msg.blk_hashes;
+        if (missing.size() > blk_range_page_max)
+            missing.resize(blk_range_page_max);
+        _do_send<std::vector<block_t>, MsgRespBlock, MsgRespBlockCompact>(
+            std::vector<block_t>(), missing, replica);
+        return;
+    }
+    if (is_compact_peer(replica))
+        serve_blks<MsgRespBlockCompact>(std::move(msg.blk_hashes), replica);
+    else
+        serve_blks<MsgRespBlock>(std::move(msg.blk_hashes), replica);
+}
+
+template<typename M>
+void HotStuffBase::serve_blks(std::vector<uint256_t> &&blk_hashes, const NetAddr &replica) {
+    RcObj<M> resp(new M(DataStream()));
+    /* the lookups (in the published index) and the encoding are done by a
+     * worker, the event loop only queues the result */
+    async_run([this, resp, blk_hashes=std::move(blk_hashes)]() {
         std::vector<block_t> blks;
-        for (auto &v: values)
+        std::vector<uint256_t> missing;
+        for (const auto &h: blk_hashes)
         {
-            auto blk = promise::any_cast<block_t>(v);
-            blks.push_back(blk);
+            block_t blk = storage->find_published_blk(h);
+            if (blk)
+                blks.push_back(std::move(blk));
+            else if (missing.size() < blk_range_page_max)
+                missing.push_back(h);
         }
-        pn.send_msg(MsgRespBlock(blks), replica);
+        *resp = M(blks, missing);
+        /* the constructor only encodes it; kept for the check below */
+        resp->missing = std::move(missing);
+        return !blks.empty();
+    }).then([this, resp, replica](bool bulky) {
+        /* nothing bulky to shape */
+        if (!bulky)
+        {
+            if (!resp->missing.empty()) _do_send(*resp, replica);
+            return;
+        }
+        _do_send_bulk(resp, replica);
     });
 }
 
-void HotStuffBase::resp_blk_handler(MsgRespBlock &&msg, const Net::conn_t &) {
-    msg.postponed_parse(this);
-    for (const auto &blk: msg.blks)
-        if (blk) on_fetch_blk(blk);
+HotStuffBase::RangeFetch *HotStuffBase::find_range_fetch(const uint256_t &blk_hash) {
+    auto it = range_members.find(blk_hash);
+    if (it == range_members.end()) return nullptr;
+    auto rit = range_fetching.find(it->second);
+    return rit == range_fetching.end() ? nullptr : &rit->second;
 }
 
-void HotStuffBase::print_stat() const {
-    LOG_INFO("===== begin stats =====");
-    LOG_INFO("-------- queues -------");
-    LOG_INFO("blk_fetch_waiting: %lu", blk_fetch_waiting.size());
-    LOG_INFO("blk_delivery_waiting: %lu", blk_delivery_waiting.size());
-    LOG_INFO("decision_waiting: %lu", decision_waiting.size());
-    LOG_INFO("commit_timers: %lu", commit_timers.size());
-    LOG_INFO("-------- misc ---------");
-    LOG_INFO("fetched: %lu", fetched);
-    LOG_INFO("delivered: %lu", delivered);
-    LOG_INFO("cmd_cache: %lu", storage->get_cmd_cache_size());
-    LOG_INFO("blk_cache: %lu", storage->get_blk_cache_size());
-    LOG_INFO("------ misc (10s) -----");
-    LOG_INFO("fetched: %lu", part_fetched);
-    LOG_INFO("delivered: %lu", part_delivered);
-    LOG_INFO("decided: %lu", part_decided);
-    LOG_INFO("gened: %lu", part_gened);
-    LOG_INFO("avg. parent_size: %.3f",
-            part_delivered ? part_parent_size / double(part_delivered) : 0);
-    LOG_INFO("delivery time: %.3f avg, %.3f min, %.3f max",
-            part_delivered ? part_delivery_time / double(part_delivered) : 0,
-            part_delivery_time_min == double_inf ? 0 : part_delivery_time_min,
-            part_delivery_time_max);
+HotStuffBase::RangeFetch *HotStuffBase::start_range_fetch(const block_t &blk,
+                                                        const uint256_t &anchor,
+                                                        const NetAddr &replica_id) {
+    auto it = range_fetching.find(anchor);
+    if (it != range_fetching.end()) return &it->second;
+    auto &rf = range_fetching[anchor];
+    rf.peer = replica_id;
+    rf.min_height = delivered_height + 1;
+    rf.next_offset = 0;
+    rf.ninflight = 0;
+    rf.done = false;
+    rf.timeout = TimerEvent(ec, [this, anchor](TimerEvent &) {
+        LOG_WARN("range fetch below %.10s timeout", get_hex(anchor).c_str());
+        finish_range_fetch(anchor);
+    });
+    rf.timeout.add(ent_waiting_timeout);
+    range_members[blk->get_hash()] = anchor;
+    range_members[anchor] = anchor;
+    LOG_INFO("fetching ancestors from %.10s down to height %u from %s",
+            get_hex(anchor).c_str(), rf.min_height,
+            std::string(replica_id).c_str());
+    pump_range_fetch(anchor);
+    return &rf;
+}
 
-    part_parent_size = 0;
-    part_fetched = 0;
-    part_delivered = 0;
+void HotStuffBase::pump_range_fetch(const uint256_t &anchor) {
+    auto it = range_fetching.find(anchor);
+    if (it == range_fetching.end()) return;
+    auto &rf = it->second;
+    while (!rf.done && rf.ninflight < blk_range_window)
+    {
+        _do_send(MsgReqBlockRange(anchor, rf.min_height,
+                                rf.next_offset, blk_range_page), rf.peer);
+        rf.ninflight++;
+        rf.next_offset += blk_range_page;
+    }
+    if (!rf.ninflight)
+        finish_range_fetch(anchor);
+}
+
+void HotStuffBase::finish_range_fetch(const uint256_t &anchor) {
+    auto it = range_fetching.find(anchor);
+    if (it == range_fetching.end()) return;
+    auto rf = std::move(it->second);
+    range_fetching.erase(it);
+    for (auto mit = range_members.begin(); mit != range_members.end();)
+    {
+        if (mit->second == anchor) mit = range_members.erase(mit);
+        else mit++;
+    }
+    for (const auto &h: rf.deferred)
+    {
+        auto fit = blk_fetch_waiting.find(h);
+        if (fit != blk_fetch_waiting.end())
+            fit->second.fetch_from(rf.peer);
+    }
+}
+
+void HotStuffBase::req_blk_range_handler(MsgReqBlockRange &&msg, const Net::conn_t &conn) {
+    MSG_RECV(MsgReqBlockRange::opcode, msg.serialized.size());
+    MSG_COST(MsgReqBlockRange::opcode);
+    const NetAddr replica = conn->get_peer();
+    if (replica.is_null()) return;
+    /* an empty page makes the requester fall back to other peers */
+    if (!bulk_lane.has_quota(replica) || msg.count > blk_range_page_max)
+    {
+        _do_send_bulk(RcObj<MsgRespBlockRange>(new MsgRespBlockRange(
+            msg.blk_hash, msg.offset, std::vector<block_t>())), replica);
+        return;
+    }
+    RcObj<MsgRespBlockRange> resp(new MsgRespBlockRange(DataStream()));
+    /* walked and encoded by a worker; only published blocks are visited,
+     * which have their heights known and their bodies in */
+    async_run([this, resp, blk_hash=msg.blk_hash, min_height=msg.min_height,
+                offset=msg.offset, count=msg.count]() {
+        auto parent = [this](const block_t &blk) -> block_t {
+            const auto &parents = blk->get_parent_hashes();
+            if (parents.empty()) return nullptr;
+            return storage->find_published_blk(parents[0]);
+        };
+        std::vector<block_t> blks;
+        block_t blk = storage->find_published_blk(blk_hash);
+        for (uint32_t i = 0; blk && i < offset; i++)
+            blk = parent(blk);
+        for (; blk && blks.size() < count &&
+                blk->get_height() >= min_height; blk = parent(blk))
+            blks.push_back(blk);
+        std::reverse(blks.begin(), blks.end());
+        *resp = MsgRespBlockRange(blk_hash, offset, blks);
+        return true;
+    }).then([this, resp, replica](bool) {
+        _do_send_bulk(resp, replica);
+    });
+}
+
+void HotStuffBase::resp_blk_range_handler(MsgRespBlockRange &&msg, const Net::conn_t &) {
+    MSG_RECV(MsgRespBlockRange::opcode, msg.serialized.size());
+    MSG_COST(MsgRespBlockRange::opcode);
+    RcObj<MsgRespBlockRange> m(new MsgRespBlockRange(std::move(msg)));
+    async_decode(m).then([this, m](bool ok) {
+        MSG_COST(MsgRespBlockRange::opcode);
+        if (!ok) return;
+        auto it = range_fetching.find(m->blk_hash);
+        if (it == range_fetching.end()) return;
+        auto &rf = it->second;
+        auto &blks = m->blks;
+        /* a page must be a single chain of first parents */
+        for (size_t i = 1; i < blks.size(); i++)
+        {
+            const auto &parents = blks[i]->get_parent_hashes();
+            if (parents.empty() || parents[0] != blks[i - 1]->get_hash())
+            {
+                LOG_WARN("broken range page below %.10s",
+                        get_hex(m->blk_hash).c_str());
+                blks.clear();
+                break;
+            }
+        }
+        m->finish_parse(this);
+        for (const auto &blk: blks)
+            range_members[blk->get_hash()] = m->blk_hash;
+        /* hand the page over bottom-up, so each block finds its parent
+         * already fetched */
+        for (const auto &blk: blks)
+            on_fetch_blk(blk);
+        rf.ninflight--;
+        rf.timeout.del();
+        rf.timeout.add(ent_waiting_timeout);
+        /* stop once the peer runs out, or the chain reaches blocks we had
+         * before this range */
+        if (blks.size() < blk_range_page)
+            rf.done = true;
+        else
+        {
+            const auto &parents = blks[0]->get_parent_hashes();
+            if (parents.empty() ||
+                (storage->is_blk_fetched(parents[0]) &&
+                !range_members.count(parents[0])))
+                rf.done = true;
+        }
+        pump_range_fetch(m->blk_hash);
+    });
+}
+
+void HotStuffBase::take_snapshot(const block_t &blk) {
+    if (!snapshot_interval) return;
+    uint32_t height = blk->get_height();
+    if (snapshot.blk && height < snapshot.height + snapshot_interval) return;
+    bytearray_t state = get_app_snapshot();
+    std::vector<bytearray_t> chunks;
+    std::vector<uint256_t> chunk_hashes;
+    for (size_t off = 0; off < state.size(); off += snapshot_chunk_size)
+    {
+        auto end = std::min(state.size(), off + snapshot_chunk_size);
+        chunks.push_back(bytearray_t(state.begin() + off, state.begin() + end));
+        chunk_hashes.push_back(get_hash(chunks.back()));
+    }
+    snapshot = Snapshot(blk, height, blk->get_self_qc()->clone(),
+                        std::move(chunk_hashes), this);
+    snapshot_digest = snapshot.get_digest();
+    snapshot_chunks = std::move(chunks);
+    LOG_INFO("checkpoint %s", std::string(snapshot).c_str());
+}
+
+void HotStuffBase::start_snapshot_sync() {
+    ssync.active = true;
+    ssync.nretry = 0;
+    ssync.offers.clear();
+    ssync.digest = uint256_t();
+    /* peers connecting later are asked by the connection handler */
+    for (const auto &peer: peers)
+        _do_send(MsgReqSnapshot(), peer);
+    ssync.timeout.del();
+    ssync.timeout.add(ent_waiting_timeout);
+    LOG_INFO("asking peers for a snapshot");
+}
+
+void HotStuffBase::on_snapshot_sync_timeout() {
+    if (!ssync.active) return;
+    if (!ssync.digest.is_null())
+    {
+        /* ask for the missing chunks again, from other sources */
+        LOG_WARN("snapshot chunks timeout (%lu/%lu)",
+                ssync.nreceived, ssync.chunks.size());
+        ssync.round++;
+        ssync.next_chunk = 0;
+        ssync.ninflight = 0;
+        pump_snapshot_sync();
+        ssync.timeout.add(ent_waiting_timeout);
+        return;
+    }
+    if (++ssync.nretry > snapshot_sync_retries)
+    {
+        LOG_WARN("no snapshot agreed on by enough peers, replaying the chain");
+        ssync.active = false;
+        ssync.offers.clear();
+        return;
+    }
+    ssync.offers.clear();
+    for (const auto &peer: peers)
+        _do_send(MsgReqSnapshot(), peer);
+    ssync.timeout.add(ent_waiting_timeout);
+}
+
+void HotStuffBase::begin_snapshot_download(const uint256_t &digest) {
+    auto &offer = ssync.offers[digest];
+    size_t nchunks = offer.first.chunk_hashes.size();
+    ssync.digest = digest;
+    ssync.sources.assign(offer.second.begin(), offer.second.end());
+    ssync.chunks.assign(nchunks, bytearray_t());
+    ssync.received.assign(nchunks, false);
+    ssync.nreceived = 0;
+    ssync.next_chunk = 0;
+    ssync.ninflight = 0;
+    ssync.round = 0;
+    ssync.timeout.del();
+    ssync.timeout.add(ent_waiting_timeout);
+    LOG_INFO("downloading %s from %lu peers",
+            std::string(offer.first).c_str(), ssync.sources.size());
+    pump_snapshot_sync();
+}
+
+void HotStuffBase::pump_snapshot_sync() {
+    size_t nchunks = ssync.chunks.size();
+    if (ssync.nreceived == nchunks)
+    {
+        finish_snapshot_sync();
+        return;
+    }
+    while (ssync.ninflight < snapshot_chunk_window && ssync.next_chunk < nchunks)
+    {
+        size_t idx = ssync.next_chunk++;
+        if (ssync.received[idx]) continue;
+        const auto &peer = ssync.sources[(idx + ssync.round) % ssync.sources.size()];
+        _do_send(MsgReqSnapshotChunk(ssync.digest, idx), peer);
+        ssync.ninflight++;
+    }
+}
+
+void HotStuffBase::finish_snapshot_sync() {
+    ssync.timeout.del();
+    ssync.active = false;
+    auto offer = std::move(ssync.offers[ssync.digest]);
+    ssync.offers.clear();
+    bytearray_t state;
+    for (const auto &chunk: ssync.chunks)
+        state.insert(state.end(), chunk.begin(), chunk.end());
+    auto &snap = offer.first;
+    if (!install_snapshot(snap))
+    {
+        LOG_WARN("snapshot %s is behind, replaying the chain",
+                std::string(snap).c_str());
+        ssync.chunks.clear();
+        return;
+    }
+    install_app_snapshot(state);
+    delivered_height = std::max(delivered_height, snap.height);
+    /* serve it to others as well */
+    snapshot = std::move(snap);
+    snapshot.blk = get_b_exec();
+    snapshot_digest = ssync.digest;
+    snapshot_chunks = std::move(ssync.chunks);
+    ssync.chunks.clear();
+}
+
+void HotStuffBase::req_snapshot_handler(MsgReqSnapshot &&msg, const Net::conn_t &conn) {
+    MSG_RECV(MsgReqSnapshot::opcode, msg.serialized.size());
+    MSG_COST(MsgReqSnapshot::opcode);
+    const NetAddr replica = conn->get_peer();
+    if (replica.is_null()) return;
+    _do_send(MsgSnapshot(snapshot), replica);
+}
+
+void HotStuffBase::snapshot_handler(MsgSnapshot &&msg, const Net::conn_t &conn) {
+    MSG_RECV(MsgSnapshot::opcode, msg.serialized.size());
+    MSG_COST(MsgSnapshot::opcode);
+    const NetAddr peer = conn->get_peer();
+    if (peer.is_null() || !ssync.active || !ssync.digest.is_null()) return;
+    RcObj<MsgSnapshot> m(new MsgSnapshot(std::move(msg)));
+    async_decode(m).then([this, m, peer](bool ok) {
+        MSG_COST(MsgSnapshot::opcode);
+        if (!ok || !ssync.active || !ssync.digest.is_null()) return;
+        auto &snap = m->snapshot;
+        if (!snap.blk || snap.height <= get_b_exec()->get_height()) return;
+        auto digest = snap.get_digest();
+        auto it = ssync.offers.find(digest);
+        if (it == ssync.offers.end())
+            it = ssync.offers.insert(std::make_pair(digest,
+                std::make_pair(std::move(snap), std::unordered_set<NetAddr>()))).first;
+        auto &vouchers = it->second.second;
+        /* at least one of f + 1 replicas vouching for it is honest */
+        size_t nvouch = get_config().nreplicas - get_config().nmajority + 1;
+        if (!vouchers.insert(peer).second || vouchers.size() != nvouch) return;
+        it->second.first.verify(vpool).then([this, digest](bool result) {
+            MSG_COST(MsgSnapshot::opcode);
+            if (!ssync.active || !ssync.digest.is_null()) return;
+            if (!result)
+            {
+                LOG_WARN("invalid QC in snapshot %.10s", get_hex(digest).c_str());
+                ssync.offers.erase(digest);
+                return;
+            }
+            begin_snapshot_download(digest);
+        });
+    });
+}
+
+void HotStuffBase::req_snapshot_chunk_handler(MsgReqSnapshotChunk &&msg, const Net::conn_t &conn) {
+    MSG_RECV(MsgReqSnapshotChunk::opcode, msg.serialized.size());
+    MSG_COST(MsgReqSnapshotChunk::opcode);
+    const NetAddr replica = conn->get_peer();
+    if (replica.is_null()) return;
+    /* an unanswered request is retried from another source */
+    if (!snapshot.blk || msg.digest != snapshot_digest ||
+        msg.idx >= snapshot_chunks.size() || !bulk_lane.has_quota(replica))
+        return;
+    _do_send_bulk(RcObj<MsgSnapshotChunk>(
+        new MsgSnapshotChunk(msg.digest, msg.idx, snapshot_chunks[msg.idx])), replica);
+}
+
+void HotStuffBase::snapshot_chunk_handler(MsgSnapshotChunk &&msg, const Net::conn_t &) {
+    MSG_RECV(MsgSnapshotChunk::opcode, msg.serialized.size());
+    MSG_COST(MsgSnapshotChunk::opcode);
+    if (!ssync.active || ssync.digest.is_null()) return;
+    RcObj<MsgSnapshotChunk> m(new MsgSnapshotChunk(std::move(msg)));
+    async_decode(m).then([this, m](bool ok) {
+        MSG_COST(MsgSnapshotChunk::opcode);
+        if (!ok || !ssync.active || m->digest != ssync.digest) return;
+        const auto &chunk_hashes = ssync.offers[ssync.digest].first.chunk_hashes;
+        size_t idx = m->idx;
+        if (idx >= chunk_hashes.size() || ssync.received[idx]) return;
+        if (m->data_hash != chunk_hashes[idx])
+        {
+            LOG_WARN("snapshot chunk %lu does not match its hash", idx);
+            return;
+        }
+        ssync.chunks[idx] = std::move(m->data);
+        ssync.received[idx] = true;
+        ssync.nreceived++;
+        if (ssync.ninflight) ssync.ninflight--;
+        ssync.timeout.del();
+        ssync.timeout.add(ent_waiting_timeout);
+        pump_snapshot_sync();
+    });
+}
+
+template<typename M>
+void HotStuffBase::resp_blk_handler(M &&msg, const Net::conn_t &conn) {
+    MSG_RECV(M::opcode, msg.serialized.size());
+    MSG_COST(M::opcode);
+    const NetAddr peer = conn->get_peer();
+    RcObj<M> m(new M(std::move(msg)));
+    async_decode(m).then([this, m, peer](bool ok) {
+        MSG_COST(M::opcode);
+        if (!ok) return;
+        /* a full copy of a block we only have the header of */
+        for (const auto &blk: m->blks)
+        {
+            if (!blk) continue;
+            block_t hdr = storage->find_blk(blk->get_hash());
+            if (hdr && !hdr->is_body_delivered())
+                fill_body(hdr, std::vector<uint256_t>(blk->get_cmds()));
+        }
+        m->finish_parse(this);
+        for (const auto &blk: m->blks)
+        {
+            if (!blk) continue;
+            auto it = blk_fetch_waiting.find(blk->get_hash());
+            if (it != blk_fetch_waiting.end())
+                it->second.on_response(peer);
+            on_fetch_blk(blk);
+        }
+        for (const auto &h: m->missing)
+        {
+            auto it = blk_fetch_waiting.find(h);
+            if (it != blk_fetch_waiting.end())
+                it->second.on_missing(peer);
+        }
+    });
+}
+
+void HotStuffBase::hello_handler(MsgHello &&msg, const Net::conn_t &conn) {
+    const NetAddr &peer = conn->get_peer();
+    if (peer.is_null()) return;
+    if (msg.version < wire_version_min)
+    {
+        /* it would not even agree with us on the hashes of blocks */
+        LOG_WARN("refusing peer %s with wire version %d",
+                std::string(peer).c_str(), msg.version);
+        pn.terminate(conn);
+        return;
+    }
+    peer_version[peer] = msg.version;
+    if (is_compact_peer(peer)) return;
+    auto it = std::find(legacy_peers.begin(), legacy_peers.end(), peer);
+    if (it == legacy_peers.end()) return;
+    legacy_peers.erase(it);
+    compact_peers.push_back(peer);
+    LOG_INFO("peer %s speaks wire version %d", std::string(peer).c_str(), msg.version);
+}
+
+#ifdef HOTSTUFF_MSG_STAT
+static const char *get_msg_name(opcode_t opcode) {
+    switch (opcode)
+    {
+        case MsgPropose::opcode: return "propose";
+        case MsgVote::opcode: return "vote";
+        case MsgReqBlock::opcode: return "reqblk";
+        case MsgRespBlock::opcode: return "respblk";
+        case MsgStatus::opcode: return "status";
+        case MsgBlame::opcode: return "blame";
+        case MsgBlameNotify::opcode: return "blamenotify";
+        case MsgNotify::opcode: return "notify";
+        case MsgNewView::opcode: return "newview";
+        case MsgHello::opcode: return "hello";
+        case MsgReqBlockRange::opcode: return "reqblkrange";
+        case MsgRespBlockRange::opcode: return "respblkrange";
+        case MsgReqSnapshot::opcode: return "reqsnapshot";
+        case MsgSnapshot::opcode: return "snapshot";
+        case MsgReqSnapshotChunk::opcode: return "reqsnapchunk";
+        case MsgSnapshotChunk::opcode: return "snapchunk";
+        case MsgProposeCompact::opcode: return "propose*";
+        case MsgVoteCompact::opcode: return "vote*";
+        case MsgRespBlockCompact::opcode: return "respblk*";
+        case MsgStatusCompact::opcode: return "status*";
+        case MsgProposeHeader::opcode: return "proposehdr";
+        case MsgBlockBody::opcode: return "blkbody";
+        case MsgBlockBodyShort::opcode: return "blkbody*";
+        case MsgReqBodyCmds::opcode: return "reqbodycmds";
+        case MsgRespBodyCmds::opcode: return "respbodycmds";
+        case MsgReconReq::opcode: return "reconreq";
+        case MsgReconResp::opcode: return "reconresp";
+        case MsgBatch::opcode: return "batch";
+        case MsgBatchAck::opcode: return "batchack";
+        case MsgReqBatch::opcode: return "reqbatch";
+    }
+    return "unknown";
+}
+#endif
+
+void HotStuffBase::print_stat() const {
+    LOG_INFO("===== begin stats =====");
+    LOG_INFO("-------- queues -------");
+    LOG_INFO("blk_fetch_waiting: %lu", blk_fetch_waiting.size());
+    LOG_INFO("blk_delivery_waiting: %lu", blk_delivery_waiting.size());
+    LOG_INFO("blk_vouched: %lu", blk_vouched.size());
+    LOG_INFO("body_waiting: %lu", body_waiting.size());
+    LOG_INFO("range_fetching: %lu", range_fetching.size());
+    LOG_INFO("snapshot: %s (%lu chunks)%s", std::string(snapshot).c_str(),
+            snapshot_chunks.size(), ssync.active ? ", syncing" : "");
+    LOG_INFO("decision_waiting: %lu (+%lu duplicates)",
+            decision_waiting.size(), decision_waiting_dup.size());
+    LOG_INFO("cmd admitted: %lu (max %lu)", cmd_admitted.load(), cmd_admitted_max);
+    LOG_INFO("commit_timers: %lu", commit_timers.size());
+    LOG_INFO("bulk_lane: %lu (%lu bytes)", bulk_lane.size(), bulk_lane.size_bytes());
+    LOG_INFO("-------- misc ---------");
+    LOG_INFO("fetched: %lu", fetched);
+    LOG_INFO("delivered: %lu", delivered);
+    LOG_INFO("verify avoided: %lu", verify_avoided);
+    LOG_INFO("cmd_cache: %lu (%lu bytes)", storage->get_cmd_cache_size(),
+            storage->get_cmd_bytes());
+    LOG_INFO("blk_cache: %lu", storage->get_blk_cache_size());
+    LOG_INFO("blk_published: %lu", storage->get_published_blk_size());
+    LOG_INFO("blk_gc_pinned: %lu", get_gc_pinned_size());
+    LOG_INFO("mempool: %lu (%lu not proposed, %lu bytes)",
+            mempool.size(), mempool.get_nfree(), mempool.get_nfree_bytes());
+    LOG_INFO("decided window: %lu", decided.size());
+    if (batch_size)
+        LOG_INFO("batches: %lu (%lu only heard of, %lu fetching)",
+                batches.size(), nbatch_unheld, batch_fetching.size());
+    LOG_INFO("blk_target: %lu (commit latency %.3f avg, %.3f min)",
+            assembly.target, assembly.latency,
+            assembly.latency_min == double_inf ? 0 : assembly.latency_min);
+    LOG_INFO("------ misc (10s) -----");
+    LOG_INFO("fetched: %lu", part_fetched);
+    LOG_INFO("delivered: %lu", part_delivered);
+    LOG_INFO("decided: %lu", part_decided);
+    LOG_INFO("gened: %lu", part_gened);
+    LOG_INFO("verify avoided: %lu", part_verify_avoided);
+    LOG_INFO("pushed: %lu", part_pushed);
+    LOG_INFO("vouched by hash link: %lu", part_vouched);
+    LOG_INFO("abandoned on forks: %lu", part_abandoned);
+    LOG_INFO("duplicate cmds: %lu", part_dup_cmds);
+    LOG_INFO("busy cmds: %u", part_cmd_busy.load());
+    LOG_INFO("short ids: %u resolved, %u asked for", part_sid_hit, part_sid_miss);
+    LOG_INFO("reconciliation: %u rounds (%u failed), %lu bytes, %u cmds learned",
+            part_recon_rounds, part_recon_failed, part_recon_bytes, part_recon_learned);
+    LOG_INFO("avg. parent_size: %.3f",
+            part_delivered ? part_parent_size / double(part_delivered) : 0);
+    LOG_INFO("delivery time: %.3f avg, %.3f min, %.3f max",
+            part_delivered ? part_delivery_time / double(part_delivered) : 0,
+            part_delivery_time_min == double_inf ? 0 : part_delivery_time_min,
+            part_delivery_time_max);
+
+#ifdef HOTSTUFF_MSG_STAT
+    uint32_t _part_decided = part_decided;
+#endif
+    part_parent_size = 0;
+    part_fetched = 0;
+    part_delivered = 0;
     part_decided = 0;
     part_gened = 0;
+    part_verify_avoided = 0;
+    part_pushed = 0;
+    part_vouched = 0;
+    part_abandoned = 0;
+    part_dup_cmds = 0;
+    part_sid_hit = 0;
+    part_sid_miss = 0;
+    part_recon_rounds = 0;
+    part_recon_failed = 0;
+    part_recon_learned = 0;
+    part_recon_bytes = 0;
+    part_cmd_busy = 0;
     part_delivery_time = 0;
     part_delivery_time_min = double_inf;
     part_delivery_time_max = 0;
@@ -468,6 +1673,7 @@ void HotStuffBase::print_stat() const {
     LOG_INFO("--- replica msg. (10s) ---");
     size_t _nsent = 0;
     size_t _nrecv = 0;
+    size_t _nsentb = 0;
     for (const auto &replica: peers)
     {
         auto conn = pn.get_peer_conn(replica);
@@ -477,16 +1683,39 @@ void HotStuffBase::print_stat() const {
         size_t nsb = conn->get_nsentb();
         size_t nrb = conn->get_nrecvb();
         conn->clear_msgstat();
-        LOG_INFO("%s: %u(%u), %u(%u), %u",
-            std::string(replica).c_str(), ns, nsb, nr, nrb, part_fetched_replica[replica]);
+        auto &fst = fetch_stat[replica];
+        LOG_INFO("%s: %u(%u), %u(%u), %u, fetch rtt %.3f/%.3f (p50/p95) ok %.2f",
+            std::string(replica).c_str(), ns, nsb, nr, nrb, part_fetched_replica[replica],
+            fst.get_rtt_quantile(0.5), fst.get_rtt_quantile(0.95),
+            fst.get_success_rate());
         _nsent += ns;
         _nrecv += nr;
+        _nsentb += nsb;
         part_fetched_replica[replica] = 0;
     }
     nsent += _nsent;
     nrecv += _nrecv;
     LOG_INFO("sent: %lu", _nsent);
     LOG_INFO("recv: %lu", _nrecv);
+    LOG_INFO("compact peers: %lu/%lu", compact_peers.size(), peers.size());
+    LOG_INFO("sent bytes per decided cmd: %.1f",
+            _part_decided ? _nsentb / double(_part_decided) : 0);
+    LOG_INFO("--- msg. types (10s) ---");
+    LOG_INFO("type: sent(bytes), recv(bytes), handler/decode cpu ms; sizes <128B,<256B,...,>=64KB");
+    for (auto &p: part_msg_stat)
+    {
+        auto &st = p.second;
+        auto &decode_ns = part_decode_ns[p.first];
+        std::string hist;
+        for (size_t i = 0; i < MsgTypeStat::nbins; i++)
+            hist += (i ? "," : "") + std::to_string(st.size_hist[i]);
+        LOG_INFO("%s: %u(%lu), %u(%lu), %.3f/%.3f; %s",
+            get_msg_name(p.first),
+            st.nsent, st.nsentb, st.nrecv, st.nrecvb,
+            st.cpu_sec * 1e3, decode_ns.exchange(0) * 1e-6,
+            hist.c_str());
+        st.clear();
+    }
     LOG_INFO("--- replica msg. total ---");
     LOG_INFO("sent: %lu", nsent);
     LOG_INFO("recv: %lu", nrecv);
@@ -508,30 +1737,110 @@ HotStuffBase::HotStuffBase(uint32_t blk_size,
         ec(ec),
         tcall(ec),
         vpool(ec, nworker),
+        bulk_lane(ec),
+        cmd_admitted(0),
+        cmd_admitted_max(0),
+        part_cmd_busy(0),
         pn(ec, netconfig),
         pmaker(std::move(pmaker)),
+        cmd_pending(cmd_ring_size),
+        short_ids(false),
 
-        fetched(0), delivered(0),
+        batch_size(0),
+        batch_wait(0),
+        nbatch_unheld(0),
+        nbatch_bytes(0),
+        recon_period(0),
+        recon_next(0),
+        recon_round(0),
+        delivered_height(0),
+        snapshot_interval(0),
+        fetched(0), delivered(0), verify_avoided(0),
         nsent(0), nrecv(0),
         part_parent_size(0),
         part_fetched(0),
         part_delivered(0),
         part_decided(0),
         part_gened(0),
+        part_verify_avoided(0),
+        part_pushed(0),
+        part_vouched(0),
+        part_abandoned(0),
+        part_dup_cmds(0),
+        part_sid_hit(0),
+        part_sid_miss(0),
+        part_recon_rounds(0),
+        part_recon_failed(0),
+        part_recon_learned(0),
+        part_recon_bytes(0),
         part_delivery_time(0),
         part_delivery_time_min(double_inf),
         part_delivery_time_max(0)
 {
+#ifdef HOTSTUFF_MSG_STAT
+    for (auto &ns: part_decode_ns) ns = 0;
+#endif
+    assembly.target = blk_size;
+    assembly.max_bytes = 0;
+    assembly.max_wait = 0;
+    assembly.latency = 0;
+    assembly.latency_min = double_inf;
+    assembly.deadline = TimerEvent(ec, [this](TimerEvent &) {
+        if (this->pmaker->get_proposer() != get_id()) return;
+        /* a partial block: its oldest command has waited long enough */
+        if (mempool.get_nfree()) propose_batch();
+        propose_from_mempool();
+    });
+    batch_timer = TimerEvent(ec, [this](TimerEvent &) { seal_batch(); });
+    batch_fetch_timer = TimerEvent(ec, [this](TimerEvent &) {
+        std::vector<uint256_t> digests;
+        for (const auto &p: batch_fetching) digests.push_back(p.first);
+        if (!digests.empty()) request_batches(digests);
+    });
+    ssync.enabled = false;
+    ssync.active = false;
+    ssync.timeout = TimerEvent(ec, [this](TimerEvent &) {
+        on_snapshot_sync_timeout();
+    });
     /* register the handlers for msg from replicas */
-    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::propose_handler, this, _1, _2));
-    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::vote_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::propose_handler<MsgPropose>, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::vote_handler<MsgVote>, this, _1, _2));
     pn.reg_handler(salticidae::generic_bind(&HotStuffBase::notify_handler, this, _1, _2));
-    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::status_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::status_handler<MsgStatus>, this, _1, _2));
     pn.reg_handler(salticidae::generic_bind(&HotStuffBase::blame_handler, this, _1, _2));
     pn.reg_handler(salticidae::generic_bind(&HotStuffBase::blamenotify_handler, this, _1, _2));
     pn.reg_handler(salticidae::generic_bind(&HotStuffBase::req_blk_handler, this, _1, _2));
-    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::resp_blk_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::resp_blk_handler<MsgRespBlock>, this, _1, _2));
     pn.reg_handler(salticidae::generic_bind(&HotStuffBase::new_view_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::hello_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::req_blk_range_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::resp_blk_range_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::req_snapshot_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::snapshot_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::req_snapshot_chunk_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::snapshot_chunk_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::propose_handler<MsgProposeCompact>, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::vote_handler<MsgVoteCompact>, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::status_handler<MsgStatusCompact>, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::resp_blk_handler<MsgRespBlockCompact>, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::propose_handler<MsgProposeHeader>, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::blk_body_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::blk_body_short_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::req_body_cmds_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::resp_body_cmds_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::recon_req_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::recon_resp_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::batch_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::batch_ack_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::req_batch_handler, this, _1, _2));
+    /* announce our wire format version on every new connection */
+    pn.reg_conn_handler([this](const salticidae::ConnPool::conn_t &_conn, bool connected) {
+        if (!connected) return;
+        auto conn = salticidae::static_pointer_cast<Net::Conn>(_conn);
+        pn.send_msg(MsgHello(wire_version), conn);
+        if (ssync.active && ssync.digest.is_null())
+            pn.send_msg(MsgReqSnapshot(), conn);
+    });
     pn.start();
     pn.listen(listen_addr);
 }
@@ -540,35 +1849,758 @@ void HotStuffBase::do_consensus(const block_t &blk){
 //    pmaker->on_consensus(blk);
 }
 
+void HotStuffBase::wait_body(const block_t &blk, const NetAddr &peer) {
+    const auto &blk_hash = blk->get_hash();
+    auto it = body_waiting.find(blk_hash);
+    if (it != body_waiting.end())
+    {
+        auto &bw = it->second;
+        if (!bw.early) return;
+        if (bw.body_digest == blk->get_body_digest())
+        {
+            fill_body(blk, std::move(bw.cmds));
+            return;
+        }
+        LOG_WARN("body of %.10s does not match its header", get_hex(blk_hash).c_str());
+        bw.early = false;
+        bw.cmds.clear();
+    }
+    else
+        it = body_waiting.insert(std::make_pair(blk_hash, BodyWaiting())).first;
+    auto &bw = it->second;
+    bw.peer = peer;
+    bw.timeout = TimerEvent(ec, [this, blk_hash](TimerEvent &) {
+        auto it = body_waiting.find(blk_hash);
+        if (it == body_waiting.end()) return;
+        auto fit = blk_fetch_waiting.find(blk_hash);
+        if (fit == blk_fetch_waiting.end())
+            LOG_WARN("body of %.10s is late, fetching the block",
+                    get_hex(blk_hash).c_str());
+        else if (fit->second.asked_all())
+        {
+            /* nobody had it when asked; some may have received it since,
+             * so go round again (a committed block cannot be skipped) */
+            LOG_WARN("body of %.10s held by no replica asked, fetching again",
+                    get_hex(blk_hash).c_str());
+            blk_fetch_waiting.erase(fit);
+            fit = blk_fetch_waiting.end();
+        }
+        /* not only from the proposer, which may be withholding it: the
+         * fetch moves on to the other replicas as it would for a block */
+        if (fit == blk_fetch_waiting.end())
+        {
+            fit = blk_fetch_waiting.insert(std::make_pair(blk_hash,
+                    BlockFetchContext(blk_hash, this))).first;
+            fit->second.add_replica(it->second.peer);
+        }
+        it->second.timeout.add(ent_waiting_timeout);
+    });
+    bw.timeout.add(2 * get_config().delta);
+}
+
+void HotStuffBase::drop_body_fetch(const uint256_t &blk_hash) {
+    auto it = body_waiting.find(blk_hash);
+    if (it != body_waiting.end())
+    {
+        it->second.timeout.del();
+        body_waiting.erase(it);
+    }
+    /* the header is here, so a fetch still going on is for the body */
+    auto fit = blk_fetch_waiting.find(blk_hash);
+    if (fit != blk_fetch_waiting.end())
+        blk_fetch_waiting.erase(fit);
+}
+
+void HotStuffBase::fill_body(const block_t &blk, std::vector<uint256_t> &&cmds) {
+    drop_body_fetch(blk->get_hash());
+    mempool.mark_taken(cmds);
+    on_deliver_body(blk, std::move(cmds));
+}
+
+void HotStuffBase::blk_body_handler(MsgBlockBody &&msg, const Net::conn_t &) {
+    MSG_RECV(MsgBlockBody::opcode, msg.serialized.size());
+    MSG_COST(MsgBlockBody::opcode);
+    RcObj<MsgBlockBody> m(new MsgBlockBody(std::move(msg)));
+    async_decode(m).then([this, m](bool ok) {
+        MSG_COST(MsgBlockBody::opcode);
+        if (!ok) return;
+        on_body(m->blk_hash, std::move(m->cmds), m->body_digest);
+    });
+}
+
+void HotStuffBase::on_body(const uint256_t &blk_hash, std::vector<uint256_t> &&cmds,
+                            const uint256_t &body_digest) {
+    block_t blk = storage->find_blk(blk_hash);
+    if (blk)
+    {
+        if (blk->is_body_delivered()) return;
+        if (body_digest != blk->get_body_digest())
+        {
+            LOG_WARN("body of %.10s does not match its header",
+                    get_hex(blk_hash).c_str());
+            return;
+        }
+        fill_body(blk, std::move(cmds));
+        return;
+    }
+    /* the header is still being decoded: keep the body for a while */
+    if (body_waiting.count(blk_hash)) return;
+    auto &bw = body_waiting[blk_hash];
+    bw.early = true;
+    bw.body_digest = body_digest;
+    bw.cmds = std::move(cmds);
+    bw.timeout = TimerEvent(ec, [this, blk_hash](TimerEvent &) {
+        body_waiting.erase(blk_hash);
+    });
+    bw.timeout.add(ent_waiting_timeout);
+}
+
+void HotStuffBase::multicast_body(const block_t &blk) {
+    std::vector<NetAddr> full, sid;
+    for (const auto &peer: compact_peers)
+        (short_ids && get_peer_version(peer) >= 2 ? sid : full).push_back(peer);
+    if (!sid.empty())
+    {
+        const auto &cmds = blk->get_cmds();
+        ShortIdKey key(blk->get_hash());
+        std::vector<uint64_t> sids;
+        FlatHashMap<uint64_t, bool, ShortIdHash> seen;
+        seen.reserve(cmds.size());
+        for (const auto &cmd: cmds)
+        {
+            sids.push_back(key(cmd));
+            if (!seen.try_emplace(sids.back(), true).second) break;
+        }
+        if (sids.size() == cmds.size())
+        {
+            MsgBlockBodyShort m(blk->get_hash(), sids);
+            stat_sent(MsgBlockBodyShort::opcode, m.serialized.size(), sid.size());
+            pn.multicast_msg(m, sid);
+        }
+        else
+            /* two commands of the block collide: no way to tell them apart */
+            full.insert(full.end(), sid.begin(), sid.end());
+    }
+    if (!full.empty())
+    {
+        MsgBlockBody m(blk);
+        stat_sent(MsgBlockBody::opcode, m.serialized.size(), full.size());
+        pn.multicast_msg(m, full);
+    }
+}
+
+void HotStuffBase::blk_body_short_handler(MsgBlockBodyShort &&msg, const Net::conn_t &conn) {
+    MSG_RECV(MsgBlockBodyShort::opcode, 33 + msg.sids.size() * short_id_bytes);
+    MSG_COST(MsgBlockBodyShort::opcode);
+    const NetAddr &peer = conn->get_peer();
+    const auto &blk_hash = msg.blk_hash;
+    const auto &sids = msg.sids;
+    if (peer.is_null() || short_bodies.count(blk_hash)) return;
+    /* only the proposer sends one (along with its header): taken from
+     * anyone, the first would keep the right one out until it times out */
+    if (peer != get_config().get_addr(pmaker->get_proposer())) return;
+    block_t blk = storage->find_blk(blk_hash);
+    if (blk && blk->is_body_delivered()) return;
+    /* the position of each short id in the body */
+    FlatHashMap<uint64_t, uint32_t, ShortIdHash> pos;
+    pos.reserve(sids.size());
+    /* the matches per position: 0, 1, or 2 for more (including a short id
+     * appearing twice in the body) */
+    std::vector<uint8_t> nmatch(sids.size(), 0);
+    for (uint32_t i = 0; i < sids.size(); i++)
+    {
+        auto res = pos.try_emplace(sids[i], i);
+        if (!res.second) nmatch[i] = nmatch[res.first->second] = 2;
+    }
+    std::vector<uint256_t> cmds(sids.size());
+    ShortIdKey key(blk_hash);
+    /* every command seen here, in a block already or not: a linear scan,
+     * as the key is new for each block */
+    auto match = [&](const uint256_t &h) {
+        auto it = pos.find(key(h));
+        if (it == pos.end()) return;
+        auto &n = nmatch[it->second];
+        if (!n) cmds[it->second] = h;
+        /* the same command, both pending and in a batch */
+        else if (cmds[it->second] == h) return;
+        if (n < 2) n++;
+    };
+    mempool.for_each(match);
+    for (const auto &p: batches)
+        if (p.second.batch) match(p.first);
+    ShortBody sb;
+    for (uint32_t i = 0; i < sids.size(); i++)
+        if (nmatch[i] != 1) sb.missing.push_back(i);
+    part_sid_hit += sids.size() - sb.missing.size();
+    if (sb.missing.empty())
+    {
+        auto body_digest = Block::get_body_digest(cmds);
+        on_body(blk_hash, std::move(cmds), body_digest);
+        return;
+    }
+    part_sid_miss += sb.missing.size();
+    _do_send(MsgReqBodyCmds(blk_hash, sb.missing), peer);
+    sb.cmds = std::move(cmds);
+    sb.peer = peer;
+    /* a body that never completes is fetched in full by wait_body() */
+    sb.timeout = TimerEvent(ec, [this, blk_hash](TimerEvent &) {
+        short_bodies.erase(blk_hash);
+    });
+    sb.timeout.add(ent_waiting_timeout);
+    short_bodies.insert(std::make_pair(blk_hash, std::move(sb)));
+}
+
+void HotStuffBase::req_body_cmds_handler(MsgReqBodyCmds &&msg, const Net::conn_t &conn) {
+    MSG_RECV(MsgReqBodyCmds::opcode, 33 + msg.idx.size() * 2);
+    MSG_COST(MsgReqBodyCmds::opcode);
+    block_t blk = storage->find_blk(msg.blk_hash);
+    if (!blk || !blk->is_body_delivered()) return;
+    const auto &body = blk->get_cmds();
+    std::vector<uint256_t> cmds;
+    for (uint32_t i: msg.idx)
+    {
+        if (i >= body.size()) return;
+        cmds.push_back(body[i]);
+    }
+    _do_send(MsgRespBodyCmds(msg.blk_hash, msg.idx, cmds), conn->get_peer());
+}
+
+void HotStuffBase::resp_body_cmds_handler(MsgRespBodyCmds &&msg, const Net::conn_t &conn) {
+    MSG_RECV(MsgRespBodyCmds::opcode, 33 + msg.cmds.size() * 34);
+    MSG_COST(MsgRespBodyCmds::opcode);
+    auto it = short_bodies.find(msg.blk_hash);
+    if (it == short_bodies.end() || msg.idx != it->second.missing ||
+        conn->get_peer() != it->second.peer) return;
+    auto &sb = it->second;
+    for (size_t i = 0; i < msg.idx.size(); i++)
+        sb.cmds[msg.idx[i]] = msg.cmds[i];
+    auto cmds = std::move(sb.cmds);
+    sb.timeout.del();
+    short_bodies.erase(it);
+    auto body_digest = Block::get_body_digest(cmds);
+    on_body(msg.blk_hash, std::move(cmds), body_digest);
+}
+
+IBLT HotStuffBase::make_recon_iblt(size_t ncells, uint64_t salt) const {
+    IBLT iblt(ncells, salt);
+    mempool.for_each_free([this, &iblt](const uint256_t &h, uint32_t size) {
+        /* only what clients sent here: a stale one goes no further */
+        if (!recon_learned.count(h)) iblt.insert(h, size);
+    });
+    return iblt;
+}
+
+void HotStuffBase::recon_step() {
+    recon_timer.add(recon_period);
+    recon_expire();
+    if (peers.empty()) return;
+    /* the next peer that can take part */
+    const NetAddr *peer = nullptr;
+    for (size_t i = 0; i < peers.size() && !peer; i++)
+    {
+        const auto &p = peers[recon_next++ % peers.size()];
+        if (get_peer_version(p) >= 3) peer = &p;
+    }
+    if (!peer) return;
+    auto &rp = recon_peers[*peer];
+    /* an unanswered round is forgotten: a lost table is no reason to grow */
+    if (!rp.ncells) rp.ncells = recon_cells_min;
+    rp.round = ++recon_round;
+    part_recon_rounds++;
+    MsgReconReq m(rp.round, make_recon_iblt(rp.ncells,
+                    ((uint64_t)get_id() << 32) | rp.round));
+    part_recon_bytes += m.serialized.size();
+    _do_send(m, *peer);
+}
+
+void HotStuffBase::recon_learn(const std::vector<std::pair<uint256_t, uint32_t>> &cmds) {
+    bool added = false;
+    for (const auto &p: cmds)
+    {
+        /* decided here */
+        if (decided.count(p.first)) continue;
+        /* taken in as if from a client: no room, no more */
+        if (cmd_admitted.fetch_add(1) >= cmd_admitted_max && cmd_admitted_max)
+        {
+            cmd_admitted--;
+            break;
+        }
+        /* or gone into a block we have seen */
+        if (!mempool.add(p.first, p.second))
+        {
+            cmd_admitted--;
+            continue;
+        }
+        uint64_t horizon = decided.get_horizon();
+        recon_learned.try_emplace(p.first, horizon);
+        recon_learned_order.push_back(std::make_pair(horizon, p.first));
+        part_recon_learned++;
+        added = true;
+    }
+    if (added) propose_from_mempool();
+}
+
+void HotStuffBase::recon_expire() {
+    while (!recon_learned_order.empty() &&
+            recon_learned_order.front().first <= decided.get_nadded())
+    {
+        const uint256_t h = recon_learned_order.front().second;
+        recon_learned_order.pop_front();
+        auto it = recon_learned.find(h);
+        /* decided meanwhile */
+        if (it == recon_learned.end()) continue;
+        if (!mempool.remove_free(h))
+        {
+            /* in a block: given another window, in case it is abandoned */
+            it->second = decided.get_horizon();
+            recon_learned_order.push_back(std::make_pair(it->second, h));
+            continue;
+        }
+        recon_learned.erase(it);
+        cmd_admitted--;
+    }
+}
+
+void HotStuffBase::recon_req_handler(MsgReconReq &&msg, const Net::conn_t &conn) {
+    MSG_RECV(MsgReconReq::opcode, 15 + msg.iblt.size() * IBLT::cell_bytes);
+    MSG_COST(MsgReconReq::opcode);
+    const NetAddr peer = conn->get_peer();
+    if (peer.is_null() || !msg.ok || batch_size) return;
+    /* a peer asks once in a few periods: more often, the pass over the
+     * mempool is not worth it */
+    auto &rp = recon_peers[peer];
+    auto now = Mempool::clock_t::now();
+    if (std::chrono::duration<double>(now - rp.last_req).count() <
+            std::max(recon_period, recon_req_gap_min))
+        return;
+    rp.last_req = now;
+    part_recon_bytes += 15 + msg.iblt.size() * IBLT::cell_bytes;
+    auto &diff = msg.iblt;
+    diff.subtract(make_recon_iblt(diff.size(), diff.get_salt()));
+    std::vector<std::pair<uint256_t, uint32_t>> theirs, mine;
+    bool ok = diff.decode(theirs, mine);
+    if (ok) recon_learn(theirs);
+    else mine.clear();
+    MsgReconResp resp(msg.round, ok, theirs.size() + mine.size(), mine);
+    part_recon_bytes += resp.serialized.size();
+    _do_send(resp, peer);
+}
+
+void HotStuffBase::recon_resp_handler(MsgReconResp &&msg, const Net::conn_t &conn) {
+    MSG_RECV(MsgReconResp::opcode, 10 + msg.cmds.size() * 36);
+    MSG_COST(MsgReconResp::opcode);
+    auto it = recon_peers.find(conn->get_peer());
+    if (it == recon_peers.end() || !msg.round || it->second.round != msg.round)
+        return;
+    part_recon_bytes += 10 + msg.cmds.size() * 36;
+    auto &rp = it->second;
+    rp.round = 0;
+    if (!msg.ok)
+    {
+        part_recon_failed++;
+        rp.ncells = std::min(rp.ncells * 2, recon_cells_max);
+        return;
+    }
+    recon_learn(msg.cmds);
+    /* about 1.5 cells per difference are enough to list it */
+    rp.ncells = std::max(recon_cells_min,
+                std::min((size_t)msg.ndiff * 2, recon_cells_max));
+}
+
+void HotStuffBase::push_missing_blks(const block_t &blk) {
+    if (blk->get_parents().empty()) return;
+    for (const auto &peer: peers)
+    {
+        /* nothing is pushed blindly to a peer never heard from */
+        auto it = peer_watermark.find(peer);
+        if (it == peer_watermark.end()) continue;
+        uint32_t wm = it->second;
+        std::vector<block_t> blks;
+        for (block_t b = blk->get_parents()[0];
+            b && b->get_height() > wm && blks.size() < blk_push_max &&
+            b->is_body_delivered();
+            b = b->get_parents().empty() ? nullptr : b->get_parents()[0])
+            blks.push_back(b);
+        const auto &qc_ref = blk->get_qc_ref();
+        if (qc_ref && qc_ref->get_height() > wm && qc_ref->is_body_delivered() &&
+            std::find(blks.begin(), blks.end(), qc_ref) == blks.end())
+            blks.push_back(qc_ref);
+        /* the proposal itself brings the peer up to blk */
+        it->second = std::max(wm, blk->get_height());
+        if (blks.empty()) continue;
+        std::reverse(blks.begin(), blks.end());
+        part_pushed += blks.size();
+        _do_send<std::vector<block_t>, MsgRespBlock, MsgRespBlockCompact>(blks, peer);
+    }
+}
+
 void HotStuffBase::do_broadcast_proposal(const Proposal &prop) {
-    MsgPropose prop_msg(prop);
-    pn.multicast_msg(prop_msg, peers);
+    /* the ancestors go out first, so they are there before they are asked for */
+    push_missing_blks(prop.blk);
+    if (!legacy_peers.empty())
+    {
+        MsgPropose m(prop);
+        stat_sent(MsgPropose::opcode, m.serialized.size(), legacy_peers.size());
+        pn.multicast_msg(m, legacy_peers);
+    }
+    if (!compact_peers.empty())
+    {
+        /* the header lets the peers vote while the body is still on its way */
+        MsgProposeHeader m(prop);
+        stat_sent(MsgProposeHeader::opcode, m.serialized.size(), compact_peers.size());
+        pn.multicast_msg(m, compact_peers);
+        if (!prop.blk->get_cmds().empty())
+            multicast_body(prop.blk);
+    }
     //for (const auto &replica: peers)
     //    pn.send_msg(prop_msg, replica);
 }
 
-void HotStuffBase::do_decide(Finality &&fin) {
-    part_decided++;
-    state_machine_execute(fin);
+void HotStuffBase::do_decide(Finality &&fin) { decide(std::move(fin), true); }
+
+void HotStuffBase::do_skip(const block_t &blk) {
+    if (!blk->is_body_delivered())
+    {
+        /* no point in fetching the body any more */
+        drop_body_fetch(blk->get_hash());
+        return;
+    }
+    const auto &cmds = blk->get_cmds();
+    for (uint32_t i = 0; i < cmds.size(); i++)
+        decide(Finality(get_id(), 1, i, blk->get_height(),
+                        cmds[i], blk->get_hash()), false);
+}
+
+void HotStuffBase::decide(Finality &&fin, bool execute) {
+    if (!batch_size)
+    {
+        decide_cmd(std::move(fin), execute);
+        return;
+    }
+    /* a batch digest: its commands are decided in order, all of them,
+     * whatever was decided before (which differs from replica to replica):
+     * the votes keep duplicates out of the chain instead */
+    auto it = batches.find(fin.cmd_hash);
+    if (it == batches.end() || !it->second.batch)
+    {
+        if (execute)
+            throw std::runtime_error("batch " + get_hex10(fin.cmd_hash) +
+                                    " executed without its payload");
+        /* covered by a snapshot: it is not needed any more */
+        mempool.remove(fin.cmd_hash);
+        decided.add(fin);
+        if (batch_fetching.erase(fin.cmd_hash) && batch_fetching.empty())
+            batch_fetch_timer.del();
+        return;
+    }
+    RcObj<Batch> batch = it->second.batch;
+    settle_batch(it->second);
+    mempool.remove(fin.cmd_hash);
+    decided.add(fin);
+    /* evicted between blocks only, see do_commit() */
+    batch_retired.push_back(fin.cmd_hash);
+    for (const auto &cmd_hash: batch->cmds)
+        decide_cmd(Finality(fin.rid, fin.decision, fin.cmd_idx, fin.cmd_height,
+                            cmd_hash, fin.blk_hash), execute);
+}
+
+void HotStuffBase::decide_cmd(Finality &&fin, bool execute) {
+    mempool.remove(fin.cmd_hash);
+    /* the slot it took when learned */
+    if (recon_learned.erase(fin.cmd_hash)) cmd_admitted--;
+    if (fin.decision == 1) decided.add(fin);
+    if (execute)
+    {
+        part_decided++;
+        state_machine_execute(fin);
+    }
+    /* no longer to be proposed: found by find_cmd() up to here */
+    storage->settle_cmd(fin.cmd_hash);
     auto it = decision_waiting.find(fin.cmd_hash);
-    if (it != decision_waiting.end())
+    if (it == decision_waiting.end()) return;
+    uint64_t handle = it->second;
+    decision_waiting.erase(it);
+    finish_cmd(fin, handle);
+    if (decision_waiting_dup.empty()) return;
+    auto range = decision_waiting_dup.equal_range(fin.cmd_hash);
+    for (auto dit = range.first; dit != range.second; dit++)
+        finish_cmd(fin, dit->second);
+    decision_waiting_dup.erase(range.first, range.second);
+}
+
+void HotStuffBase::do_commit(const block_t &blk, bool certified) {
+    /* not while a block executes, as is_payload_ready() found its batches */
+    while (batch_retired.size() > batch_retain_max)
+    {
+        batches.erase(batch_retired.front());
+        batch_retired.pop_front();
+    }
+    adapt_blk_target(blk);
+    if (certified) take_snapshot(blk);
+}
+
+void HotStuffBase::adapt_blk_target(const block_t &blk) {
+    auto &ba = assembly;
+    auto it = ba.proposed.find(blk->get_hash());
+    if (it == ba.proposed.end()) return;
+    double lat = std::chrono::duration<double>(
+        Mempool::clock_t::now() - it->second).count();
+    ba.proposed.erase(it);
+    ba.latency = ba.latency ? ba.latency * 0.875 + lat * 0.125 : lat;
+    ba.latency_min = std::min(ba.latency_min, lat);
+    if (mempool.get_nfree() > ba.target)
+        /* falling behind: fewer, larger blocks */
+        ba.target = std::min(ba.target << 1, blk_size);
+    else if (ba.latency > 2 * ba.latency_min)
+        /* the pipeline is congested: smaller blocks commit sooner */
+        ba.target = std::max(ba.target * 3 / 4, (size_t)1);
+}
+
+void HotStuffBase::do_abandon(const block_t &blk) {
+    part_abandoned++;
+    assembly.proposed.erase(blk->get_hash());
+    /* its commands can be proposed again */
+    if (blk->is_body_delivered()) mempool.untake(blk->get_cmds());
+    /* no point in fetching the body any more */
+    drop_body_fetch(blk->get_hash());
+}
+
+bool HotStuffBase::is_payload_ready(const block_t &blk) {
+    if (!batch_size) return true;
+    std::vector<uint256_t> missing;
+    for (const auto &digest: blk->get_cmds())
+    {
+        auto it = batches.find(digest);
+        if (it == batches.end() || !it->second.batch)
+            missing.push_back(digest);
+    }
+    if (missing.empty()) return true;
+    fetch_batches(missing);
+    return false;
+}
+
+bool HotStuffBase::is_vote_ready(const block_t &blk) {
+    if (!batch_size) return true;
+    if (!blk->is_body_delivered()) return false;
+    /* at least one of f + 1 holders is honest and can serve it */
+    size_t nholders = get_config().nreplicas - get_config().nmajority + 1;
+    std::unordered_set<uint256_t> seen;
+    for (const auto &digest: blk->get_cmds())
+    {
+        /* executed in full each time it is committed: a duplicate, in the
+         * block or of a decided one, is not certified */
+        if (decided.count(digest) || !seen.insert(digest).second) return false;
+        auto it = batches.find(digest);
+        if (it == batches.end()) return false;
+        const auto &e = it->second;
+        if (!e.batch && e.holders.size() < nholders) return false;
+    }
+    /* nor one of the uncommitted blocks it extends */
+    for (block_t b = blk->get_parents().empty() ? nullptr : blk->get_parents()[0];
+            b && b->get_decision() == 0 && b->is_body_delivered();
+            b = b->get_parents().empty() ? nullptr : b->get_parents()[0])
+        for (const auto &digest: b->get_cmds())
+            if (seen.count(digest)) return false;
+    return true;
+}
+
+void HotStuffBase::add_to_batch(const uint256_t &cmd_hash, bytearray_t &&payload) {
+    if (batch_out.cmds.empty()) batch_timer.add(batch_wait);
+    batch_out.nbytes += payload.size();
+    batch_out.cmds.push_back(cmd_hash);
+    batch_out.payloads.push_back(std::move(payload));
+    if (batch_out.cmds.size() >= batch_size) seal_batch();
+}
+
+void HotStuffBase::seal_batch() {
+    batch_timer.del();
+    if (batch_out.cmds.empty()) return;
+    RcObj<Batch> batch(new Batch(std::move(batch_out)));
+    batch_out = Batch();
+    RcObj<MsgBatch> m(new MsgBatch(DataStream()));
+    /* the payloads are copied and hashed by a worker */
+    async_run([batch, m]() {
+        *m = MsgBatch(*batch);
+        return true;
+    }).then([this, batch, m](bool) {
+        stat_sent(MsgBatch::opcode, m->serialized.size(), peers.size());
+        pn.multicast_msg(*m, peers);
+        /* the peers count us as a holder from the batch itself */
+        hold_batch(m->digest, RcObj<Batch>(batch));
+    });
+}
+
+bool HotStuffBase::hold_batch(const uint256_t &digest, RcObj<Batch> &&batch,
+                            const NetAddr &origin) {
+    /* unless a committed block has it again */
+    if (decided.count(digest) && !batch_fetching.count(digest)) return false;
+    auto it = batches.find(digest);
+    if (it != batches.end() && it->second.batch) return false;
+    if (!origin.is_null())
+    {
+        /* not asked for: a faulty peer can push any number of them, until
+         * proposed (those are asked for again) */
+        size_t &pushed = batch_pushed[origin];
+        if (pushed + batch->nbytes > batch_peer_bytes_max ||
+            nbatch_bytes + batch->nbytes > batch_bytes_max)
+        {
+            if (!pushed) batch_pushed.erase(origin);
+            return false;
+        }
+        pushed += batch->nbytes;
+    }
+    if (it == batches.end())
+        it = batches.try_emplace(digest).first;
+    else
+        nbatch_unheld--;
+    /* any of them coming in directly is a duplicate */
+    mempool.mark_taken(batch->cmds);
+    auto &e = it->second;
+    e.batch = std::move(batch);
+    e.pending = true;
+    e.origin = origin;
+    nbatch_bytes += e.batch->nbytes;
+    note_batch_holder(digest, listen_addr);
+    if (batch_fetching.erase(digest))
+    {
+        if (batch_fetching.empty()) batch_fetch_timer.del();
+        on_payload_ready();
+    }
+    return true;
+}
+
+void HotStuffBase::settle_batch(BatchEntry &e) {
+    if (!e.pending) return;
+    e.pending = false;
+    nbatch_bytes -= e.batch->nbytes;
+    if (e.origin.is_null()) return;
+    auto it = batch_pushed.find(e.origin);
+    if ((it->second -= e.batch->nbytes) == 0) batch_pushed.erase(it);
+    e.origin = NetAddr();
+}
+
+void HotStuffBase::note_batch_holder(const uint256_t &digest, const NetAddr &holder) {
+    auto it = batches.find(digest);
+    if (it == batches.end())
+    {
+        if (decided.count(digest)) return;
+        if (nbatch_unheld >= batch_unheld_max)
+        {
+            /* never sent to us, or long gone */
+            for (auto bit = batches.begin(); bit != batches.end();)
+                if (!bit->second.batch) bit = batches.erase(bit);
+                else bit++;
+            nbatch_unheld = 0;
+        }
+        it = batches.try_emplace(digest).first;
+        nbatch_unheld++;
+    }
+    auto &e = it->second;
+    if (e.holders.insert(holder).second) on_vote_ready();
+    /* at least one of f + 1 holders is honest and can serve it */
+    size_t nholders = get_config().nreplicas - get_config().nmajority + 1;
+    if (e.available || !e.batch || e.holders.size() < nholders) return;
+    e.available = true;
+    mempool.add(digest, e.batch->nbytes);
+    propose_from_mempool();
+}
+
+void HotStuffBase::fetch_batches(const std::vector<uint256_t> &digests) {
+    std::vector<uint256_t> req;
+    for (const auto &d: digests)
+        if (!batch_fetching.count(d)) req.push_back(d);
+    if (!req.empty()) request_batches(req);
+}
+
+void HotStuffBase::request_batches(const std::vector<uint256_t> &digests) {
+    if (peers.empty()) return;
+    std::unordered_map<const NetAddr, std::vector<uint256_t>> reqs;
+    for (const auto &d: digests)
+    {
+        size_t nasked = batch_fetching[d]++;
+        std::vector<const NetAddr *> holders;
+        auto it = batches.find(d);
+        if (it != batches.end())
+            for (const auto &h: it->second.holders)
+                if (h != listen_addr) holders.push_back(&h);
+        const NetAddr &target = holders.empty() ?
+            peers[nasked % peers.size()] : *holders[nasked % holders.size()];
+        reqs[target].push_back(d);
+    }
+    for (const auto &r: reqs)
+        _do_send(MsgReqBatch(r.second), r.first);
+    batch_fetch_timer.del();
+    batch_fetch_timer.add(2 * get_config().delta);
+}
+
+void HotStuffBase::batch_handler(MsgBatch &&msg, const Net::conn_t &conn) {
+    MSG_RECV(MsgBatch::opcode, msg.serialized.size());
+    MSG_COST(MsgBatch::opcode);
+    const NetAddr peer = conn->get_peer();
+    if (peer.is_null() || !batch_size) return;
+    RcObj<MsgBatch> m(new MsgBatch(std::move(msg)));
+    async_decode(m).then([this, m, peer](bool ok) {
+        MSG_COST(MsgBatch::opcode);
+        if (!ok) return;
+        const uint256_t digest = m->digest;
+        /* asked for, it is taken whatever the bounds */
+        const NetAddr origin = batch_fetching.count(digest) ? NetAddr() : peer;
+        if (hold_batch(digest, RcObj<Batch>(new Batch(std::move(m->batch))), origin))
+        {
+            MsgBatchAck ack(digest);
+            stat_sent(MsgBatchAck::opcode, ack.serialized.size(), peers.size());
+            pn.multicast_msg(ack, peers);
+        }
+        note_batch_holder(digest, peer);
+    });
+}
+
+void HotStuffBase::batch_ack_handler(MsgBatchAck &&msg, const Net::conn_t &conn) {
+    MSG_RECV(MsgBatchAck::opcode, msg.serialized.size());
+    MSG_COST(MsgBatchAck::opcode);
+    const NetAddr peer = conn->get_peer();
+    if (peer.is_null() || !batch_size) return;
+    note_batch_holder(msg.digest, peer);
+}
+
+void HotStuffBase::req_batch_handler(MsgReqBatch &&msg, const Net::conn_t &conn) {
+    MSG_RECV(MsgReqBatch::opcode, 1 + msg.digests.size() * 32);
+    MSG_COST(MsgReqBatch::opcode);
+    const NetAddr replica = conn->get_peer();
+    if (replica.is_null()) return;
+    for (const auto &d: msg.digests)
     {
-        it->second(std::move(fin));
-        decision_waiting.erase(it);
+        /* an unanswered request is retried elsewhere */
+        if (!bulk_lane.has_quota(replica)) break;
+        auto it = batches.find(d);
+        if (it == batches.end() || !it->second.batch) continue;
+        RcObj<Batch> batch = it->second.batch;
+        RcObj<MsgBatch> m(new MsgBatch(DataStream()));
+        async_run([batch, m]() {
+            *m = MsgBatch(*batch);
+            return true;
+        }).then([this, m, replica](bool) {
+            _do_send_bulk(m, replica);
+        });
     }
 }
 
 void HotStuffBase::do_status(const Status &status) {
-    MsgStatus m(status);
     ReplicaID next_proposer = pmaker->get_proposer();
 
     if (next_proposer != get_id())
-        pn.send_msg(m, get_config().get_addr(next_proposer));
+        _do_send<Status, MsgStatus, MsgStatusCompact, uint32_t>(
+            status, delivered_height, get_config().get_addr(next_proposer));
     else
         on_receive_status(status);
 }
 
-HotStuffBase::~HotStuffBase() {}
+HotStuffBase::~HotStuffBase() {
+    /* the payloads still on the ring */
+    PendingCmd buf[cmd_drain_max];
+    while (size_t n = cmd_pending.dequeue_bulk(buf, cmd_drain_max))
+        for (size_t i = 0; i < n; i++) delete buf[i].payload;
+}
 
 void HotStuffBase::start(
         std::vector<std::pair<NetAddr, pubkey_bt>> &&replicas,
@@ -580,6 +2612,7 @@ void HotStuffBase::start(
         if (addr != listen_addr)
         {
             peers.push_back(addr);
+            legacy_peers.push_back(addr);
             pn.add_peer(addr);
         }
     }
@@ -590,44 +2623,116 @@ void HotStuffBase::start(
         LOG_WARN("too few replicas in the system to tolerate any failure");
     on_init(nfaulty, delta);
     pmaker->init(this);
+    if (recon_period > 0 && !batch_size)
+    {
+        recon_timer = TimerEvent(ec, [this](TimerEvent &) { recon_step(); });
+        recon_timer.add(recon_period);
+    }
+    if (ssync.enabled)
+        start_snapshot_sync();
     if (ec_loop)
         ec.dispatch();
 
-    cmd_pending.reg_handler(ec, [this](cmd_queue_t &q) {
-        std::pair<uint256_t, commit_cb_t> e;
-        while (q.try_dequeue(e))
+    cmd_pending.reg_handler(ec, [this](cmd_ring_t &q) {
+        PendingCmd buf[cmd_drain_max];
+        size_t n = q.dequeue_bulk(buf, cmd_drain_max);
+        bool added = false;
+        for (size_t i = 0; i < n; i++)
         {
-            ReplicaID proposer = pmaker->get_proposer();
-            if (proposer != get_id()) continue;
-
-            const auto &cmd_hash = e.first;
-            cmd_pending_buffer.push(cmd_hash);
-
-            auto it = decision_waiting.find(cmd_hash);
-            if (it == decision_waiting.end())
-            {
-                it = decision_waiting.insert(std::make_pair(cmd_hash, e.second)).first;
-            }
-            else
+            const auto &e = buf[i];
+            const auto &cmd_hash = e.cmd_hash;
+            std::unique_ptr<bytearray_t> payload(e.payload);
+            Finality fin;
+            if (decided.find(cmd_hash, fin))
             {
-                // TODO: duplicate commands
+                /* decided already: answer it right away */
+                part_dup_cmds++;
+                finish_cmd(fin, e.handle);
+                continue;
             }
-            if (cmd_pending_buffer.size() >= blk_size)
+            if (e.cmd) storage->add_cmd(e.cmd, e.cmd_size);
+            /* kept whoever the proposer is: it may be us later */
+            if (!mempool.add(cmd_hash, e.cmd_size, batch_size > 0, e.client))
             {
-                std::vector<uint256_t> cmds;
-                for (uint32_t i = 0; i < blk_size; i++)
-                {
-                    cmds.push_back(cmd_pending_buffer.front());
-                    cmd_pending_buffer.pop();
-                }
-                pmaker->beat().then([this, cmds = std::move(cmds)](ReplicaID proposer) {
-                    if (proposer == get_id())
-                        on_propose(cmds, pmaker->get_parents());
-                });
-                return true;
+                /* pending or in a block already: only to be notified */
+                part_dup_cmds++;
+                wait_decision(cmd_hash, e.handle);
+                continue;
             }
+            added = true;
+            wait_decision(cmd_hash, e.handle);
+            if (batch_size)
+                /* ordered through the digest of its batch */
+                add_to_batch(cmd_hash, payload ? std::move(*payload) : bytearray_t());
         }
-        return false;
+        /* the whole lot at once, and the deadline of what is left */
+        if (added) propose_from_mempool();
+        return n == cmd_drain_max;
+    });
+    reg_mempool_hqc_update();
+    reg_mempool_view_change();
+}
+
+void HotStuffBase::propose_from_mempool() {
+    auto &ba = assembly;
+    if (pmaker->get_proposer() != get_id())
+    {
+        ba.deadline.del();
+        return;
+    }
+    while (mempool.get_nfree() >= ba.target ||
+            (ba.max_bytes && mempool.get_nfree_bytes() >= ba.max_bytes))
+        propose_batch();
+    ba.deadline.del();
+    Mempool::clock_t::time_point oldest;
+    if (ba.max_wait > 0 && mempool.get_oldest_arrival(oldest))
+    {
+        double waited = std::chrono::duration<double>(
+            Mempool::clock_t::now() - oldest).count();
+        ba.deadline.add(std::max(ba.max_wait - waited, 0.0));
+    }
+}
+
+void HotStuffBase::propose_batch() {
+    auto cmds = mempool.take(assembly.target, assembly.max_bytes);
+    /* decided meanwhile through another path */
+    cmds.erase(std::remove_if(cmds.begin(), cmds.end(),
+        [this](const uint256_t &h) {
+            if (!decided.count(h)) return false;
+            mempool.remove(h);
+            return true;
+        }), cmds.end());
+    if (cmds.empty()) return;
+    pmaker->beat().then([this, cmds = std::move(cmds)](ReplicaID proposer) {
+        block_t blk;
+        /* otherwise they stay for whoever proposes next */
+        if (proposer != get_id() ||
+            !(blk = on_propose(cmds, pmaker->get_parents())))
+        {
+            mempool.untake(cmds);
+            return;
+        }
+        assembly.proposed.insert(std::make_pair(blk->get_hash(),
+                                Mempool::clock_t::now()));
+    });
+}
+
+void HotStuffBase::reg_mempool_hqc_update() {
+    async_hqc_update().then([this](const block_t &) {
+        /* not in the middle of the core's state transition */
+        tcall.async_call([this](salticidae::ThreadCall::Handle &) {
+            propose_from_mempool();
+        });
+        reg_mempool_hqc_update();
+    });
+}
+
+void HotStuffBase::reg_mempool_view_change() {
+    async_wait_view_change().then([this](uint32_t) {
+        tcall.async_call([this](salticidae::ThreadCall::Handle &) {
+            propose_from_mempool();
+        });
+        reg_mempool_view_change();
     });
 }
 
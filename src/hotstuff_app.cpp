@@ -62,12 +62,15 @@ using hotstuff::MsgReqCmd;
 using hotstuff::MsgRespCmd;
 using hotstuff::get_hash;
 using hotstuff::promise_t;
+using hotstuff::FlatHashMap;
 
 using HotStuff = hotstuff::HotStuffSecp256k1;
 
 class HotStuffApp: public HotStuff {
     double stat_period;
     double impeach_timeout;
+    /** blocks kept below the last executed one (0: all) */
+    uint32_t prune_staleness;
     EventContext ec;
     EventContext req_ec;
     EventContext resp_ec;
@@ -80,7 +83,8 @@ class HotStuffApp: public HotStuff {
     /** The listen address for client RPC */
     NetAddr clisten_addr;
 
-    std::unordered_map<const uint256_t, promise_t> unconfirmed;
+    /** the clients waiting for each command (used by the response thread) */
+    FlatHashMap<uint256_t, std::vector<NetAddr>> unconfirmed;
 
     using conn_t = ClientNetwork<opcode_t>::conn_t;
     using resp_queue_t = salticidae::MPSCQueueEventDriven<Finality>;
@@ -93,6 +97,8 @@ class HotStuffApp: public HotStuff {
     salticidae::BoxObj<salticidae::ThreadCall> req_tcall;
 
     void client_request_cmd_handler(MsgReqCmd &&, const conn_t &);
+    /** Answer the clients waiting for a command (on the response thread). */
+    void confirm(const Finality &fin);
 
     static command_t parse_cmd(DataStream &s) {
         auto cmd = new CommandDummy();
@@ -108,11 +114,23 @@ class HotStuffApp: public HotStuff {
     void state_machine_execute(const Finality &fin) override {
         reset_imp_timer();
 #ifndef HOTSTUFF_ENABLE_BENCHMARK
-        HOTSTUFF_LOG_INFO("replicated %s", std::string(fin).c_str());
+        /* only held here for the commands submitted here */
+        auto cmd = find_cmd(fin.cmd_hash);
+        HOTSTUFF_LOG_INFO("replicated %s %s", std::string(fin).c_str(),
+                        cmd ? std::string(*cmd).c_str() : "");
 #endif
         resp_queue.enqueue(fin);
     }
 
+    /* the clients waiting are looked up by the command; through the same
+     * queue as their registration, so that the answer to a command decided
+     * already cannot overtake it */
+    void do_cmd_done(const Finality &fin, uint64_t) override {
+        resp_tcall->async_call([this, fin](salticidae::ThreadCall::Handle &) {
+            confirm(fin);
+        });
+    }
+
 //#ifdef HOTSTUFF_AUTOCLI
 //    void do_demand_commands(size_t blk_size) override {
 //        size_t ncli = client_conns.size();
@@ -144,6 +162,7 @@ class HotStuffApp: public HotStuff {
 
     void start(const std::vector<std::pair<NetAddr, bytearray_t>> &reps, double delta);
     void stop();
+    void set_prune_staleness(uint32_t staleness) { prune_staleness = staleness; }
 };
 
 std::pair<std::string, std::string> split_ip_port_cport(const std::string &s) {
@@ -162,6 +181,8 @@ int main(int argc, char **argv) {
     elapsed.start();
 
     auto opt_blk_size = Config::OptValInt::create(1);
+    auto opt_blk_bytes = Config::OptValInt::create(0);
+    auto opt_blk_wait = Config::OptValDouble::create(0.05);
     auto opt_parent_limit = Config::OptValInt::create(-1);
     auto opt_stat_period = Config::OptValDouble::create(10);
     auto opt_replicas = Config::OptValStrVec::create();
@@ -180,8 +201,33 @@ int main(int argc, char **argv) {
     auto opt_clinworker = Config::OptValInt::create(8);
     auto opt_cliburst = Config::OptValInt::create(1000);
     auto opt_delta = Config::OptValDouble::create(1);
+    auto opt_bulk_rate = Config::OptValDouble::create(0);
+    auto opt_bulk_burst = Config::OptValDouble::create(256);
+    auto opt_bulk_quota = Config::OptValInt::create(4096);
+    auto opt_snapshot_interval = Config::OptValInt::create(1000);
+    auto opt_snapshot_sync = Config::OptValFlag::create(false);
+    auto opt_dedup_mem = Config::OptValInt::create(64);
+    auto opt_max_pending = Config::OptValInt::create(100000);
+    auto opt_batch_size = Config::OptValInt::create(0);
+    auto opt_batch_wait = Config::OptValDouble::create(0.01);
+    auto opt_short_ids = Config::OptValFlag::create(false);
+    auto opt_recon_period = Config::OptValDouble::create(0);
+    auto opt_cmd_mem = Config::OptValInt::create(256);
+    auto opt_prune = Config::OptValInt::create(4096);
+    auto opt_cmd_order = Config::OptValStr::create("fifo");
+    auto opt_client_share = Config::OptValDouble::create(0);
+    auto opt_prio_clients = Config::OptValStrVec::create();
 
     config.add_opt("block-size", opt_blk_size, Config::SET_VAL);
+    config.add_opt("block-bytes", opt_blk_bytes, Config::SET_VAL);
+    config.add_opt("block-wait", opt_blk_wait, Config::SET_VAL);
+    config.add_opt("batch-size", opt_batch_size, Config::SET_VAL);
+    config.add_opt("batch-wait", opt_batch_wait, Config::SET_VAL);
+    config.add_opt("short-ids", opt_short_ids, Config::SWITCH_ON, 'I', "send block bodies as short ids to the replicas that take them (for clients sending to every replica)");
+    config.add_opt("recon-period", opt_recon_period, Config::SET_VAL, 'e', "reconcile pending commands with a replica this often in seconds (for clients not sending to every replica, 0 to disable)");
+    config.add_opt("cmd-order", opt_cmd_order, Config::SET_VAL, 'O', "the order to propose commands in (fifo, fair)");
+    config.add_opt("client-share", opt_client_share, Config::SET_VAL, 'S', "the largest share of a block for one client while others wait (for fair, 0 for no limit)");
+    config.add_opt("prio-client", opt_prio_clients, Config::APPEND, 'C', "put a client in a priority class, as <cid>,<class> (for fair, lower first)");
     config.add_opt("parent-limit", opt_parent_limit, Config::SET_VAL);
     config.add_opt("stat-period", opt_stat_period, Config::SET_VAL);
     config.add_opt("replica", opt_replicas, Config::APPEND, 'a', "add an replica to the list");
@@ -199,6 +245,15 @@ int main(int argc, char **argv) {
     config.add_opt("clinworker", opt_clinworker, Config::SET_VAL, 'M', "the number of threads for client network");
     config.add_opt("cliburst", opt_cliburst, Config::SET_VAL, 'B', "");
     config.add_opt("delta", opt_delta, Config::SET_VAL, 'd', "maximum network delay");
+    config.add_opt("bulk-rate", opt_bulk_rate, Config::SET_VAL, 'r', "limit block responses to this rate in KB/s (0 for unlimited)");
+    config.add_opt("bulk-burst", opt_bulk_burst, Config::SET_VAL, 'R', "the burst size in KB for bulk-rate");
+    config.add_opt("bulk-quota", opt_bulk_quota, Config::SET_VAL, 'Q', "the most KB of block responses queued for one peer (with bulk-rate)");
+    config.add_opt("snapshot-interval", opt_snapshot_interval, Config::SET_VAL, 'k', "take a checkpoint snapshot every this many committed blocks (0 to disable)");
+    config.add_opt("snapshot-sync", opt_snapshot_sync, Config::SWITCH_ON, 'K', "catch up from a snapshot offered by f + 1 replicas on start");
+    config.add_opt("cmd-mem", opt_cmd_mem, Config::SET_VAL, 'g', "the MB of commands held that no block refers to (0 for unlimited)");
+    config.add_opt("prune", opt_prune, Config::SET_VAL, 'G', "release the blocks (and their commands) this many blocks below the last executed one, every stat period (0 to keep them); a replica further behind catches up from a snapshot");
+    config.add_opt("dedup-mem", opt_dedup_mem, Config::SET_VAL, 'D', "the MB spent on remembering decided commands against duplicates");
+    config.add_opt("max-pending", opt_max_pending, Config::SET_VAL, 'P', "answer clients as busy once this many commands wait for a decision (0 for unlimited)");
     config.add_opt("help", opt_help, Config::SWITCH_ON, 'h', "show this help info");
 
     EventContext ec;
@@ -262,6 +317,32 @@ int main(int argc, char **argv) {
                         opt_nworker->get(),
                         repnet_config,
                         clinet_config);
+    papp->set_bulk_rate(opt_bulk_rate->get() * 1024, opt_bulk_burst->get() * 1024);
+    papp->set_bulk_peer_quota((size_t)opt_bulk_quota->get() * 1024);
+    papp->set_blk_assembly(opt_blk_bytes->get(), opt_blk_wait->get());
+    papp->set_snapshot_interval(opt_snapshot_interval->get());
+    papp->set_dedup_budget((size_t)opt_dedup_mem->get() << 20);
+    papp->set_max_pending_cmds(opt_max_pending->get());
+    papp->set_batching(opt_batch_size->get(), opt_batch_wait->get());
+    papp->set_short_ids(opt_short_ids->get());
+    papp->set_recon_period(opt_recon_period->get());
+    papp->set_cmd_budget((size_t)opt_cmd_mem->get() << 20);
+    papp->set_prune_staleness(opt_prune->get());
+    if (opt_cmd_order->get() == "fair")
+    {
+        auto order = new hotstuff::FairOrder(opt_client_share->get());
+        for (const auto &s: opt_prio_clients->get())
+        {
+            auto res = trim_all(split(s, ","));
+            if (res.size() != 2)
+                throw HotStuffError("invalid client priority");
+            order->set_class(std::stoul(res[0]), std::stoul(res[1]));
+        }
+        papp->set_cmd_order(std::unique_ptr<hotstuff::CmdOrder>(order));
+    }
+    else if (opt_cmd_order->get() != "fifo")
+        throw HotStuffError("unknown command order");
+    papp->set_snapshot_sync(opt_snapshot_sync->get());
     std::vector<std::pair<NetAddr, bytearray_t>> reps;
     for (auto &r: replicas)
     {
@@ -296,6 +377,7 @@ HotStuffApp::HotStuffApp(uint32_t blk_size,
             plisten_addr, std::move(pmaker), ec, nworker, repnet_config),
     stat_period(stat_period),
     impeach_timeout(impeach_timeout),
+    prune_staleness(0),
     ec(ec),
     cn(req_ec, clinet_config),
     clisten_addr(clisten_addr) {
@@ -304,15 +386,7 @@ HotStuffApp::HotStuffApp(uint32_t blk_size,
     req_tcall = new salticidae::ThreadCall(req_ec);
     resp_queue.reg_handler(resp_ec, [this](resp_queue_t &q) {
         Finality fin;
-        while (q.try_dequeue(fin))
-        {
-            auto it = unconfirmed.find(fin.cmd_hash);
-            if (it != unconfirmed.end())
-            {
-                it->second.resolve(fin);
-                unconfirmed.erase(it);
-            }
-        }
+        while (q.try_dequeue(fin)) confirm(fin);
         return false;
     });
 
@@ -324,29 +398,57 @@ HotStuffApp::HotStuffApp(uint32_t blk_size,
 
 void HotStuffApp::client_request_cmd_handler(MsgReqCmd &&msg, const conn_t &conn) {
     const NetAddr addr = conn->get_addr();
+    uint32_t cmd_size = msg.serialized.size();
+    /* only copied if it is to be disseminated */
+    bytearray_t payload;
+    if (is_batching())
+        payload = bytearray_t(msg.serialized.data(),
+                            msg.serialized.data() + cmd_size);
     auto cmd = parse_cmd(msg.serialized);
     const auto &cmd_hash = cmd->get_hash();
+    /* ordered fairly among the client connections: the cid in a command is
+     * whatever its sender put there, while the address is the one the
+     * connection was accepted from */
+    const uint32_t client = (uint32_t)std::hash<NetAddr>()(addr);
     HOTSTUFF_LOG_DEBUG("processing %s", std::string(*cmd).c_str());
-    exec_command(cmd_hash, [this, addr](Finality fin) {
-        resp_queue.enqueue(fin);
-    });
-    /* the following function is executed on the dedicated thread for confirming commands */
+    /* the following functions are executed on the dedicated thread for
+     * confirming commands; the client is registered before the command is
+     * submitted, as it may be answered right away */
     resp_tcall->async_call([this, addr, cmd_hash](salticidae::ThreadCall::Handle &) {
-        auto it = unconfirmed.find(cmd_hash);
-        if (it == unconfirmed.end())
-            it = unconfirmed.insert(
-                std::make_pair(cmd_hash, promise_t([](promise_t &){}))).first;
-        it->second.then([this, addr](const Finality &fin) {
-            cn.send_msg(MsgRespCmd(std::move(fin)), addr);
-        });
+        unconfirmed[cmd_hash].push_back(addr);
     });
+    if (!(is_batching() ?
+            exec_command(cmd_hash, std::move(payload), 0, client) :
+            exec_command(cmd, 0, cmd_size, client)))
+    {
+        /* nothing is kept for a command turned away */
+        resp_tcall->async_call([this, addr, cmd_hash](salticidae::ThreadCall::Handle &) {
+            auto it = unconfirmed.find(cmd_hash);
+            if (it == unconfirmed.end()) return;
+            auto &addrs = it->second;
+            auto ait = std::find(addrs.begin(), addrs.end(), addr);
+            if (ait != addrs.end()) addrs.erase(ait);
+            if (addrs.empty()) unconfirmed.erase(it);
+        });
+        cn.send_msg(MsgRespCmd(Finality(get_id(), 0, 0, 0, cmd_hash, uint256_t()),
+                            MsgRespCmd::STATUS_BUSY, 0), addr);
+    }
+}
+
+void HotStuffApp::confirm(const Finality &fin) {
+    auto it = unconfirmed.find(fin.cmd_hash);
+    if (it == unconfirmed.end()) return;
+    uint32_t credit = get_cmd_credit();
+    for (const auto &addr: it->second)
+        cn.send_msg(MsgRespCmd(fin, MsgRespCmd::STATUS_OK, credit), addr);
+    unconfirmed.erase(it);
 }
 
 void HotStuffApp::start(const std::vector<std::pair<NetAddr, bytearray_t>> &reps, double delta) {
     ev_stat_timer = TimerEvent(ec, [this](TimerEvent &) {
         HotStuff::print_stat();
         HotStuffApp::print_stat();
-        //HotStuffCore::prune(100);
+        if (prune_staleness) HotStuffCore::prune(prune_staleness);
         ev_stat_timer.add(stat_period);
     });
     ev_stat_timer.add(stat_period);
@@ -28,6 +28,7 @@
 #include "hotstuff/util.h"
 #include "hotstuff/type.h"
 #include "hotstuff/client.h"
+#include "hotstuff/hashmap.h"
 
 using salticidae::Config;
 
@@ -40,8 +41,10 @@ using hotstuff::CommandDummy;
 using hotstuff::Finality;
 using hotstuff::HotStuffError;
 using hotstuff::uint256_t;
+using hotstuff::FlatHashMap;
 using hotstuff::opcode_t;
 using hotstuff::command_t;
+using salticidae::TimerEvent;
 
 EventContext ec;
 ReplicaID proposer;
@@ -50,6 +53,10 @@ int max_iter_num;
 uint32_t cid;
 uint32_t cnt = 0;
 uint32_t nfaulty;
+/** the replicas each command is sent to, and how many of their answers
+ * make it confirmed (f + 1, or all of them if fewer) */
+std::vector<ReplicaID> targets;
+size_t nconfirm;
 
 struct Request {
     command_t cmd;
@@ -61,7 +68,14 @@ struct Request {
 using Net = salticidae::MsgNetwork<opcode_t>;
 
 std::unordered_map<ReplicaID, Net::conn_t> conns;
-std::unordered_map<const uint256_t, Request> waiting;
+FlatHashMap<uint256_t, Request> waiting;
+/** Flow control: the commands each replica would still take, as it last
+ * told us minus what has been sent to it since. */
+std::unordered_map<ReplicaID, uint32_t> credits;
+/** commands a replica was too busy to take, to be sent to it again */
+std::vector<std::pair<ReplicaID, uint256_t>> busy_retry;
+TimerEvent busy_retry_timer;
+double busy_retry_delay = 0.05;
 std::vector<NetAddr> replicas;
 std::vector<std::pair<struct timeval, double>> elapsed;
 Net mn(ec, Net::Config());
@@ -71,12 +85,28 @@ void connect_all() {
         conns.insert(std::make_pair(i, mn.connect(replicas[i])));
 }
 
+/** Whether enough replicas to confirm a command (f + 1) have credit left. If
+ * nothing is outstanding, one command is let through anyway to learn the
+ * credits again. */
+bool has_credit() {
+    if (waiting.empty()) return true;
+    size_t n = 0;
+    for (auto rid: targets)
+        if (credits[rid] > 0) n++;
+    return n >= nconfirm;
+}
+
 bool try_send(bool check = true) {
-    if ((!check || waiting.size() < max_async_num) && max_iter_num)
+    if ((!check || (waiting.size() < max_async_num && has_credit())) && max_iter_num)
     {
         auto cmd = new CommandDummy(cid, cnt++);
         MsgReqCmd msg(*cmd);
-        for (auto &p: conns) mn.send_msg(msg, p.second);
+        for (auto rid: targets)
+        {
+            mn.send_msg(msg, conns[rid]);
+            auto &c = credits[rid];
+            if (c) c--;
+        }
 #ifndef HOTSTUFF_ENABLE_BENCHMARK
         HOTSTUFF_LOG_INFO("send new cmd %.10s",
                             get_hex(cmd->get_hash()).c_str());
@@ -90,15 +120,28 @@ bool try_send(bool check = true) {
     return false;
 }
 
-void client_resp_cmd_handler(MsgRespCmd &&msg, const Net::conn_t &) {
+void client_resp_cmd_handler(MsgRespCmd &&msg, const Net::conn_t &conn) {
     auto &fin = msg.fin;
     HOTSTUFF_LOG_DEBUG("got %s", std::string(msg.fin).c_str());
     const uint256_t &cmd_hash = fin.cmd_hash;
+    for (const auto &p: conns)
+        if (p.second == conn)
+        {
+            credits[p.first] = msg.credit;
+            if (msg.status == MsgRespCmd::STATUS_BUSY)
+            {
+                /* try that replica again later */
+                if (busy_retry.empty()) busy_retry_timer.add(busy_retry_delay);
+                busy_retry.push_back(std::make_pair(p.first, cmd_hash));
+            }
+            break;
+        }
+    if (msg.status != MsgRespCmd::STATUS_OK) return;
     auto it = waiting.find(cmd_hash);
-    auto &et = it->second.et;
     if (it == waiting.end()) return;
+    auto &et = it->second.et;
     et.stop();
-    if (++it->second.confirmed <= nfaulty) return; // wait for f + 1 ack
+    if (++it->second.confirmed < nconfirm) return; // wait for f + 1 ack
 #ifndef HOTSTUFF_ENABLE_BENCHMARK
     HOTSTUFF_LOG_INFO("got %s, wall: %.3f, cpu: %.3f",
                         std::string(fin).c_str(),
@@ -134,6 +177,7 @@ int main(int argc, char **argv) {
     auto opt_max_iter_num = Config::OptValInt::create(100);
     auto opt_max_async_num = Config::OptValInt::create(10);
     auto opt_cid = Config::OptValInt::create(-1);
+    auto opt_fanout = Config::OptValInt::create(0);
 
     auto shutdown = [&](int) { ec.stop(); };
     salticidae::SigEvent ev_sigint(ec, shutdown);
@@ -152,6 +196,9 @@ int main(int argc, char **argv) {
     config.add_opt("replica", opt_replicas, Config::APPEND);
     config.add_opt("iter", opt_max_iter_num, Config::SET_VAL);
     config.add_opt("max-async", opt_max_async_num, Config::SET_VAL);
+    /* with batching on the replicas, f + 1 are enough to get a command in
+     * (and to be answered by an honest one) */
+    config.add_opt("fanout", opt_fanout, Config::SET_VAL);
     config.parse(argc, argv);
     auto idx = opt_idx->get();
     max_iter_num = opt_max_iter_num->get();
@@ -177,7 +224,26 @@ int main(int argc, char **argv) {
 
     nfaulty = (replicas.size() - 1) / 2;
     HOTSTUFF_LOG_INFO("nfaulty = %zu", nfaulty);
+    busy_retry_timer = TimerEvent(ec, [](TimerEvent &) {
+        auto retry = std::move(busy_retry);
+        busy_retry.clear();
+        for (const auto &e: retry)
+        {
+            auto it = waiting.find(e.second);
+            if (it == waiting.end()) continue;
+            mn.send_msg(MsgReqCmd(*it->second.cmd), conns[e.first]);
+        }
+    });
     connect_all();
+    size_t fanout = opt_fanout->get();
+    if (!fanout || fanout > replicas.size()) fanout = replicas.size();
+    if (fanout < (size_t)nfaulty + 1)
+        throw std::invalid_argument("fanout below f + 1");
+    /* spread the clients over the replicas */
+    for (size_t i = 0; i < fanout; i++)
+        targets.push_back((cid + i) % replicas.size());
+    nconfirm = nfaulty + 1;
+    for (auto rid: targets) credits[rid] = max_async_num;
     while (try_send());
     ec.dispatch();
 
@@ -20,4 +20,8 @@ namespace hotstuff {
 
 Logger logger("hotstuff");
 
+#ifdef HOTSTUFF_MSG_STAT
+thread_local bool CPUTimer::running = false;
+#endif
+
 }
@@ -0,0 +1,98 @@
+/**
+ * Copyright 2018 VMware
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+#include "hotstuff/type.h"
+#include "hotstuff/hashmap.h"
+
+using namespace hotstuff;
+
+/* compares FlatHashMap against std::unordered_map on random uint256_t keys,
+ * usage: bench_hashmap [nentries] */
+
+static std::vector<uint256_t> gen_keys(size_t n, uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    std::vector<uint256_t> keys;
+    keys.reserve(n);
+    bytearray_t buff(32);
+    for (size_t i = 0; i < n; i++)
+    {
+        for (size_t j = 0; j < 32; j += 8)
+        {
+            uint64_t r = rng();
+            for (size_t k = 0; k < 8; k++)
+                buff[j + k] = (uint8_t)(r >> (k * 8));
+        }
+        keys.push_back(uint256_t(buff));
+    }
+    return keys;
+}
+
+template<typename F>
+static double timed(F f) {
+    auto t0 = std::chrono::steady_clock::now();
+    f();
+    return std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - t0).count();
+}
+
+template<typename Map>
+static void bench(const char *name,
+                const std::vector<uint256_t> &keys,
+                const std::vector<uint256_t> &absent) {
+    Map m;
+    size_t n = keys.size();
+    uint64_t found = 0;
+    double t_ins = timed([&]() {
+        for (size_t i = 0; i < n; i++)
+            m.insert(std::make_pair(keys[i], (uint64_t)i));
+    });
+    double t_hit = timed([&]() {
+        for (const auto &k: keys)
+        {
+            auto it = m.find(k);
+            if (it != m.end()) found += it->second;
+        }
+    });
+    double t_miss = timed([&]() {
+        for (const auto &k: absent)
+            found += m.count(k);
+    });
+    double t_del = timed([&]() {
+        for (const auto &k: keys)
+            m.erase(k);
+    });
+    printf("%-14s insert %6.1f  hit %6.1f  miss %6.1f  erase %6.1f ns/op (%lu)\n",
+            name, t_ins / n * 1e9, t_hit / n * 1e9,
+            t_miss / n * 1e9, t_del / n * 1e9, found);
+}
+
+int main(int argc, char **argv) {
+    size_t n = argc > 1 ? strtoul(argv[1], nullptr, 10) : 4000000;
+    auto keys = gen_keys(n, 1);
+    auto absent = gen_keys(n, 2);
+    printf("%lu entries\n", n);
+    bench<std::unordered_map<const uint256_t, uint64_t>>("unordered_map", keys, absent);
+    bench<FlatHashMap<uint256_t, uint64_t>>("FlatHashMap", keys, absent);
+    return 0;
+}
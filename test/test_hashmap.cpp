@@ -0,0 +1,136 @@
+/**
+ * Copyright 2018 VMware
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cstdio>
+#include <random>
+#include <unordered_map>
+
+#include "hotstuff/hashmap.h"
+
+using namespace hotstuff;
+
+/* checks FlatHashMap against std::unordered_map under random inserts, finds
+ * and erases, over a small key space so that slots are erased and reused
+ * many times */
+
+/* spreads the keys over the whole table */
+struct MixHash {
+    size_t operator()(uint64_t k) const {
+        k ^= k >> 33;
+        k *= 0xff51afd7ed558ccdULL;
+        k ^= k >> 33;
+        return k;
+    }
+};
+
+/* few distinct hashes (and one tag): long probes through full groups,
+ * where erased slots become tombstones */
+struct WeakHash {
+    size_t operator()(uint64_t k) const { return k % 3; }
+};
+
+static int nfailed = 0;
+
+static void check(bool cond, const char *name, const char *what, size_t step) {
+    if (cond) return;
+    printf("%s: %s at step %lu\n", name, what, step);
+    nfailed++;
+}
+
+template<typename Hash>
+static void run(const char *name, uint64_t nkeys, size_t nsteps, uint64_t seed) {
+    FlatHashMap<uint64_t, uint64_t, Hash> m;
+    std::unordered_map<uint64_t, uint64_t> ref;
+    std::mt19937_64 rng(seed);
+    for (size_t step = 0; step < nsteps && !nfailed; step++)
+    {
+        uint64_t k = rng() % nkeys;
+        switch (rng() % 4)
+        {
+            case 0: {
+                /* insert keeps an existing value */
+                uint64_t v = rng();
+                bool ins = m.insert(std::make_pair(k, v)).second;
+                check(ins == ref.insert(std::make_pair(k, v)).second,
+                        name, "insert", step);
+                break;
+            }
+            case 1:
+                m[k] = step;
+                ref[k] = step;
+                break;
+            case 2:
+                check(m.erase(k) == ref.erase(k), name, "erase", step);
+                break;
+            case 3: {
+                auto it = m.find(k);
+                auto rit = ref.find(k);
+                check((it == m.end()) == (rit == ref.end()), name, "find", step);
+                if (it != m.end() && rit != ref.end())
+                    check(it->first == k && it->second == rit->second,
+                            name, "find value", step);
+                break;
+            }
+        }
+        check(m.size() == ref.size(), name, "size", step);
+        /* a full comparison now and then */
+        if (step % 997 == 0)
+        {
+            size_t n = 0;
+            for (const auto &p: m)
+            {
+                auto rit = ref.find(p.first);
+                check(rit != ref.end() && rit->second == p.second,
+                        name, "iteration", step);
+                n++;
+            }
+            check(n == ref.size(), name, "iteration count", step);
+            for (const auto &p: ref)
+                check(m.count(p.first) == 1, name, "count", step);
+        }
+    }
+    /* erasing while iterating */
+    for (auto it = m.begin(); it != m.end();)
+    {
+        if (it->first & 1)
+        {
+            ref.erase(it->first);
+            it = m.erase(it);
+        }
+        else
+            it++;
+    }
+    check(m.size() == ref.size(), name, "erase while iterating", nsteps);
+    for (const auto &p: ref)
+        check(m.count(p.first) == 1, name, "erase while iterating", nsteps);
+    /* every slot freed and taken again */
+    for (uint64_t k = 0; k < nkeys; k++) m.erase(k);
+    check(m.empty(), name, "empty", nsteps);
+    for (uint64_t k = 0; k < nkeys; k++) m[k] = k;
+    for (uint64_t k = 0; k < nkeys; k++)
+    {
+        auto it = m.find(k);
+        check(it != m.end() && it->second == k, name, "refill", nsteps);
+    }
+    printf("%-8s %s\n", name, nfailed ? "failed" : "ok");
+}
+
+int main() {
+    run<MixHash>("mix", 5000, 2000000, 1);
+    run<MixHash>("small", 40, 200000, 2);
+    run<WeakHash>("weak", 300, 200000, 3);
+    return nfailed ? 1 : 0;
+}
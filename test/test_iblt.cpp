@@ -0,0 +1,106 @@
+/**
+ * Copyright 2018 VMware
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cstdio>
+#include <map>
+#include <random>
+
+#include "hotstuff/iblt.h"
+
+using namespace hotstuff;
+
+/* checks that the difference of two random sets sharing most elements is
+ * listed exactly by IBLT::decode(), on the right sides and with the right
+ * values, and that a difference too large for the table is refused rather
+ * than listed wrong */
+
+using elems_t = std::map<bytearray_t, uint32_t>;
+
+static int nfailed = 0;
+
+static uint256_t random_hash(std::mt19937_64 &rng) {
+    bytearray_t b(32);
+    for (auto &x: b) x = rng();
+    return uint256_t(b);
+}
+
+static elems_t to_elems(const std::vector<std::pair<uint256_t, uint32_t>> &v) {
+    elems_t m;
+    for (const auto &p: v) m[bytearray_t(p.first)] = p.second;
+    return m;
+}
+
+/* @return how many of the trials could be decoded */
+static size_t run(const char *name, size_t ncommon, size_t ndiff,
+                    size_t ncells, size_t ntrials, uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    size_t ndecoded = 0;
+    for (size_t t = 0; t < ntrials; t++)
+    {
+        uint64_t salt = rng();
+        IBLT a(ncells, salt), b(ncells, salt);
+        for (size_t i = 0; i < ncommon; i++)
+        {
+            auto h = random_hash(rng);
+            uint32_t v = rng();
+            a.insert(h, v);
+            b.insert(h, v);
+        }
+        elems_t only_a, only_b;
+        for (size_t i = 0; i < ndiff; i++)
+        {
+            auto h = random_hash(rng);
+            uint32_t v = rng();
+            if (rng() & 1)
+            {
+                a.insert(h, v);
+                only_a[bytearray_t(h)] = v;
+            }
+            else
+            {
+                b.insert(h, v);
+                only_b[bytearray_t(h)] = v;
+            }
+        }
+        a.subtract(b);
+        std::vector<std::pair<uint256_t, uint32_t>> mine, theirs;
+        if (!a.decode(mine, theirs)) continue;
+        ndecoded++;
+        if (mine.size() != only_a.size() || to_elems(mine) != only_a ||
+            theirs.size() != only_b.size() || to_elems(theirs) != only_b)
+        {
+            printf("%s: wrong difference in trial %lu\n", name, t);
+            nfailed++;
+        }
+    }
+    printf("%-8s decoded %lu/%lu\n", name, ndecoded, ntrials);
+    return ndecoded;
+}
+
+int main() {
+    if (run("none", 1000, 0, 96, 10, 1) != 10) nfailed++;
+    /* sized as reconciliation does: two cells per difference */
+    for (size_t ndiff: {10, 48, 200, 1000})
+    {
+        size_t ntrials = 100;
+        if (run("sized", 1000, ndiff, std::max((size_t)96, 2 * ndiff),
+                ntrials, ndiff) < ntrials * 9 / 10)
+            nfailed++;
+    }
+    /* far too small a table: refused, never listed wrong */
+    run("small", 1000, 400, 96, 100, 7);
+    return nfailed ? 1 : 0;
+}